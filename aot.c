@@ -0,0 +1,122 @@
+#include <stdarg.h>
+
+#include "ownlisp.h"
+
+/* Runtime support for modules compiled ahead of time by lspyc.
+ *
+ * A compiled module is a loader that builds the forms of the file and
+ * evaluates them one by one, exactly like ast_load_eval, so it only saves
+ * reading and parsing. After each definition of a lambda the loader checks
+ * that the name is bound to a lambda with the expected parameters and body
+ * and attaches the translated body to its code, which lambda_call and the
+ * VM then run instead of the bytecode. Calls to other lambdas of the module
+ * go straight to their C function while the name still holds the same
+ * value; anything else takes the generic path. */
+
+typedef struct {
+    char *file;
+    aot_loader load;
+} aot_module;
+
+int aot_enabled = 1;
+
+static aot_module *aot_table = NULL;
+static int aot_count = 0;
+
+void aot_init(void) {
+    char *s = getenv("OWNLISP_AOT");
+    if (s) aot_enabled = strtol(s, NULL, 10) != 0;
+}
+
+void aot_register(char *file, aot_loader load) {
+    aot_table = realloc(aot_table, sizeof(aot_module) * (aot_count + 1));
+    aot_table[aot_count].file = file;
+    aot_table[aot_count].load = load;
+    aot_count++;
+}
+
+aot_loader aot_find(char *file) {
+    int i;
+    if (!aot_enabled) return NULL;
+    for (i = 0; i < aot_count; ++i) {
+        if (!strcmp(aot_table[i].file, file)) return aot_table[i].load;
+    }
+    return NULL;
+}
+
+/* an expression of type holding the n values that follow, consumed */
+lval * aot_list(int type, int n, ...) {
+    int i;
+    lval *r;
+    va_list ap;
+
+    if (type == LVAL_QEXPR && n == 0) return lval_nil();
+    r = type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+    va_start(ap, n);
+    for (i = 0; i < n; ++i) lval_append(r, va_arg(ap, lval*));
+    va_end(ap);
+    return r;
+}
+
+/* calls s[0] with the n - 1 values after it, consuming all of them */
+lval * aot_call(lval **s, int n, lenv *env) {
+    lval *r;
+    expr *args;
+
+    if (s[0]->type == LVAL_BUILTIN && s[0]->builtin) {
+        r = s[0]->builtin(s + 1, n - 1, env);
+        args_release(s + 1, n - 1);
+        lval_del(s[0]);
+        return r;
+    }
+
+    args = expr_new(n - 1);
+    if (n > 1) memcpy(args->cell, s + 1, sizeof(lval*) * (n - 1));
+    r = lval_call(s[0], args, env);
+    expr_del(args);
+    return r;
+}
+
+/* Binds the n - 1 values after the lambda s[0] in a fresh frame for it,
+ * consuming all of them. Returns NULL, consuming nothing, unless that is a
+ * plain call with exactly one value per parameter. */
+lenv * aot_frame(lval **s, int n) {
+    int i;
+    lenv *r;
+    lambda *fun = s[0]->fun;
+
+    if (
+        fun->env->count || !fun->code ||
+        fun->code->nparams != n - 1 || fun->args->expr->count != n - 1
+    ) {
+        return NULL;
+    }
+
+    r = lenv_copy(fun->env);
+    for (i = 0; i < n - 1; ++i) lenv_set(r, fun->code->params[i], s[i + 1]);
+    r->fixed = r->count;
+    lval_del(s[0]);
+    return r;
+}
+
+/* Attaches fn to the lambda bound to name if it was defined with args and
+ * body, keeping it in *known for direct calls. */
+void aot_attach(
+    lenv *env, char *name, lval *args, lval *body,
+    aot_fn fn, lval **known
+) {
+    lval *v = lenv_get(env, sym_intern(name));
+
+    if (
+        v->type != LVAL_LAMBDA || !v->fun->code || v->fun->env->count ||
+        !expr_eq(v->fun->args->expr, args->expr) ||
+        !expr_eq(v->fun->body->expr, body->expr)
+    ) {
+        lval_del(v);
+        return;
+    }
+
+    v->fun->code->aot = fn;
+    if (*known) lval_del(*known);
+    *known = v;
+}
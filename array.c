@@ -0,0 +1,366 @@
+#include "ownlisp.h"
+
+/* Kernels for packed arrays of 64 bit integers.
+ *
+ * Each operation has a plain C version and, on x86-64, SSE2 and AVX2
+ * versions built with target attributes so the rest of the program does
+ * not need -mavx2. array_init picks the widest set the CPU supports, or
+ * the one asked for with OWNLISP_SIMD (0 plain C, 1 SSE2, 2 AVX2).
+ * Arithmetic wraps around like the + and * builtins. SSE2 has no 64 bit
+ * comparison, so its min, max and filter are the plain ones. */
+
+typedef struct {
+    long (*sum)(long *x, int n);
+    long (*min)(long *x, int n);
+    long (*max)(long *x, int n);
+    void (*add)(long *r, long *x, long y, int n);
+    void (*add_array)(long *r, long *x, long *y, int n);
+    long (*dot)(long *x, long *y, int n);
+    int (*filter_lt)(long *r, long *x, long y, int n);
+} array_kernels;
+
+/* plain C */
+
+static long plain_sum(long *x, int n) {
+    int i;
+    unsigned long r = 0;
+    for (i = 0; i < n; ++i) r += (unsigned long)x[i];
+    return (long)r;
+}
+
+static long plain_min(long *x, int n) {
+    int i;
+    long r = x[0];
+    for (i = 1; i < n; ++i) if (x[i] < r) r = x[i];
+    return r;
+}
+
+static long plain_max(long *x, int n) {
+    int i;
+    long r = x[0];
+    for (i = 1; i < n; ++i) if (x[i] > r) r = x[i];
+    return r;
+}
+
+static void plain_add(long *r, long *x, long y, int n) {
+    int i;
+    for (i = 0; i < n; ++i) r[i] = (long)((unsigned long)x[i] + y);
+}
+
+static void plain_add_array(long *r, long *x, long *y, int n) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        r[i] = (long)((unsigned long)x[i] + (unsigned long)y[i]);
+    }
+}
+
+static long plain_dot(long *x, long *y, int n) {
+    int i;
+    unsigned long r = 0;
+    for (i = 0; i < n; ++i) r += (unsigned long)x[i] * (unsigned long)y[i];
+    return (long)r;
+}
+
+static int plain_filter_lt(long *r, long *x, long y, int n) {
+    int i;
+    int m = 0;
+    for (i = 0; i < n; ++i) if (x[i] < y) r[m++] = x[i];
+    return m;
+}
+
+static array_kernels array_plain = {
+    plain_sum, plain_min, plain_max, plain_add, plain_add_array,
+    plain_dot, plain_filter_lt
+};
+
+static array_kernels *array_k = &array_plain;
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+/* SSE2, two values at a time */
+
+static long sse2_hsum(__m128i v) {
+    long t[2];
+    _mm_storeu_si128((__m128i *)t, v);
+    return (long)((unsigned long)t[0] + (unsigned long)t[1]);
+}
+
+/* low 64 bits of the lane products, from 32 bit multiplies */
+static __m128i sse2_mul(__m128i a, __m128i b) {
+    __m128i lo = _mm_mul_epu32(a, b);
+    __m128i cross = _mm_add_epi64(
+        _mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+        _mm_mul_epu32(a, _mm_srli_epi64(b, 32))
+    );
+    return _mm_add_epi64(lo, _mm_slli_epi64(cross, 32));
+}
+
+static long sse2_sum(long *x, int n) {
+    int i;
+    __m128i a = _mm_setzero_si128();
+    __m128i b = _mm_setzero_si128();
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        a = _mm_add_epi64(a, _mm_loadu_si128((__m128i *)(x + i)));
+        b = _mm_add_epi64(b, _mm_loadu_si128((__m128i *)(x + i + 2)));
+    }
+    return (long)(
+        (unsigned long)sse2_hsum(_mm_add_epi64(a, b)) +
+        (unsigned long)plain_sum(x + i, n - i)
+    );
+}
+
+static void sse2_add(long *r, long *x, long y, int n) {
+    int i;
+    __m128i v = _mm_set1_epi64x(y);
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        _mm_storeu_si128(
+            (__m128i *)(r + i),
+            _mm_add_epi64(_mm_loadu_si128((__m128i *)(x + i)), v)
+        );
+    }
+    plain_add(r + i, x + i, y, n - i);
+}
+
+static void sse2_add_array(long *r, long *x, long *y, int n) {
+    int i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        _mm_storeu_si128(
+            (__m128i *)(r + i),
+            _mm_add_epi64(
+                _mm_loadu_si128((__m128i *)(x + i)),
+                _mm_loadu_si128((__m128i *)(y + i))
+            )
+        );
+    }
+    plain_add_array(r + i, x + i, y + i, n - i);
+}
+
+static long sse2_dot(long *x, long *y, int n) {
+    int i;
+    __m128i a = _mm_setzero_si128();
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        a = _mm_add_epi64(a, sse2_mul(
+            _mm_loadu_si128((__m128i *)(x + i)),
+            _mm_loadu_si128((__m128i *)(y + i))
+        ));
+    }
+    return (long)(
+        (unsigned long)sse2_hsum(a) +
+        (unsigned long)plain_dot(x + i, y + i, n - i)
+    );
+}
+
+static array_kernels array_sse2 = {
+    sse2_sum, plain_min, plain_max, sse2_add, sse2_add_array,
+    sse2_dot, plain_filter_lt
+};
+
+/* AVX2, four values at a time */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static long avx2_hsum(__m256i v) {
+    long t[4];
+    _mm256_storeu_si256((__m256i *)t, v);
+    return (long)(
+        (unsigned long)t[0] + (unsigned long)t[1] +
+        (unsigned long)t[2] + (unsigned long)t[3]
+    );
+}
+
+AVX2 static __m256i avx2_mul(__m256i a, __m256i b) {
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+        _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32))
+    );
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+AVX2 static long avx2_sum(long *x, int n) {
+    int i;
+    __m256i a = _mm256_setzero_si256();
+    __m256i b = _mm256_setzero_si256();
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        a = _mm256_add_epi64(a, _mm256_loadu_si256((__m256i *)(x + i)));
+        b = _mm256_add_epi64(b, _mm256_loadu_si256((__m256i *)(x + i + 4)));
+    }
+    return (long)(
+        (unsigned long)avx2_hsum(_mm256_add_epi64(a, b)) +
+        (unsigned long)plain_sum(x + i, n - i)
+    );
+}
+
+/* the lanes of v reduced to one with pick, then x[i..n) with it */
+#define AVX2_PICK(v, x, i, n, pick)                                            \
+do {                                                                           \
+    long t[4];                                                                 \
+    int j;                                                                     \
+    _mm256_storeu_si256((__m256i *)t, v);                                      \
+    r = t[0];                                                                  \
+    for (j = 1; j < 4; ++j) if (t[j] pick r) r = t[j];                         \
+    for (; i < n; ++i) if (x[i] pick r) r = x[i];                              \
+} while (0)
+
+AVX2 static long avx2_min(long *x, int n) {
+    int i;
+    long r;
+    __m256i v;
+    __m256i m;
+
+    if (n < 4) return plain_min(x, n);
+    m = _mm256_loadu_si256((__m256i *)x);
+    for (i = 4; i + 4 <= n; i += 4) {
+        v = _mm256_loadu_si256((__m256i *)(x + i));
+        m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(m, v));
+    }
+    AVX2_PICK(m, x, i, n, <);
+    return r;
+}
+
+AVX2 static long avx2_max(long *x, int n) {
+    int i;
+    long r;
+    __m256i v;
+    __m256i m;
+
+    if (n < 4) return plain_max(x, n);
+    m = _mm256_loadu_si256((__m256i *)x);
+    for (i = 4; i + 4 <= n; i += 4) {
+        v = _mm256_loadu_si256((__m256i *)(x + i));
+        m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(v, m));
+    }
+    AVX2_PICK(m, x, i, n, >);
+    return r;
+}
+
+#undef AVX2_PICK
+
+AVX2 static void avx2_add(long *r, long *x, long y, int n) {
+    int i;
+    __m256i v = _mm256_set1_epi64x(y);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        _mm256_storeu_si256(
+            (__m256i *)(r + i),
+            _mm256_add_epi64(_mm256_loadu_si256((__m256i *)(x + i)), v)
+        );
+    }
+    plain_add(r + i, x + i, y, n - i);
+}
+
+AVX2 static void avx2_add_array(long *r, long *x, long *y, int n) {
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        _mm256_storeu_si256(
+            (__m256i *)(r + i),
+            _mm256_add_epi64(
+                _mm256_loadu_si256((__m256i *)(x + i)),
+                _mm256_loadu_si256((__m256i *)(y + i))
+            )
+        );
+    }
+    plain_add_array(r + i, x + i, y + i, n - i);
+}
+
+AVX2 static long avx2_dot(long *x, long *y, int n) {
+    int i;
+    __m256i a = _mm256_setzero_si256();
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        a = _mm256_add_epi64(a, avx2_mul(
+            _mm256_loadu_si256((__m256i *)(x + i)),
+            _mm256_loadu_si256((__m256i *)(y + i))
+        ));
+    }
+    return (long)(
+        (unsigned long)avx2_hsum(a) +
+        (unsigned long)plain_dot(x + i, y + i, n - i)
+    );
+}
+
+AVX2 static int avx2_filter_lt(long *r, long *x, long y, int n) {
+    int i;
+    int j;
+    int m = 0;
+    int mask;
+    __m256i v;
+    __m256i bound = _mm256_set1_epi64x(y);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        v = _mm256_loadu_si256((__m256i *)(x + i));
+        mask = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(bound, v))
+        );
+        if (mask == 0xf) {
+            _mm256_storeu_si256((__m256i *)(r + m), v);
+            m += 4;
+            continue;
+        }
+        for (j = 0; j < 4; ++j) if (mask & (1 << j)) r[m++] = x[i + j];
+    }
+    return m + plain_filter_lt(r + m, x + i, y, n - i);
+}
+
+#undef AVX2
+
+static array_kernels array_avx2 = {
+    avx2_sum, avx2_min, avx2_max, avx2_add, avx2_add_array,
+    avx2_dot, avx2_filter_lt
+};
+
+void array_init(void) {
+    char *s = getenv("OWNLISP_SIMD");
+    long level = s ? strtol(s, NULL, 10) : 2;
+
+    __builtin_cpu_init();
+    if (level >= 2 && __builtin_cpu_supports("avx2")) array_k = &array_avx2;
+    else if (level >= 1) array_k = &array_sse2;
+    else array_k = &array_plain;
+}
+
+#else /* no SIMD kernels */
+
+void array_init(void) {
+}
+
+#endif
+
+long array_sum(long *x, int n) {
+    return array_k->sum(x, n);
+}
+
+/* n > 0 */
+long array_min(long *x, int n) {
+    return array_k->min(x, n);
+}
+
+/* n > 0 */
+long array_max(long *x, int n) {
+    return array_k->max(x, n);
+}
+
+void array_add(long *r, long *x, long y, int n) {
+    array_k->add(r, x, y, n);
+}
+
+void array_add_array(long *r, long *x, long *y, int n) {
+    array_k->add_array(r, x, y, n);
+}
+
+long array_dot(long *x, long *y, int n) {
+    return array_k->dot(x, y, n);
+}
+
+/* stores the values of x below y in r and returns how many there are */
+int array_filter_lt(long *r, long *x, long y, int n) {
+    return array_k->filter_lt(r, x, y, n);
+}
@@ -1,6 +1,43 @@
 #include "ownlisp.h"
 mpc_parser_t *Lispy;
 
+static mpc_parser_t *Number;
+static mpc_parser_t *Symbol;
+static mpc_parser_t *String;
+static mpc_parser_t *Comment;
+static mpc_parser_t *Sexpr;
+static mpc_parser_t *Qexpr;
+static mpc_parser_t *Expr;
+
+void ast_init(void) {
+    Number = mpc_new("number");
+    Symbol = mpc_new("symbol");
+    String = mpc_new("string");
+    Comment = mpc_new("comment");
+    Sexpr = mpc_new("sexpr");
+    Qexpr = mpc_new("qexpr");
+    Expr = mpc_new("expr");
+    Lispy = mpc_new("lispy");
+
+    mpca_lang(
+        MPC_LANG_DEFAULT,
+        "number   :  /-?[0-9]+/ ;"
+        "symbol   :  /[a-zA-Z0-9_+\\-*\\/\%\\\\=<>!&|?]+/ ;"
+        "string   :  /\"(\\\\.|[^\"])*\"/ ;"
+        "comment  :  /;[^\\r\\n]*/ ;"
+        "sexpr    :  '(' <expr>* ')' ;"
+        "qexpr    :  '{' <expr>* '}' ;"
+        "expr     :  <number> | <symbol> | <string>"
+        "         |  <comment> | <sexpr> | <qexpr> ;"
+        "lispy    :  /^/ <expr>* /$/ ;",
+        Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy
+    );
+}
+
+void ast_cleanup(void) {
+    mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+}
+
 lval * ast_read_num(mpc_ast_t *t) {
     assert(strstr(t->tag, "number"));
     long x = strtol(t->contents, NULL, 10);
@@ -61,6 +98,11 @@ lval * ast_read(mpc_ast_t *t) {
         if(v) lval_append(x, v);
     }
 
+    if (x->type == LVAL_QEXPR && x->expr->count == 0) {
+        lval_del(x);
+        return lval_nil();
+    }
+
     return x;
 }
 
@@ -69,6 +111,9 @@ lval * ast_load_eval(char* fn, lenv *env) {
     mpc_result_t parsed;
     lval *ast;
     lval *result;
+    aot_loader load = aot_find(fn);
+
+    if (load) return load(env);
 
     if (mpc_parse_contents(fn, Lispy, &parsed)) {
         ast = ast_read(parsed.output);
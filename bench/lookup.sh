@@ -0,0 +1,29 @@
+#!/usr/bin/env bash
+# global lookup microbenchmark: ./bench/lookup.sh [prompt binary]
+# times a lookup-heavy loop with 10, 100 and 10000 globals defined; the
+# "setup" run only loads the definitions, so the difference is the loop
+
+PROMPT=${1:-./prompt}
+DEFS=${TMPDIR:-/tmp}/ownlisp-defs.lspy
+LOOP=${TMPDIR:-/tmp}/ownlisp-loop.lspy
+
+for n in 10 100 10000; do
+    {
+        echo '(load "std.lspy")'
+        for ((i = 1; i <= n; ++i)); do
+            echo "(def {v$i} $i)"
+        done
+    } > "$DEFS"
+    {
+        cat "$DEFS"
+        echo "(fun {loop k} {if (> k 0) {do (+ v1 v$n v1 v$n v1 v$n v1 v$n) (loop (- k 1))} {k}})"
+        for ((i = 0; i < 2000; ++i)); do
+            echo "(loop 20)"
+        done
+    } > "$LOOP"
+    echo "$n definitions:"
+    ( time "$PROMPT" "$DEFS" > /dev/null ) 2>&1 | grep real | sed 's/real/setup/'
+    ( time "$PROMPT" "$LOOP" > /dev/null ) 2>&1 | grep real | sed 's/real/loop /'
+done
+
+rm -f "$DEFS" "$LOOP"
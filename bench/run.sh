@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+# times each benchmark with the tree walker, the bytecode vm, the vm with
+# std.lspy compiled ahead of time and the jit:
+# ./bench/run.sh [prompt binary]
+# a run that prints an error is reported as failed instead of timed, and
+# makes the script fail
+
+PROMPT=${1:-./prompt}
+DIR=$(dirname "$0")
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+failed=0
+
+# times benchmark $1 run with the environment variable $2
+run() {
+    printf '%-7s %-17s ' "$1" "$2"
+    t=$( ( time env $2 "$PROMPT" "$DIR/$1.lspy" > "$OUT" ) 2>&1 \
+        | grep real | sed 's/real[[:space:]]*//' )
+    if grep -q '^ERROR' "$OUT"; then
+        echo "FAILED: $(grep -m 1 '^ERROR' "$OUT")"
+        failed=1
+    else
+        echo "$t"
+    fi
+}
+
+for b in fib map filter vec fuse par; do
+    for mode in OWNLISP_VM=0 OWNLISP_AOT=0 OWNLISP_VM=1 OWNLISP_JIT=1; do
+        run $b $mode
+    done
+done
+
+# the parallel list functions against the sequential ones
+run par OWNLISP_THREADS=1
+
+exit $failed
@@ -1,38 +1,30 @@
+#include <limits.h>
+
 #include "ownlisp.h"
 
+/* Builtins read their arguments in place, see lprim: they only take one
+ * out of the span to return it or to modify it. */
+
 #define BUILTIN_CMP(cmp)                                                       \
     do {                                                                       \
-        lval *fst;                                                             \
-        lval *cur;                                                             \
-                                                                               \
-        if(this->count < 2) return LERR_BAD_ARITY;                             \
+        int i;                                                                 \
                                                                                \
-        fst = expr_pop(this, 0);                                               \
-        if (fst->type == LVAL_ERR) return fst;                                 \
+        if(count < 2) return LERR_BAD_ARITY;                                   \
+        if (args[0]->type == LVAL_ERR) return lval_ref(args[0]);               \
                                                                                \
-        while(this->count) {                                                   \
-            cur = expr_pop(this, 0);                                           \
-            if (cur->type == LVAL_ERR) {                                       \
-                lval_del(fst);                                                 \
-                return cur;                                                    \
-            }                                                                  \
-            if (cmp(fst, cur)) {                                               \
-                lval_del(fst);                                                 \
-                lval_del(cur);                                                 \
-                return lval_boolean(0);                                        \
-            }                                                                  \
-            lval_del(cur);                                                     \
+        for(i = 1; i < count; ++i) {                                           \
+            if (args[i]->type == LVAL_ERR) return lval_ref(args[i]);           \
+            if (cmp(args[0], args[i])) return lval_boolean(0);                 \
         }                                                                      \
                                                                                \
-        lval_del(fst);                                                         \
         return lval_boolean(1);                                                \
     } while(0)
 
-lval * builtin_eq(expr *this, lenv *env) {
+lval * builtin_eq(lval **args, int count, lenv *env) {
     BUILTIN_CMP(!lval_eq);
 }
 
-lval * builtin_ne(expr *this, lenv *env) {
+lval * builtin_ne(lval **args, int count, lenv *env) {
     BUILTIN_CMP(lval_eq);
 }
 
@@ -40,122 +32,92 @@ lval * builtin_ne(expr *this, lenv *env) {
 
 #define BUILTIN_FOLD(init, op)                                                 \
 do {                                                                           \
-    lval *c;                                                                   \
-    lval *r = lval_num(init);                                                  \
+    int i;                                                                     \
+    long r = init;                                                             \
+    lval *e = args_check(args, 0, count, LVAL_NUM);                            \
+    if (e) return e;                                                           \
                                                                                \
-    while(this->count) {                                                       \
-        c = expr_pop_num(this);                                                \
-        if (c->type == LVAL_ERR) {                                             \
-            lval_del(r);                                                       \
-            return c;                                                          \
-        }                                                                      \
-        r->num op c->num;                                                      \
-        lval_del(c);                                                           \
+    for(i = 0; i < count; ++i) {                                               \
+        r op args[i]->num;                                                     \
     }                                                                          \
                                                                                \
-    return r;                                                                  \
+    return lval_num(r);                                                        \
 } while(0)
 
-lval * builtin_plus(expr *this, lenv *env) {
+lval * builtin_plus(lval **args, int count, lenv *env) {
     BUILTIN_FOLD(0, +=);
 }
 
-lval * builtin_mul(expr *this, lenv *env) {
+lval * builtin_mul(lval **args, int count, lenv *env) {
     BUILTIN_FOLD(1, *=);
 }
 
 #undef BUILTIN_FOLD
 
-lval * builtin_minus(expr *this, lenv *env) {
-    lval *c;
-    lval *r;
+lval * builtin_minus(lval **args, int count, lenv *env) {
+    int i = 0;
+    long r = 0;
+    lval *e = args_check(args, 0, count, LVAL_NUM);
+    if (e) return e;
 
-    if  (this->count > 1) {
-        r = expr_pop_num(this);
-        if (r->type == LVAL_ERR) return r;
-    }
-    else {
-        r = lval_num(0);
-    }
+    if (count > 1) r = args[i++]->num;
 
-    while(this->count) {
-        c = expr_pop_num(this);
-        if (c->type == LVAL_ERR) {
-            lval_del(r);
-            return c;
-        }
-        r->num -= c->num;
-        lval_del(c);
+    for(; i < count; ++i) {
+        r -= args[i]->num;
     }
 
-    return r;
+    return lval_num(r);
 }
 
-#define BUILTIN_DIV(op)                                                        \
+/* dividing LONG_MIN by -1 overflows, so -1 gets its own result */
+#define BUILTIN_DIV(op, by_minus_one)                                          \
 do {                                                                           \
-    if(this->count != 2) return LERR_BAD_ARITY;                                \
+    if(count != 2) return LERR_BAD_ARITY;                                      \
                                                                                \
-    lval *left = expr_pop_num(this);                                           \
-    if (left->type == LVAL_ERR) return left;                                   \
-    lval *right = expr_pop_num(this);                                          \
-    if (right->type == LVAL_ERR) {                                             \
-        lval_del(left);                                                        \
-        return right;                                                          \
-    }                                                                          \
+    lval *e = args_check(args, 0, 2, LVAL_NUM);                                \
+    if (e) return e;                                                           \
                                                                                \
-    if (right->num == 0) {                                                     \
-        lval_del(left); lval_del(right);                                       \
-        return LERR_DIV_ZERO;                                                  \
-    }                                                                          \
+    if (args[1]->num == 0) return LERR_DIV_ZERO;                               \
+    if (args[1]->num == -1) return by_minus_one;                               \
                                                                                \
-    left->num op right->num;                                                   \
-    return left;                                                               \
+    return lval_num(args[0]->num op args[1]->num);                             \
 } while(0)
 
-lval * builtin_div(expr *this, lenv *env) {
-    BUILTIN_DIV(/=);
+lval * builtin_div(lval **args, int count, lenv *env) {
+    BUILTIN_DIV(/, args[0]->num == LONG_MIN ?
+        LERR_OVERFLOW : lval_num(-args[0]->num));
 }
 
-lval * builtin_mod(expr *this, lenv *env) {
-    BUILTIN_DIV(%=);
+lval * builtin_mod(lval **args, int count, lenv *env) {
+    BUILTIN_DIV(%, lval_num(0));
 }
 
 #undef BUILTIN_DIV
 
 #define BUILTIN_PICK(cmp)                                                      \
 do {                                                                           \
-    lval *c;                                                                   \
-    lval *r;                                                                   \
+    int i;                                                                     \
+    int r = 0;                                                                 \
+    lval *e;                                                                   \
                                                                                \
-    if(this->count < 1) return LERR_BAD_ARITY;                                 \
+    if(count < 1) return LERR_BAD_ARITY;                                       \
                                                                                \
-    r = expr_pop_num(this);                                                    \
-    if (r->type == LVAL_ERR) return r;                                         \
+    e = args_check(args, 0, count, LVAL_NUM);                                  \
+    if (e) return e;                                                           \
                                                                                \
-    while(this->count) {                                                       \
-        c = expr_pop_num(this);                                                \
-        if (c->type == LVAL_ERR) {                                             \
-            lval_del(r);                                                       \
-            return c;                                                          \
-        }                                                                      \
-        if(c->num cmp r->num) {                                                \
-            lval_del(r);                                                       \
-            r = c;                                                             \
-        }                                                                      \
-        else {                                                                 \
-            lval_del(c);                                                       \
-        }                                                                      \
+    for(i = 1; i < count; ++i) {                                               \
+        if(args[i]->num cmp args[r]->num) r = i;                               \
     }                                                                          \
                                                                                \
-    return r;                                                                  \
+    return args_take(args, r);                                                 \
 } while(0)
 
 
-lval * builtin_min(expr *this, lenv *env) {
+lval * builtin_min(lval **args, int count, lenv *env) {
     BUILTIN_PICK(<);
 }
 
-lval * builtin_max(expr *this, lenv *env) {
+lval * builtin_max(lval **args, int count, lenv *env) {
     BUILTIN_PICK(>);
 }
 
@@ -163,427 +125,1362 @@ lval * builtin_max(expr *this, lenv *env) {
 
 #define BUILTIN_ORD(cmp)                                                       \
     do {                                                                       \
-        lval *fst;                                                             \
-        lval *cur;                                                             \
+        int i;                                                                 \
+        lval *e;                                                               \
                                                                                \
-        if(this->count < 2) return LERR_BAD_ARITY;                             \
+        if(count < 2) return LERR_BAD_ARITY;                                   \
                                                                                \
-        fst = expr_pop_num(this);                                              \
-        if (fst->type == LVAL_ERR) return fst;                                 \
+        e = args_check(args, 0, 1, LVAL_NUM);                                  \
+        if (e) return e;                                                       \
                                                                                \
-        while(this->count) {                                                   \
-            cur = expr_pop_num(this);                                          \
-            if (cur->type == LVAL_ERR) {                                       \
-                lval_del(fst);                                                 \
-                return cur;                                                    \
-            }                                                                  \
-            if (cur->num cmp fst->num) {                                       \
-                lval_del(fst);                                                 \
-                lval_del(cur);                                                 \
-                return lval_boolean(0);                                        \
-            }                                                                  \
-            lval_del(cur);                                                     \
+        for(i = 1; i < count; ++i) {                                           \
+            e = args_check(args, i, i + 1, LVAL_NUM);                          \
+            if (e) return e;                                                   \
+            if (args[i]->num cmp args[0]->num) return lval_boolean(0);         \
         }                                                                      \
                                                                                \
-        lval_del(fst);                                                         \
         return lval_boolean(1);                                                \
     } while(0)
 
-lval * builtin_lt(expr *this, lenv *env) {
+lval * builtin_lt(lval **args, int count, lenv *env) {
     BUILTIN_ORD(<=);
 }
 
-lval * builtin_le(expr *this, lenv *env) {
+lval * builtin_le(lval **args, int count, lenv *env) {
     BUILTIN_ORD(<);
 }
 
-lval * builtin_gt(expr *this, lenv *env) {
+lval * builtin_gt(lval **args, int count, lenv *env) {
     BUILTIN_ORD(>=);
 }
 
-lval * builtin_ge(expr *this, lenv *env) {
+lval * builtin_ge(lval **args, int count, lenv *env) {
     BUILTIN_ORD(>);
 }
 
 #undef BUILTIN_ORD
 
-lval * builtin_head(expr *this, lenv *env) {
-    if(this->count != 1) return LERR_BAD_ARITY;
+/* a Q-Expression holding e */
+static lval * builtin_qexpr(expr *e) {
+    lval *r = lval_qexpr();
+    expr_del(r->expr);
+    r->expr = e;
+    return r;
+}
+
+lval * builtin_head(lval **args, int count, lenv *env) {
+    lval *r;
 
-    lval *r = expr_pop_qexpr(this);
-    if (r->type == LVAL_ERR) return r;
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
 
-    if (r->expr->count == 0) {
-        lval_del(r);
-        return LERR_EMPTY;
+    if (args[0]->expr->count == 0) return LERR_EMPTY;
+
+    return builtin_qexpr(expr_sub(args[0]->expr, 0, 1));
+}
+
+lval * builtin_tail(lval **args, int count, lenv *env) {
+    expr *e;
+    lval *r;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
+
+    if (args[0]->expr->count == 0) return LERR_EMPTY;
+    if (args[0]->expr->count == 1) return lval_nil();
+
+    if (args[0]->refs > 1) {
+        e = args[0]->expr;
+        return builtin_qexpr(expr_sub(e, 1, e->count));
     }
+    r = args_take(args, 0);
+    lval_del(expr_pop(r->expr, 0));
+
+    return r;
+}
+
+lval * builtin_list(lval **args, int count, lenv *env) {
+    int i;
+    expr *e = expr_new(count);
+
+    for(i = 0; i < count; ++i) {
+        e->cell[i] = args_take(args, i);
+    }
+
+    return builtin_qexpr(e);
+}
+
+lval * builtin_eval(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
+
+    return expr_eval(args[0]->expr, env);
+}
+
+lval * _builtin_join_qexprs(lval **args, int count, lenv *env) {
+    int i;
+    int m = 0;
+    lval *r = args_check(args, 0, count, LVAL_QEXPR);
+    if (r) return r;
 
-    while(r->expr->count > 1) {
-        lval_del(expr_pop(r->expr, 1));
+    /* add the others around the longest list */
+    for(i = 1; i < count; ++i) {
+        if (args[i]->expr->count > args[m]->expr->count) m = i;
+    }
+    r = lval_unshare(args_take(args, m));
+
+    for(i = m - 1; i >= 0; --i) {
+        expr_unshift(r->expr, args[i]->expr);
+    }
+    for(i = m + 1; i < count; ++i) {
+        expr_concat(r->expr, args[i]->expr);
     }
 
     return r;
 }
 
-lval * builtin_tail(expr *this, lenv *env) {
-    if(this->count != 1) return LERR_BAD_ARITY;
+lval * _builtin_join_strings(lval **args, int count, lenv *env) {
+    int i;
+    ssize_t sz;
+    lval *r = args_check(args, 0, count, LVAL_STR);
+    if (r) return r;
 
-    lval *r = expr_pop_qexpr(this);
-    if (r->type == LVAL_ERR) return r;
+    r = lval_unshare(args_take(args, 0));
 
-    if (r->expr->count == 0) {
-        lval_del(r);
-        return LERR_EMPTY;
+    sz = strlen(r->str) + 1;
+    for(i = 1; i < count; ++i) sz += strlen(args[i]->str);
+    r->str = realloc(r->str, sz);
+
+    for(i = 1; i < count; ++i) {
+        strcat(r->str, args[i]->str);
     }
 
-    lval_del(expr_pop(r->expr, 0));
+    return r;
+}
+
+lval * builtin_join(lval **args, int count, lenv *env) {
+    if(count < 1) return LERR_BAD_ARITY;
+    switch (args[0]->type) {
+        case LVAL_QEXPR:
+            return _builtin_join_qexprs(args, count, env);
+        case LVAL_VECTOR:
+            return builtin_concat(args, count, env);
+        case LVAL_STR:
+            return _builtin_join_strings(args, count, env);
+        default:
+            return LERR_BAD_TYPE;
+    }
+}
+
+lval * builtin_cons(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_ERR) return lval_ref(args[0]);
+    r = args_check(args, 1, 2, LVAL_QEXPR);
+    if (r) return r;
+
+    r = lval_unshare(args_take(args, 1));
+    lval_prepend(r, args_take(args, 0));
 
     return r;
 }
 
-lval * builtin_list(expr *this, lenv *env) {
-    lval *r = lval_qexpr();
+/* counts the elements of a sequence by running it */
+static lval * builtin_seq_len(lval *x) {
+    int n;
+    long r = 0;
+    lval *e;
+    seq_iter *it = seq_iter_new(x);
+
+    while ((n = seq_next(it, &e)) > 0) {
+        lval_del(e);
+        r++;
+    }
+    seq_iter_del(it);
+    return n < 0 ? e : lval_num(r);
+}
+
+lval * builtin_len(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_VECTOR) {
+        return lval_num(VECTOR_COUNT(args[0]->vec));
+    }
+    if (args[0]->type == LVAL_MAP) return lval_num(MAP_COUNT(args[0]->map));
+    if (args[0]->type == LVAL_I64ARRAY) return lval_num(args[0]->arr_count);
+    if (args[0]->type == LVAL_SEQ) return builtin_seq_len(args[0]);
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
+
+    return lval_num(args[0]->expr->count);
+}
+
+lval * builtin_init(lval **args, int count, lenv *env) {
+    expr *e;
+    lval *r;
 
-    while(this->count) {
-        lval_append(r, expr_pop(this, 0));
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
+
+    if (args[0]->expr->count == 0) return LERR_EMPTY;
+
+    if (args[0]->refs > 1) {
+        e = args[0]->expr;
+        return builtin_qexpr(expr_sub(e, 0, e->count - 1));
     }
+    r = args_take(args, 0);
+    lval_del(expr_pop(r->expr, r->expr->count - 1));
 
     return r;
 }
 
-lval * builtin_eval(expr *this, lenv *env) {
-    if(this->count != 1) return LERR_BAD_ARITY;
+/* list library: single pass versions of what std.lspy used to define
+ * recursively. Like fst, elements given to functions are evaluated. */
 
-    lval *r = expr_pop_qexpr(this);
-    if (r->type == LVAL_ERR) return r;
+/* calls f with the n values in argv, consumed */
+static lval * builtin_apply(lval *f, lval **argv, int n, lenv *env) {
+    int i;
+    lval *r;
+    expr *e = expr_new(n);
 
-    r->type = LVAL_SEXPR;
-    return lval_eval(r, env);
+    for(i = 0; i < n; ++i) e->cell[i] = argv[i];
+    r = lval_call(lval_ref(f), e, env);
+    expr_del(e);
+    return r;
 }
 
-lval * _builtin_join_qexprs(expr *this, lenv *env) {
-    if(this->count < 1) return LERR_BAD_ARITY;
+static lval * builtin_elem(expr *l, int i, lenv *env) {
+    return lval_eval(lval_ref(l->cell[i]), env);
+}
 
-    lval *c;
-    lval *r = expr_pop_qexpr(this);
-    if (r->type == LVAL_ERR) return r;
+lval * builtin_map(lval **args, int count, lenv *env) {
+    int i;
+    lval *r;
+    expr *l;
+    expr *e;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_ERR) return lval_ref(args[0]);
+    r = args_check(args, 1, 2, LVAL_QEXPR);
+    if (r) return r;
+
+    l = args[1]->expr;
+    if (!l->count) return lval_nil();
+
+    e = expr_new(l->count);
+    e->count = 0;
+    for(i = 0; i < l->count; ++i) {
+        r = builtin_elem(l, i, env);
+        if (r->type != LVAL_ERR) r = builtin_apply(args[0], &r, 1, env);
+        if (r->type == LVAL_ERR) {
+            expr_del(e);
+            return r;
+        }
+        e->cell[e->count++] = r;
+    }
 
-    while(this->count) {
-        c = expr_pop_qexpr(this);
-        if (c->type == LVAL_ERR) {
+    return builtin_qexpr(e);
+}
+
+lval * builtin_filter(lval **args, int count, lenv *env) {
+    int i;
+    int keep;
+    lval *r;
+    expr *l;
+    expr *e;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_ERR) return lval_ref(args[0]);
+    r = args_check(args, 1, 2, LVAL_QEXPR);
+    if (r) return r;
+
+    l = args[1]->expr;
+    e = expr_new(l->count);
+    e->count = 0;
+    for(i = 0; i < l->count; ++i) {
+        r = builtin_elem(l, i, env);
+        if (r->type != LVAL_ERR) r = builtin_apply(args[0], &r, 1, env);
+        if (r->type != LVAL_BOOLEAN) {
+            expr_del(e);
+            if (r->type == LVAL_ERR) return r;
             lval_del(r);
-            return c;
-        }
-        while(c->expr->count) {
-            lval_append(r, expr_pop(c->expr, 0));
+            return LERR_BAD_TYPE;
         }
-        lval_del(c);
+        keep = r->boolean;
+        lval_del(r);
+        if (keep) e->cell[e->count++] = lval_ref(l->cell[i]);
     }
 
-    return r;
+    if (!e->count) {
+        expr_del(e);
+        return lval_nil();
+    }
+    return builtin_qexpr(e);
 }
 
-lval * _builtin_join_strings(expr *this, lenv *env) {
-    if(this->count < 1) return LERR_BAD_ARITY;
+/* foldl f z s over a sequence, one element at a time */
+static lval * builtin_fold_seq(lval **args, lenv *env) {
+    int n;
+    lval *argv[2];
+    seq_iter *it = seq_iter_new(args[2]);
+
+    argv[0] = args_take(args, 1);
+    while ((n = seq_next(it, &argv[1])) > 0) {
+        argv[1] = lval_eval(argv[1], env);
+        if (argv[1]->type == LVAL_ERR) break;
+        argv[0] = builtin_apply(args[0], argv, 2, env);
+        if (argv[0]->type == LVAL_ERR) {
+            seq_iter_del(it);
+            return argv[0];
+        }
+    }
+    seq_iter_del(it);
 
-    lval *c;
-    lval *r = expr_pop_str(this);
-    if (r->type == LVAL_ERR) return r;
-    ssize_t sz = strlen(r->str) + 1;
+    if (n != 0) {
+        lval_del(argv[0]);
+        return argv[1];
+    }
+    return argv[0];
+}
 
-    while(this->count) {
-        c = expr_pop_str(this);
-        if (c->type == LVAL_ERR) {
+/* f z x1 ... from the left, or f x1 ... z from the right */
+static lval * builtin_fold(lval **args, int count, lenv *env, int right) {
+    int i;
+    int k;
+    lval *r;
+    lval *x;
+    lval *argv[2];
+    expr *l;
+
+    if(count != 3) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_ERR) return lval_ref(args[0]);
+    if (args[1]->type == LVAL_ERR) return lval_ref(args[1]);
+    if (!right && args[2]->type == LVAL_SEQ) return builtin_fold_seq(args, env);
+    r = args_check(args, 2, 3, LVAL_QEXPR);
+    if (r) return r;
+
+    l = args[2]->expr;
+    r = args_take(args, 1);
+    for(k = 0; k < l->count; ++k) {
+        i = right ? l->count - 1 - k : k;
+        x = builtin_elem(l, i, env);
+        if (x->type == LVAL_ERR) {
             lval_del(r);
-            return c;
+            return x;
         }
-        sz += strlen(c->str);
-        r->str = realloc(r->str, sz);
-        strcat(r->str, c->str);
-        lval_del(c);
+        argv[right ? 1 : 0] = r;
+        argv[right ? 0 : 1] = x;
+        r = builtin_apply(args[0], argv, 2, env);
+        if (r->type == LVAL_ERR) return r;
     }
 
     return r;
 }
 
-lval * builtin_join(expr *this, lenv *env) {
-    if(this->count < 1) return LERR_BAD_ARITY;
-    switch (this->cell[0]->type) {
-        case LVAL_QEXPR:
-            return _builtin_join_qexprs(this, env);
-        case LVAL_STR:
-            return _builtin_join_strings(this, env);
-        default:
-            return LERR_BAD_TYPE;
+lval * builtin_foldl(lval **args, int count, lenv *env) {
+    return builtin_fold(args, count, env, 0);
+}
+
+lval * builtin_foldr(lval **args, int count, lenv *env) {
+    return builtin_fold(args, count, env, 1);
+}
+
+lval * builtin_last(lval **args, int count, lenv *env) {
+    lval *r;
+    expr *l;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
+
+    l = args[0]->expr;
+    if (!l->count) return LERR_EMPTY;
+    return builtin_elem(l, l->count - 1, env);
+}
+
+lval * builtin_reverse(lval **args, int count, lenv *env) {
+    int i;
+    lval *r;
+    expr *l;
+    expr *e;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
+
+    l = args[0]->expr;
+    if (l->count < 2) return args_take(args, 0);
+
+    e = expr_new(l->count);
+    for(i = 0; i < l->count; ++i) {
+        e->cell[i] = lval_ref(l->cell[l->count - 1 - i]);
     }
+    return builtin_qexpr(e);
+}
+
+/* the elements of l from from to to - 1, with from and to clamped */
+static lval * builtin_range_of(lval **args, int i, long from, long to) {
+    expr *l = args[i]->expr;
+
+    if (from < 0) from = 0;
+    if (to > l->count) to = l->count;
+    if (from >= to) return lval_nil();
+    if (from == 0 && to == l->count) return args_take(args, i);
+    return builtin_qexpr(expr_sub(l, from, to));
 }
 
-lval * builtin_cons(expr *this, lenv *env) {
-    if(this->count != 2) return LERR_BAD_ARITY;
+static lval * builtin_lazy_take(lval **args, long n);
+
+lval * builtin_take(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_NUM);
+    if (r) return r;
+    if (args[1]->type == LVAL_SEQ) return builtin_lazy_take(args, args[0]->num);
+    r = args_check(args, 1, 2, LVAL_QEXPR);
+    if (r) return r;
+
+    return builtin_range_of(args, 1, 0, args[0]->num);
+}
+
+lval * builtin_drop(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_NUM);
+    if (r) return r;
+    r = args_check(args, 1, 2, LVAL_QEXPR);
+    if (r) return r;
+
+    return builtin_range_of(args, 1, args[0]->num, args[1]->expr->count);
+}
+
+/* zip {a b} {1 2} is {{a 1} {b 2}}, as long as the shortest list */
+lval * builtin_zip(lval **args, int count, lenv *env) {
+    int i;
+    int j;
+    int n;
+    lval *r;
+    expr *e;
+    expr *t;
 
-    lval *c = expr_pop(this, 0);
-    lval *r = expr_pop_qexpr(this);
-    if (c->type == LVAL_ERR) {
-        lval_del(c);
+    if(count < 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, count, LVAL_QEXPR);
+    if (r) return r;
+
+    n = args[0]->expr->count;
+    for(j = 1; j < count; ++j) {
+        if (args[j]->expr->count < n) n = args[j]->expr->count;
+    }
+    if (!n) return lval_nil();
+
+    e = expr_new(n);
+    for(i = 0; i < n; ++i) {
+        t = expr_new(count);
+        for(j = 0; j < count; ++j) {
+            t->cell[j] = lval_ref(args[j]->expr->cell[i]);
+        }
+        e->cell[i] = builtin_qexpr(t);
+    }
+    return builtin_qexpr(e);
+}
+
+/* Reads range b, range a b or range a b step, from a (0) up to b
+ * excluded, into the from, step and count of r. The span between a and b
+ * is taken unsigned, where it always fits. */
+static lval * builtin_range_args(lval **args, int count, seq *r) {
+    long to;
+    unsigned long n;
+    lval *e;
+
+    if(count < 1 || count > 3) return LERR_BAD_ARITY;
+    e = args_check(args, 0, count, LVAL_NUM);
+    if (e) return e;
+
+    to = args[count > 1]->num;
+    r->from = count > 1 ? args[0]->num : 0;
+    r->step = count > 2 ? args[2]->num : 1;
+    if (r->step == 0) return LERR_BAD_NUM;
+
+    if (r->step > 0 && r->from < to) {
+        n = ((unsigned long)to - r->from - 1) / r->step + 1;
+    }
+    else if (r->step < 0 && r->from > to) {
+        n = ((unsigned long)r->from - to - 1) / -(unsigned long)r->step + 1;
+    }
+    else {
+        n = 0;
+    }
+    if (n > LONG_MAX) return LERR_OVERFLOW;
+    r->count = n;
+    return NULL;
+}
+
+lval * builtin_range(lval **args, int count, lenv *env) {
+    int i;
+    seq s;
+    lval *r;
+    expr *e;
+
+    r = builtin_range_args(args, count, &s);
+    if (r) return r;
+    if (s.count == 0) return lval_nil();
+    if (s.count > INT_MAX / 2) return LERR_OVERFLOW;
+
+    e = expr_new(s.count);
+    for(i = 0; i < s.count; ++i) {
+        e->cell[i] = lval_num(s.from + (unsigned long)i * s.step);
+    }
+    return builtin_qexpr(e);
+}
+
+/* lazy sequences, see seq.c */
+
+/* NULL if x is a sequence or a Q-Expression */
+static lval * builtin_check_lazy(lval *x) {
+    if (x->type == LVAL_ERR) return lval_ref(x);
+    if (x->type != LVAL_SEQ && x->type != LVAL_QEXPR) return LERR_BAD_TYPE;
+    return NULL;
+}
+
+lval * builtin_lazy_range(lval **args, int count, lenv *env) {
+    seq *s = seq_new(SEQ_RANGE);
+    lval *r = builtin_range_args(args, count, s);
+
+    if (r) {
+        seq_del(s);
         return r;
     }
+    return lval_seq(s);
+}
+
+static lval * builtin_lazy_stage(lval **args, int count, lenv *env, int kind) {
+    seq *s;
+    lval *r;
 
-    lval_prepend(r, c);
+    if(count != 2) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_ERR) return lval_ref(args[0]);
+    r = builtin_check_lazy(args[1]);
+    if (r) return r;
 
-    return r;
+    s = seq_new(kind);
+    s->fn = args_take(args, 0);
+    s->env = lenv_ref(env);
+    s->src = args_take(args, 1);
+    return lval_seq(s);
+}
+
+lval * builtin_lazy_map(lval **args, int count, lenv *env) {
+    return builtin_lazy_stage(args, count, env, SEQ_MAP);
+}
+
+lval * builtin_lazy_filter(lval **args, int count, lenv *env) {
+    return builtin_lazy_stage(args, count, env, SEQ_FILTER);
 }
 
-lval * builtin_len(expr *this, lenv *env) {
-    if(this->count != 1) return LERR_BAD_ARITY;
+/* the first n elements of the sequence at args[1] */
+static lval * builtin_lazy_take(lval **args, long n) {
+    seq *s = seq_new(SEQ_TAKE);
+    s->count = n < 0 ? 0 : n;
+    s->src = args_take(args, 1);
+    return lval_seq(s);
+}
 
+lval * builtin_realize(lval **args, int count, lenv *env) {
+    int n;
     lval *r;
-    lval *c = expr_pop_qexpr(this);
-    if (c->type == LVAL_ERR) return c;
+    lval *x;
+    seq_iter *it;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = builtin_check_lazy(args[0]);
+    if (r) return r;
+    if (args[0]->type == LVAL_QEXPR) return args_take(args, 0);
 
-    r = lval_num(c->expr->count);
-    lval_del(c);
+    r = lval_qexpr();
+    it = seq_iter_new(args[0]);
+    while ((n = seq_next(it, &x)) > 0) lval_append(r, x);
+    seq_iter_del(it);
 
+    if (n < 0) {
+        lval_del(r);
+        return x;
+    }
+    if (!r->expr->count) {
+        lval_del(r);
+        return lval_nil();
+    }
     return r;
 }
 
-lval * builtin_init(expr *this, lenv *env) {
-    if(this->count != 1) return LERR_BAD_ARITY;
+lval * builtin_delay(lval **args, int count, lenv *env) {
+    lval *r;
 
-    lval *r = expr_pop_qexpr(this);
-    if (r->type == LVAL_ERR) return r;
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
 
-    if (r->expr->count == 0) {
-        lval_del(r);
-        return LERR_EMPTY;
+    return lval_delay(args_take(args, 0), lenv_ref(env));
+}
+
+/* the value of a delay, anything else as it is */
+lval * builtin_force(lval **args, int count, lenv *env) {
+    if(count != 1) return LERR_BAD_ARITY;
+    if (args[0]->type != LVAL_DELAY) return args_take(args, 0);
+    return delay_force(args[0]);
+}
+
+/* map, filter and foldl on a thread pool, see par.c */
+
+lval * builtin_pmap(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_ERR) return lval_ref(args[0]);
+    r = args_check(args, 1, 2, LVAL_QEXPR);
+    if (r) return r;
+
+    r = par_list(PAR_MAP, args[0], NULL, args[1]->expr, env);
+    return r ? r : builtin_map(args, count, env);
+}
+
+lval * builtin_pfilter(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_ERR) return lval_ref(args[0]);
+    r = args_check(args, 1, 2, LVAL_QEXPR);
+    if (r) return r;
+
+    r = par_list(PAR_FILTER, args[0], NULL, args[1]->expr, env);
+    return r ? r : builtin_filter(args, count, env);
+}
+
+/* foldl for an associative function */
+lval * builtin_preduce(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 3) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_ERR) return lval_ref(args[0]);
+    if (args[1]->type == LVAL_ERR) return lval_ref(args[1]);
+    r = args_check(args, 2, 3, LVAL_QEXPR);
+    if (r) return r;
+
+    r = par_list(PAR_REDUCE, args[0], args[1], args[2]->expr, env);
+    return r ? r : builtin_foldl(args, count, env);
+}
+
+/* vectors, indices start at 1 like nth in std.lspy used to */
+
+/* NULL if x is a Q-Expression or a vector */
+static lval * builtin_check_seq(lval *x) {
+    if (x->type == LVAL_ERR) return lval_ref(x);
+    if (x->type != LVAL_QEXPR && x->type != LVAL_VECTOR) return LERR_BAD_TYPE;
+    return NULL;
+}
+
+lval * builtin_vec(lval **args, int count, lenv *env) {
+    lval *r;
+    expr *e;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = builtin_check_seq(args[0]);
+    if (r) return r;
+
+    if (args[0]->type == LVAL_VECTOR) return args_take(args, 0);
+    e = args[0]->expr;
+    return lval_vector(vector_from(e->cell, e->count));
+}
+
+lval * builtin_nth(lval **args, int count, lenv *env) {
+    lval *r;
+    long i;
+    int n;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_NUM);
+    if (r) return r;
+    r = builtin_check_seq(args[1]);
+    if (r) return r;
+
+    i = args[0]->num;
+    if (i < 1) return lval_err("invalid number");
+    if (args[1]->type == LVAL_VECTOR) {
+        n = VECTOR_COUNT(args[1]->vec);
+        if (i > n) return LERR_EMPTY;
+        r = vector_get(args[1]->vec, i - 1);
+    }
+    else {
+        n = args[1]->expr->count;
+        if (i > n) return LERR_EMPTY;
+        r = args[1]->expr->cell[i - 1];
     }
 
-    lval_del(expr_pop(r->expr, r->expr->count - 1));
+    /* like fst, the element is evaluated */
+    return lval_eval(lval_ref(r), env);
+}
 
-    return r;
+lval * builtin_assoc(lval **args, int count, lenv *env) {
+    lval *r;
+    vnode *v;
+
+    if(count != 3) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_VECTOR);
+    if (r) return r;
+    r = args_check(args, 1, 2, LVAL_NUM);
+    if (r) return r;
+
+    v = args[0]->vec;
+    if (args[1]->num < 1 || args[1]->num > VECTOR_COUNT(v)) return LERR_RANGE;
+
+    return lval_vector(vector_assoc(v, args[1]->num - 1, args_take(args, 2)));
+}
+
+lval * builtin_slice(lval **args, int count, lenv *env) {
+    lval *r;
+    long from;
+    long to;
+    int n;
+
+    if(count != 3) return LERR_BAD_ARITY;
+    r = builtin_check_seq(args[0]);
+    if (r) return r;
+    r = args_check(args, 1, 3, LVAL_NUM);
+    if (r) return r;
+
+    n = args[0]->type == LVAL_VECTOR ?
+        VECTOR_COUNT(args[0]->vec) : args[0]->expr->count;
+    from = args[1]->num;
+    to = args[2]->num;
+    if (from < 1 || to > n || from > to + 1) return LERR_RANGE;
+
+    if (args[0]->type == LVAL_VECTOR) {
+        return lval_vector(vector_slice(args[0]->vec, from - 1, to));
+    }
+    if (from > to) return lval_nil();
+    return builtin_qexpr(expr_sub(args[0]->expr, from - 1, to));
+}
+
+lval * builtin_concat(lval **args, int count, lenv *env) {
+    int i;
+    lval *r;
+    vnode *v = NULL;
+
+    if(count < 1) return LERR_BAD_ARITY;
+    for(i = 0; i < count; ++i) {
+        r = builtin_check_seq(args[i]);
+        if (r) return r;
+    }
+
+    for(i = 0; i < count; ++i) {
+        if (args[i]->type == LVAL_VECTOR) {
+            v = vector_concat(v, vnode_ref(args[i]->vec));
+        }
+        else {
+            v = vector_concat(
+                v, vector_from(args[i]->expr->cell, args[i]->expr->count)
+            );
+        }
+    }
+
+    return lval_vector(v);
+}
+
+/* maps */
+
+/* m with the pairs of keys and values in args, m consumed, args borrowed */
+static lval * builtin_put_pairs(mnode *m, lval **args, int count) {
+    int i;
+    unsigned long h;
+    mnode *r;
+
+    for(i = 0; i < count; i += 2) {
+        if (args[i]->type == LVAL_ERR || !map_hash(args[i], &h)) {
+            mnode_del(m);
+            if (args[i]->type == LVAL_ERR) return lval_ref(args[i]);
+            return LERR_BAD_KEY;
+        }
+        r = map_put(m, lval_ref(args[i]), lval_ref(args[i + 1]), h);
+        mnode_del(m);
+        m = r;
+    }
+
+    return lval_map(m);
+}
+
+/* hash-map k v ..., or hash-map {k v ...} which also gives an empty map */
+lval * builtin_hash_map(lval **args, int count, lenv *env) {
+    expr *e;
+
+    if (count == 1 && args[0]->type == LVAL_QEXPR) {
+        e = args[0]->expr;
+        if(e->count % 2) return LERR_BAD_ARITY;
+        return builtin_put_pairs(NULL, e->cell, e->count);
+    }
+    if(count % 2) return LERR_BAD_ARITY;
+    return builtin_put_pairs(NULL, args, count);
+}
+
+lval * builtin_get(lval **args, int count, lenv *env) {
+    unsigned long h;
+    lval *r;
+
+    if(count != 2 && count != 3) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_MAP);
+    if (r) return r;
+    if (args[1]->type == LVAL_ERR) return lval_ref(args[1]);
+    if (!map_hash(args[1], &h)) return LERR_BAD_KEY;
+
+    r = map_get(args[0]->map, args[1], h);
+    if (r) return lval_ref(r);
+    if (count == 3) return args_take(args, 2);
+    return LERR_NO_KEY;
+}
+
+lval * builtin_put(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count < 3 || count % 2 == 0) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_MAP);
+    if (r) return r;
+
+    return builtin_put_pairs(mnode_ref(args[0]->map), args + 1, count - 1);
+}
+
+lval * builtin_del(lval **args, int count, lenv *env) {
+    int i;
+    unsigned long h;
+    lval *r;
+    mnode *m;
+    mnode *n;
+
+    if(count < 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_MAP);
+    if (r) return r;
+
+    m = mnode_ref(args[0]->map);
+    for(i = 1; i < count; ++i) {
+        if (args[i]->type == LVAL_ERR || !map_hash(args[i], &h)) {
+            mnode_del(m);
+            if (args[i]->type == LVAL_ERR) return lval_ref(args[i]);
+            return LERR_BAD_KEY;
+        }
+        n = map_remove(m, args[i], h);
+        mnode_del(m);
+        m = n;
+    }
+
+    return lval_map(m);
+}
+
+/* a Q-Expression of the keys or the values of the map in args */
+static lval * builtin_entries(lval **args, int count, int keys) {
+    int i;
+    lval *r;
+    expr *e;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_MAP);
+    if (r) return r;
+    if (!args[0]->map) return lval_nil();
+
+    e = expr_new(args[0]->map->count);
+    map_entries(args[0]->map, keys ? e->cell : NULL, keys ? NULL : e->cell);
+    for(i = 0; i < e->count; ++i) lval_ref(e->cell[i]);
+
+    return builtin_qexpr(e);
+}
+
+lval * builtin_keys(lval **args, int count, lenv *env) {
+    return builtin_entries(args, count, 1);
+}
+
+lval * builtin_vals(lval **args, int count, lenv *env) {
+    return builtin_entries(args, count, 0);
+}
+
+lval * builtin_contains(lval **args, int count, lenv *env) {
+    unsigned long h;
+    lval *r;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_MAP);
+    if (r) return r;
+    if (args[1]->type == LVAL_ERR) return lval_ref(args[1]);
+    if (!map_hash(args[1], &h)) return LERR_BAD_KEY;
+
+    return lval_boolean(map_get(args[0]->map, args[1], h) != NULL);
+}
+
+/* packed arrays, see array.c */
+
+static long * builtin_arr_alloc(int n) {
+    return malloc(sizeof(long) * (n ? n : 1));
+}
+
+lval * builtin_arr(lval **args, int count, lenv *env) {
+    int i;
+    lval *r;
+    long *a;
+    expr *e;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    if (args[0]->type == LVAL_I64ARRAY) return args_take(args, 0);
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
+
+    e = args[0]->expr;
+    r = args_check(e->cell, 0, e->count, LVAL_NUM);
+    if (r) return r;
+
+    a = builtin_arr_alloc(e->count);
+    for(i = 0; i < e->count; ++i) a[i] = e->cell[i]->num;
+    return lval_i64array(a, e->count);
+}
+
+lval * builtin_arr_list(lval **args, int count, lenv *env) {
+    int i;
+    lval *r;
+    expr *e;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_I64ARRAY);
+    if (r) return r;
+    if (!args[0]->arr_count) return lval_nil();
+
+    e = expr_new(args[0]->arr_count);
+    for(i = 0; i < e->count; ++i) e->cell[i] = lval_num(args[0]->arr[i]);
+    return builtin_qexpr(e);
+}
+
+lval * builtin_arr_sum(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_I64ARRAY);
+    if (r) return r;
+
+    return lval_num(array_sum(args[0]->arr, args[0]->arr_count));
+}
+
+lval * builtin_arr_min(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_I64ARRAY);
+    if (r) return r;
+    if (!args[0]->arr_count) return LERR_EMPTY;
+
+    return lval_num(array_min(args[0]->arr, args[0]->arr_count));
+}
+
+lval * builtin_arr_max(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_I64ARRAY);
+    if (r) return r;
+    if (!args[0]->arr_count) return LERR_EMPTY;
+
+    return lval_num(array_max(args[0]->arr, args[0]->arr_count));
+}
+
+/* arr-map+ a n adds n to every value, arr-map+ a b adds b value by value */
+lval * builtin_arr_map_plus(lval **args, int count, lenv *env) {
+    lval *r;
+    long *a;
+    int n;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_I64ARRAY);
+    if (r) return r;
+    if (args[1]->type == LVAL_ERR) return lval_ref(args[1]);
+
+    n = args[0]->arr_count;
+    if (args[1]->type == LVAL_NUM) {
+        a = builtin_arr_alloc(n);
+        array_add(a, args[0]->arr, args[1]->num, n);
+    }
+    else if (args[1]->type == LVAL_I64ARRAY) {
+        if (args[1]->arr_count != n) return LERR_LENGTH;
+        a = builtin_arr_alloc(n);
+        array_add_array(a, args[0]->arr, args[1]->arr, n);
+    }
+    else {
+        return LERR_BAD_TYPE;
+    }
+
+    return lval_i64array(a, n);
+}
+
+lval * builtin_arr_dot(lval **args, int count, lenv *env) {
+    lval *r;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 2, LVAL_I64ARRAY);
+    if (r) return r;
+    if (args[0]->arr_count != args[1]->arr_count) return LERR_LENGTH;
+
+    return lval_num(array_dot(args[0]->arr, args[1]->arr, args[0]->arr_count));
+}
+
+lval * builtin_arr_filter_lt(lval **args, int count, lenv *env) {
+    lval *r;
+    long *a;
+    int n;
+
+    if(count != 2) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_I64ARRAY);
+    if (r) return r;
+    r = args_check(args, 1, 2, LVAL_NUM);
+    if (r) return r;
+
+    a = builtin_arr_alloc(args[0]->arr_count);
+    n = array_filter_lt(a, args[0]->arr, args[1]->num, args[0]->arr_count);
+    return lval_i64array(realloc(a, sizeof(long) * (n ? n : 1)), n);
 }
 
 #define BUILTIN_DEF(setter)                                                    \
 do {                                                                           \
-    lval *sym;                                                                 \
-    lval *v;                                                                   \
+    int i;                                                                     \
+    expr *syms;                                                                \
+    lval *e;                                                                   \
                                                                                \
-    if(this->count < 1) return LERR_BAD_ARITY;                                 \
+    if(count < 1) return LERR_BAD_ARITY;                                       \
                                                                                \
-    lval *syms = expr_pop_qexpr(this);                                         \
-    if (syms->type == LVAL_ERR) return syms;                                   \
+    e = args_check(args, 0, 1, LVAL_QEXPR);                                    \
+    if (e) return e;                                                           \
+    syms = args[0]->expr;                                                      \
                                                                                \
-    if(this->count != syms->expr->count) {                                     \
-        lval_del(syms);                                                        \
-        return LERR_BAD_ARITY;                                                 \
-    }                                                                          \
+    if(count - 1 != syms->count) return LERR_BAD_ARITY;                        \
+    e = args_check(syms->cell, 0, syms->count, LVAL_SYM);                      \
+    if (e) return e;                                                           \
                                                                                \
-    while(this->count) {                                                       \
-        sym = expr_pop_sym(syms->expr);                                        \
-        if (sym->type == LVAL_ERR) {                                           \
-            lval_del(syms);                                                    \
-            return sym;                                                        \
-        }                                                                      \
-        v = expr_pop(this, 0);                                                 \
-        setter(env, sym->sym, v);                                              \
-        lval_del(sym);                                                         \
+    for(i = 0; i < syms->count; ++i) {                                         \
+        setter(env, syms->cell[i]->sym, args_take(args, i + 1));               \
+        lenv_bump();                                                           \
     }                                                                          \
                                                                                \
-    lval_del(syms);                                                            \
     return lval_sexpr();                                                       \
 } while(0)
 
-lval * builtin_def(expr *this, lenv *env) {
+lval * builtin_def(lval **args, int count, lenv *env) {
     BUILTIN_DEF(lenv_set_global);
 }
 
-lval * builtin_deflocal(expr *this, lenv *env) {
+lval * builtin_deflocal(lval **args, int count, lenv *env) {
     BUILTIN_DEF(lenv_set);
 }
 
 #undef BUILTIN_DEF
 
-lval * builtin_lambda(expr *this, lenv *env) {
-    int i;
+lval * builtin_lambda(lval **args, int count, lenv *env) {
     lambda *r;
+    lval *e;
 
-    if(this->count != 2) return LERR_BAD_ARITY;
-
-    lval *args = expr_pop_qexpr(this);
-    if (args->type == LVAL_ERR) return args;
+    if(count != 2) return LERR_BAD_ARITY;
 
-    lval *body = expr_pop_qexpr(this);
-    if (body->type == LVAL_ERR) {
-        lval_del(args);
-        return body;
-    }
+    e = args_check(args, 0, 2, LVAL_QEXPR);
+    if (e) return e;
 
-    for(i = 0; i < args->expr->count; ++i) {
-        if (args->expr->cell[i]->type != LVAL_SYM) {
-            lval_del(args);
-            lval_del(body);
-            return LERR_BAD_TYPE;
-        }
+    e = args_check(args[0]->expr->cell, 0, args[0]->expr->count, LVAL_SYM);
+    if (e) {
+        lval_del(e);
+        return LERR_BAD_TYPE;
     }
 
     r = lambda_new();
     r->env = lenv_new();
-    r->args = args->expr;
-    r->body = body->expr;
+    r->env->parent = lenv_ref(env);
+    r->args = args_take(args, 0);
+    r->body = args_take(args, 1);
 
-    args->expr = NULL; body->expr = NULL;
-    lval_del(args); lval_del(body);
+    lambda_resolve(r);
+    r->code = compile_lambda(r);
 
     return lval_lambda(r);
 }
 
-lval * builtin_if(expr *this, lenv *env) {
-    lval *b;
-    lval *t;
-    lval *f;
+lval * builtin_if(lval **args, int count, lenv *env) {
+    lval *e;
+
+    if(count != 3) return LERR_BAD_ARITY;
+    e = args_check(args, 0, 1, LVAL_BOOLEAN);
+    if (e) return e;
+    e = args_check(args, 1, 3, LVAL_QEXPR);
+    if (e) return e;
+
+    return expr_eval(args[args[0]->boolean ? 1 : 2]->expr, env);
+}
+
+lval * builtin_let(lval **args, int count, lenv *env) {
     lval *r;
+    lenv *e;
 
-    if(this->count != 3) return LERR_BAD_ARITY;
-    b = expr_pop_boolean(this);
-    if (b->type == LVAL_ERR) return b;
-    t = expr_pop_qexpr(this);
-    if (t->type == LVAL_ERR) {
-        lval_del(b);
-        return t;
-    }
-    f = expr_pop_qexpr(this);
-    if (f->type == LVAL_ERR) {
-        lval_del(b);
-        lval_del(t);
-        return f;
-    }
+    if(count != 1) return LERR_BAD_ARITY;
+
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
 
-    r = expr_eval(b->boolean ? t->expr : f->expr, env);
+    e = lenv_new();
+    e->parent = lenv_ref(env);
 
-    lval_del(b);
-    lval_del(t);
-    lval_del(f);
+    r = expr_eval(args[0]->expr, e);
 
+    lenv_del(e);
     return r;
 }
 
-lval * builtin_not(expr *this, lenv *env) {
-    if(this->count != 1) return LERR_BAD_ARITY;
+lval * builtin_not(lval **args, int count, lenv *env) {
+    lval *r;
 
-    lval *r = expr_pop_boolean(this);
-    if (r->type == LVAL_ERR) return r;
+    if(count != 1) return LERR_BAD_ARITY;
 
-    r->boolean = 1 - r->boolean;
+    r = args_check(args, 0, 1, LVAL_BOOLEAN);
+    if (r) return r;
 
-    return r;
+    return lval_boolean(!args[0]->boolean);
 }
 
 #define BUILTIN_FOLD_BOOL(fnd, nfnd)                                           \
 do {                                                                           \
-    lval *c;                                                                   \
+    int i;                                                                     \
+    lval *e;                                                                   \
                                                                                \
-    while(this->count) {                                                       \
-        c = expr_pop_boolean(this);                                            \
-        if (c->type == LVAL_ERR) return c;                                     \
-        if (c->boolean == fnd) return c;                                       \
-        lval_del(c);                                                           \
+    for(i = 0; i < count; ++i) {                                               \
+        e = args_check(args, i, i + 1, LVAL_BOOLEAN);                          \
+        if (e) return e;                                                       \
+        if (args[i]->boolean == fnd) return args_take(args, i);                \
     }                                                                          \
                                                                                \
     return lval_boolean(nfnd);                                                 \
 } while(0)
 
-lval * builtin_and(expr *this, lenv *env) {
+lval * builtin_and(lval **args, int count, lenv *env) {
     BUILTIN_FOLD_BOOL(0, 1);
 }
 
-lval * builtin_or(expr *this, lenv *env) {
+lval * builtin_or(lval **args, int count, lenv *env) {
     BUILTIN_FOLD_BOOL(1, 0);
 }
 
 #undef BUILTIN_FOLD_BOOL
 
-lval * builtin_load(expr *this, lenv *env) {
-    lval *fn;
+lval * builtin_load(lval **args, int count, lenv *env) {
     lval *r;
 
-    if(this->count != 1) return LERR_BAD_ARITY;
-
-    fn = expr_pop_str(this);
-    if (fn->type == LVAL_ERR) return fn;
+    if(count != 1) return LERR_BAD_ARITY;
 
-    r = ast_load_eval(fn->str, env);
+    r = args_check(args, 0, 1, LVAL_STR);
+    if (r) return r;
 
-    lval_del(fn);
-    return(r);
+    return ast_load_eval(args[0]->str, env);
 }
 
-lval * builtin_print(expr *this, lenv *env) {
-    lval *cur;
+lval * builtin_print(lval **args, int count, lenv *env) {
+    int i;
 
-    while(this->count) {
-        cur = expr_pop(this, 0);
-        lval_print(cur);
+    for(i = 0; i < count; ++i) {
+        lval_print(args[i]);
         putchar(' ');
-        lval_del(cur);
     }
     putchar('\n');
 
     return lval_sexpr();
 }
 
-lval * builtin_error(expr *this, lenv *env) {
+lval * builtin_error(lval **args, int count, lenv *env) {
     lval *r;
 
-    if(this->count != 1) return LERR_BAD_ARITY;
-    r = expr_pop_str(this);
+    if(count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_STR);
+    if (r) return r;
+    r = lval_unshare(args_take(args, 0));
     r->type = LVAL_ERR;
 
     return r;
 }
 
-lval * builtin_type(expr *this, lenv *env) {
-    lval *v;
+lval * builtin_type(lval **args, int count, lenv *env) {
+    if(count != 1) return LERR_BAD_ARITY;
+    return lval_str(lval_type(args[0]));
+}
+
+/* nullary builtins are called with a dummy argument: (gc ()) */
+
+lval * builtin_gc(lval **args, int count, lenv *env) {
+    if(count > 1) return LERR_BAD_ARITY;
+    return lval_num(gc_collect());
+}
+
+lval * builtin_gc_threshold(lval **args, int count, lenv *env) {
+    if(count != 1) return LERR_BAD_ARITY;
+    if(args[0]->type != LVAL_NUM) return lval_num(gc_threshold);
+
+    gc_threshold = args[0]->num;
+
+    return args_take(args, 0);
+}
+
+lval * builtin_max_depth(lval **args, int count, lenv *env) {
+    if(count != 1) return LERR_BAD_ARITY;
+    if(args[0]->type != LVAL_NUM) return lval_num(vm_max_depth);
+
+    vm_max_depth = args[0]->num;
+
+    return args_take(args, 0);
+}
+
+lval * builtin_pool_stats(lval **args, int count, lenv *env) {
+    if(count > 1) return LERR_BAD_ARITY;
+    pool_print_stats();
+    return lval_sexpr();
+}
+
+lval * builtin_disassemble(lval **args, int count, lenv *env) {
+    lambda *f;
+
+    if(count != 1) return LERR_BAD_ARITY;
+    if(args[0]->type != LVAL_LAMBDA) return LERR_BAD_TYPE;
+
+    f = args[0]->fun;
+    if (!f->code) return LERR_NOT_COMPILED;
+    code_disassemble(f->code);
+    if (f->code->jit) jit_print(f->code->jit);
+    if (f->code->aot) printf("compiled ahead of time\n");
+
+    return lval_sexpr();
+}
+
+/* The plan a form runs with, or those of the fused calls in the code of
+ * a lambda, see fuse.c. Forms that do not fuse give {}. */
+lval * builtin_explain_fusion(lval **args, int count, lenv *env) {
+    int i;
     lval *r;
+    lval *x;
+    code *c;
+
+    if(count != 1) return LERR_BAD_ARITY;
+
+    if (args[0]->type == LVAL_LAMBDA) {
+        if (!args[0]->fun->code) return LERR_NOT_COMPILED;
+        c = code_current(args[0]->fun->code, args[0]->fun->env);
+        r = lval_qexpr();
+        for (i = 0; i + 1 < c->nconsts; ++i) {
+            x = c->consts[i];
+            if (x->type == LVAL_BUILTIN && x->builtin == fuse_run) {
+                lval_append(r, lval_ref(c->consts[i + 1]));
+            }
+        }
+        return r;
+    }
 
-    if(this->count != 1) return LERR_BAD_ARITY;
+    r = args_check(args, 0, 1, LVAL_QEXPR);
+    if (r) return r;
+    if (!args[0]->expr->count) return lval_nil();
+    if (args[0]->expr->cell[0]->type != LVAL_SYM) return lval_nil();
 
-    v = expr_pop(this, 0);
-    r = lval_str(lval_type(v));
+    x = lenv_lookup(env, args[0]->expr->cell[0]);
+    r = fuse_plan(args[0]->expr, x, env);
+    lval_del(x);
+    return r ? r : lval_nil();
+}
 
-    lval_del(v);
-    return r;
+lval * builtin_jit(lval **args, int count, lenv *env) {
+    if(count != 1) return LERR_BAD_ARITY;
+    if(args[0]->type != LVAL_LAMBDA) return LERR_BAD_TYPE;
+
+    if (!jit_compile(args[0])) return LERR_NOT_JITTABLE;
+    return lval_sexpr();
 }
 
 void register_builtins(lenv *env) {
-    lenv_add_builtin(env, "==",    builtin_eq);
-    lenv_add_builtin(env, "!=",    builtin_ne);
-    lenv_add_builtin(env, "+",     builtin_plus);
-    lenv_add_builtin(env, "-",     builtin_minus);
-    lenv_add_builtin(env, "*",     builtin_mul);
-    lenv_add_builtin(env, "/",     builtin_div);
-    lenv_add_builtin(env, "\%",    builtin_mod);
-    lenv_add_builtin(env, "min",   builtin_min);
-    lenv_add_builtin(env, "max",   builtin_max);
-    lenv_add_builtin(env, "<",     builtin_lt);
-    lenv_add_builtin(env, "<=",    builtin_le);
-    lenv_add_builtin(env, ">",     builtin_gt);
-    lenv_add_builtin(env, ">=",    builtin_ge);
-    lenv_add_builtin(env, "list",  builtin_list);
-    lenv_add_builtin(env, "head",  builtin_head);
-    lenv_add_builtin(env, "tail",  builtin_tail);
-    lenv_add_builtin(env, "eval",  builtin_eval);
-    lenv_add_builtin(env, "join",  builtin_join);
-    lenv_add_builtin(env, "cons",  builtin_cons);
-    lenv_add_builtin(env, "len",   builtin_len);
-    lenv_add_builtin(env, "init",  builtin_init);
-    lenv_add_builtin(env, "def",   builtin_def);
-    lenv_add_builtin(env, "=",     builtin_deflocal);
-    lenv_add_builtin(env, "\\",    builtin_lambda);
-    lenv_add_builtin(env, "if",    builtin_if);
-    lenv_add_builtin(env, "!",     builtin_not);
-    lenv_add_builtin(env, "&&",    builtin_and);
-    lenv_add_builtin(env, "||",    builtin_or);
-    lenv_add_builtin(env, "load",  builtin_load);
-    lenv_add_builtin(env, "print", builtin_print);
-    lenv_add_builtin(env, "error", builtin_error);
-    lenv_add_builtin(env, "type",  builtin_type);
+    lenv_add_prim(env, "==",    builtin_eq);
+    lenv_add_prim(env, "!=",    builtin_ne);
+    lenv_add_prim(env, "+",     builtin_plus);
+    lenv_add_prim(env, "-",     builtin_minus);
+    lenv_add_prim(env, "*",     builtin_mul);
+    lenv_add_prim(env, "/",     builtin_div);
+    lenv_add_prim(env, "\%",    builtin_mod);
+    lenv_add_prim(env, "min",   builtin_min);
+    lenv_add_prim(env, "max",   builtin_max);
+    lenv_add_prim(env, "<",     builtin_lt);
+    lenv_add_prim(env, "<=",    builtin_le);
+    lenv_add_prim(env, ">",     builtin_gt);
+    lenv_add_prim(env, ">=",    builtin_ge);
+    lenv_add_prim(env, "list",  builtin_list);
+    lenv_add_prim(env, "head",  builtin_head);
+    lenv_add_prim(env, "tail",  builtin_tail);
+    lenv_add_prim(env, "eval",  builtin_eval);
+    lenv_add_prim(env, "join",  builtin_join);
+    lenv_add_prim(env, "cons",  builtin_cons);
+    lenv_add_prim(env, "len",   builtin_len);
+    lenv_add_prim(env, "init",  builtin_init);
+    lenv_add_prim(env, "map",   builtin_map);
+    lenv_add_prim(env, "filter", builtin_filter);
+    lenv_add_prim(env, "foldl", builtin_foldl);
+    lenv_add_prim(env, "foldr", builtin_foldr);
+    lenv_add_prim(env, "last",  builtin_last);
+    lenv_add_prim(env, "reverse", builtin_reverse);
+    lenv_add_prim(env, "take",  builtin_take);
+    lenv_add_prim(env, "drop",  builtin_drop);
+    lenv_add_prim(env, "zip",   builtin_zip);
+    lenv_add_prim(env, "range", builtin_range);
+    lenv_add_prim(env, "lazy-range", builtin_lazy_range);
+    lenv_add_prim(env, "lazy-map", builtin_lazy_map);
+    lenv_add_prim(env, "lazy-filter", builtin_lazy_filter);
+    lenv_add_prim(env, "realize", builtin_realize);
+    lenv_add_prim(env, "delay", builtin_delay);
+    lenv_add_prim(env, "force", builtin_force);
+    lenv_add_prim(env, "pmap",  builtin_pmap);
+    lenv_add_prim(env, "pfilter", builtin_pfilter);
+    lenv_add_prim(env, "preduce", builtin_preduce);
+    lenv_add_prim(env, "vec",   builtin_vec);
+    lenv_add_prim(env, "nth",   builtin_nth);
+    lenv_add_prim(env, "assoc", builtin_assoc);
+    lenv_add_prim(env, "slice", builtin_slice);
+    lenv_add_prim(env, "concat", builtin_concat);
+    lenv_add_prim(env, "hash-map", builtin_hash_map);
+    lenv_add_prim(env, "get",   builtin_get);
+    lenv_add_prim(env, "put",   builtin_put);
+    lenv_add_prim(env, "del",   builtin_del);
+    lenv_add_prim(env, "keys",  builtin_keys);
+    lenv_add_prim(env, "vals",  builtin_vals);
+    lenv_add_prim(env, "contains?", builtin_contains);
+    lenv_add_prim(env, "arr",   builtin_arr);
+    lenv_add_prim(env, "arr-list", builtin_arr_list);
+    lenv_add_prim(env, "arr-sum", builtin_arr_sum);
+    lenv_add_prim(env, "arr-min", builtin_arr_min);
+    lenv_add_prim(env, "arr-max", builtin_arr_max);
+    lenv_add_prim(env, "arr-map+", builtin_arr_map_plus);
+    lenv_add_prim(env, "arr-dot", builtin_arr_dot);
+    lenv_add_prim(env, "arr-filter<", builtin_arr_filter_lt);
+    lenv_add_prim(env, "def",   builtin_def);
+    lenv_add_prim(env, "=",     builtin_deflocal);
+    lenv_add_prim(env, "\\",    builtin_lambda);
+    lenv_add_prim(env, "if",    builtin_if);
+    lenv_add_prim(env, "let",   builtin_let);
+    lenv_add_prim(env, "!",     builtin_not);
+    lenv_add_prim(env, "&&",    builtin_and);
+    lenv_add_prim(env, "||",    builtin_or);
+    lenv_add_prim(env, "load",  builtin_load);
+    lenv_add_prim(env, "print", builtin_print);
+    lenv_add_prim(env, "error", builtin_error);
+    lenv_add_prim(env, "type",  builtin_type);
+    lenv_add_prim(env, "gc",    builtin_gc);
+    lenv_add_prim(env, "gc-threshold", builtin_gc_threshold);
+    lenv_add_prim(env, "max-depth", builtin_max_depth);
+    lenv_add_prim(env, "pool-stats", builtin_pool_stats);
+    lenv_add_prim(env, "disassemble", builtin_disassemble);
+    lenv_add_prim(env, "explain-fusion", builtin_explain_fusion);
+    lenv_add_prim(env, "jit", builtin_jit);
 }
@@ -0,0 +1,755 @@
+#include "ownlisp.h"
+
+/* Bytecode compiler for lambda bodies.
+ *
+ * A body is compiled once, when the lambda is created, into code for a
+ * small stack machine (see vm.c). Parameters are loaded by slot, every
+ * other symbol through lenv_lookup, and calls to if with two literal
+ * branches become conditional jumps. Those are guarded: if if no longer
+ * names the builtin when the code runs, the form is handed back to the
+ * tree walker. Calls in tail position, the last form of the body or of a
+ * taken branch, are marked so the VM can reuse its C frame for them.
+ * Bodies the compiler cannot handle stay interpreted.
+ *
+ * Calls to builtins without side effects on literal arguments are
+ * evaluated at compile time, looking the builtin up from the lambda's
+ * environment, and become constants. Chains of list builtins such as
+ * (foldl f z (map g l)) become one call running them fused (see fuse.c).
+ * Calls to small lambdas are inlined: the arguments stay on the stack,
+ * where the inlined body reads its parameters, as long as the symbols it
+ * uses are bound to the same values here as where it was defined and none
+ * of them is a builtin that works on the calling environment. The code
+ * records which value each folded, fused or inlined symbol had; like
+ * native code (see jit.c) it is checked again after the next def or =,
+ * and if a symbol changed the lambda runs the body compiled without any
+ * of them from then on. Frames already running find out at the next
+ * folded, fused or inlined form, which is guarded the way if is: once a
+ * symbol changed, or if no longer names the builtin, the form is handed
+ * to the tree walker, in a frame binding the parameters of the lambda it
+ * was inlined from, if any, to their arguments on the stack. */
+
+#define COMPILE_INLINE_OPS 32
+#define COMPILE_INLINE_DEPTH 4
+
+typedef struct {
+    code *code;
+    int depth;
+    /* where symbols are looked up for folding and inlining, NULL not to */
+    lenv *env;
+    /* lambdas being inlined, innermost last, and the stack slots of the
+     * innermost one's arguments */
+    lval *inlining[COMPILE_INLINE_DEPTH];
+    int ninline;
+    int *inline_slots;
+} compiler;
+
+static char *sym_if = NULL;
+
+/* builtins folded on literals; their results are no bigger than their
+ * arguments, so folding does not cost more than the literals themselves
+ * (range is left to the runtime for that reason) */
+static lprim compile_pure[] = {
+    builtin_eq, builtin_ne, builtin_plus, builtin_minus, builtin_mul,
+    builtin_div, builtin_mod, builtin_min, builtin_max, builtin_lt,
+    builtin_le, builtin_gt, builtin_ge, builtin_list, builtin_head,
+    builtin_tail, builtin_join, builtin_cons, builtin_len, builtin_init,
+    builtin_not, builtin_and, builtin_or, builtin_reverse, builtin_take,
+    builtin_drop, builtin_zip, NULL
+};
+
+/* builtins that work on the environment they are called from, the list
+ * functions evaluate elements in it, lazy sequences and delays keep it */
+static lprim compile_dynamic[] = {
+    builtin_lambda, builtin_deflocal, builtin_let, builtin_eval,
+    builtin_load, builtin_nth, builtin_last, builtin_map, builtin_filter,
+    builtin_foldl, builtin_foldr, builtin_lazy_map, builtin_lazy_filter,
+    builtin_delay, builtin_pmap, builtin_pfilter, builtin_preduce, NULL
+};
+
+static void compile_emit(compiler *this, int op) {
+    code *c = this->code;
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->cap);
+    }
+    c->ops[c->count++] = op;
+}
+
+static int compile_const(compiler *this, lval *v) {
+    code *c = this->code;
+    c->consts = realloc(c->consts, sizeof(lval*) * (c->nconsts + 1));
+    c->consts[c->nconsts] = lval_ref(v);
+    return c->nconsts++;
+}
+
+static void compile_push(compiler *this, int n) {
+    this->depth += n;
+    if (this->depth > this->code->depth) this->code->depth = this->depth;
+}
+
+static int compile_code_param(code *c, char *sym) {
+    int i;
+    for (i = 0; i < c->nparams; ++i) {
+        if (c->params[i] == sym) return i;
+    }
+    return -1;
+}
+
+/* slot of sym among the parameters in scope: those of the lambda being
+ * inlined, if any, else the lambda's own */
+static int compile_param(compiler *this, char *sym) {
+    if (this->ninline) {
+        return compile_code_param(
+            this->inlining[this->ninline - 1]->fun->code, sym
+        );
+    }
+    return compile_code_param(this->code, sym);
+}
+
+static int compile_is(lprim *set, lval *v) {
+    int i;
+    if (v->type != LVAL_BUILTIN) return 0;
+    for (i = 0; set[i]; ++i) {
+        if (set[i] == v->builtin) return 1;
+    }
+    return 0;
+}
+
+/* looks sym up with a fresh symbol, leaving the caches of the body alone */
+static lval * compile_lookup(lenv *env, char *sym) {
+    lval *s = lval_sym(sym);
+    lval *r = lenv_lookup(env, s);
+    lval_del(s);
+    return r;
+}
+
+static void compile_assume(compiler *this, char *sym, lval *v) {
+    int i;
+    code *c = this->code;
+
+    for (i = 0; i < c->nassume; ++i) {
+        if (c->assume_syms[i]->sym == sym) {
+            lval_del(v);
+            return;
+        }
+    }
+    c->assume_syms = realloc(
+        c->assume_syms, sizeof(lval*) * (c->nassume + 1)
+    );
+    c->assume_vals = realloc(
+        c->assume_vals, sizeof(lval*) * (c->nassume + 1)
+    );
+    c->assume_syms[c->nassume] = lval_sym(sym);
+    c->assume_vals[c->nassume] = v;
+    c->nassume++;
+}
+
+static int compile_value(compiler *this, lval *v, int tail);
+static int compile_form(compiler *this, lval *form, int tail);
+
+/* The value of form if it calls a pure builtin on literals or on forms
+ * that fold in turn, NULL if it has to be evaluated at runtime. Errors
+ * are left for the runtime too. */
+static lval * compile_fold(compiler *this, lval *form) {
+    int i;
+    lval *fn;
+    lval *x;
+    lval *args;
+    lval *r;
+    expr *e = form->expr;
+
+    if (!this->env || e->count < 2) return NULL;
+    if (e->cell[0]->type != LVAL_SYM) return NULL;
+    if (compile_param(this, e->cell[0]->sym) >= 0) return NULL;
+
+    fn = compile_lookup(this->env, e->cell[0]->sym);
+    if (!compile_is(compile_pure, fn)) {
+        lval_del(fn);
+        return NULL;
+    }
+
+    args = lval_sexpr();
+    for (i = 1; i < e->count; ++i) {
+        x = e->cell[i];
+        switch (x->type) {
+            case LVAL_NUM:
+            case LVAL_BOOLEAN:
+            case LVAL_STR:
+            case LVAL_QEXPR:
+                x = lval_ref(x);
+            break;
+            case LVAL_SEXPR:
+                x = compile_fold(this, x);
+            break;
+            default:
+                x = NULL;
+        }
+        if (!x) {
+            lval_del(args);
+            lval_del(fn);
+            return NULL;
+        }
+        lval_append(args, x);
+    }
+
+    r = fn->builtin(args->expr->cell, args->expr->count, this->env);
+    lval_del(args);
+    if (r->type == LVAL_ERR) {
+        lval_del(r);
+        lval_del(fn);
+        return NULL;
+    }
+    compile_assume(this, e->cell[0]->sym, fn);
+    return r;
+}
+
+/* Whether the symbols body uses besides the parameters of fn are bound to
+ * the same values for the lambda being compiled as for fn, recording them
+ * if record is set. */
+static int compile_closed(compiler *this, lval *fn, expr *body, int record) {
+    int i;
+    int ok;
+    lval *x;
+    lval *v;
+    lval *w;
+
+    for (i = 0; i < body->count; ++i) {
+        x = body->cell[i];
+        if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+            if (!compile_closed(this, fn, x->expr, record)) return 0;
+            continue;
+        }
+        if (x->type != LVAL_SYM) continue;
+        if (compile_code_param(fn->fun->code, x->sym) >= 0) continue;
+        if (compile_code_param(this->code, x->sym) >= 0) return 0;
+
+        v = compile_lookup(fn->fun->env, x->sym);
+        w = compile_lookup(this->env, x->sym);
+        ok = v == w && v->type != LVAL_ERR && v != fn &&
+            !compile_is(compile_dynamic, v);
+        lval_del(w);
+        if (ok && record) compile_assume(this, x->sym, v);
+        else lval_del(v);
+        if (!ok) return 0;
+    }
+    return 1;
+}
+
+/* The plan of form if it is a chain of list builtins to run fused, see
+ * fuse.c, recording the builtins. */
+static lval * compile_fusion(compiler *this, lval *form) {
+    int i;
+    lval *fn;
+    lval *plan;
+    expr *e = form->expr;
+
+    if (!this->env || e->cell[0]->type != LVAL_SYM) return NULL;
+    if (compile_param(this, e->cell[0]->sym) >= 0) return NULL;
+
+    fn = compile_lookup(this->env, e->cell[0]->sym);
+    plan = fuse_plan(e, fn, this->env);
+    lval_del(fn);
+    if (!plan) return NULL;
+
+    for (i = 1; i < plan->expr->count; ++i) {
+        e = e->cell[e->count - 1]->expr;
+        if (compile_param(this, e->cell[0]->sym) >= 0) {
+            lval_del(plan);
+            return NULL;
+        }
+    }
+
+    e = form->expr;
+    for (i = 0; i < plan->expr->count; ++i) {
+        if (i) e = e->cell[e->count - 1]->expr;
+        fn = compile_lookup(this->env, e->cell[0]->sym);
+        compile_assume(this, e->cell[0]->sym, fn);
+    }
+    return plan;
+}
+
+/* a call to fuse_run with plan and the arguments of every stage */
+static int compile_fused(compiler *this, lval *form, lval *plan, int tail) {
+    int i;
+    int j;
+    int n = 2;
+    lval *fn = lval_builtin(fuse_run);
+    expr *e = form->expr;
+
+    compile_emit(this, OP_CONST);
+    compile_emit(this, compile_const(this, fn));
+    compile_emit(this, OP_CONST);
+    compile_emit(this, compile_const(this, plan));
+    compile_push(this, 2);
+    lval_del(fn);
+
+    for (i = 0; i < plan->expr->count; ++i) {
+        if (i) e = e->cell[e->count - 1]->expr;
+        for (j = 1; j < e->count - 1; ++j, ++n) {
+            if (!compile_value(this, e->cell[j], 0)) return 0;
+        }
+    }
+    if (!compile_value(this, e->cell[e->count - 1], 0)) return 0;
+    n++;
+
+    compile_emit(this, tail ? OP_TAILCALL : OP_CALL);
+    compile_emit(this, n);
+    this->depth -= n - 1;
+    return 1;
+}
+
+static int compile_pure_body(lval *fn, expr *body, lval **seen, int n);
+
+/* whether calling fn has no side effects, seen holding the n lambdas
+ * already being checked */
+static int compile_pure_fn(lval *fn, lval **seen, int n) {
+    int i;
+
+    if (fn->type == LVAL_BUILTIN) {
+        return compile_is(compile_pure, fn) || fn->builtin == builtin_if;
+    }
+    if (fn->type != LVAL_LAMBDA) return 0;
+    for (i = 0; i < n; ++i) {
+        if (seen[i] == fn) return 1;
+    }
+    if (n == COMPILE_INLINE_DEPTH) return 0;
+    seen[n] = fn;
+    return compile_pure_body(fn, fn->fun->body->expr, seen, n + 1);
+}
+
+/* whether every symbol of body is a parameter of fn or bound for fn to a
+ * value, a pure builtin or a pure lambda */
+static int compile_pure_body(lval *fn, expr *body, lval **seen, int n) {
+    int i;
+    int j;
+    int ok;
+    lval *x;
+    lval *v;
+    expr *params = fn->fun->args->expr;
+
+    for (i = 0; i < body->count; ++i) {
+        x = body->cell[i];
+        if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+            if (!compile_pure_body(fn, x->expr, seen, n)) return 0;
+            continue;
+        }
+        if (x->type != LVAL_SYM) continue;
+        for (j = 0; j < params->count && params->cell[j]->sym != x->sym; ++j);
+        if (j < params->count) continue;
+
+        v = compile_lookup(fn->fun->env, x->sym);
+        ok = v->type != LVAL_ERR && (
+            (v->type != LVAL_BUILTIN && v->type != LVAL_LAMBDA) ||
+            compile_pure_fn(v, seen, n)
+        );
+        lval_del(v);
+        if (!ok) return 0;
+    }
+    return 1;
+}
+
+/* Whether calling fn has no side effects: it is one of the builtins folded
+ * on literals or if, or a lambda whose body only uses its parameters,
+ * values and such functions. Lambdas calling themselves count, lambdas
+ * nested deeper than inlining goes do not. */
+int compile_pure_call(lval *fn) {
+    lval *seen[COMPILE_INLINE_DEPTH];
+    return compile_pure_fn(fn, seen, 0);
+}
+
+/* the lambda form calls, if that can be inlined */
+static lval * compile_inlinable(compiler *this, lval *form) {
+    int i;
+    lval *fn;
+    code *c;
+    expr *e = form->expr;
+
+    if (!this->env || this->ninline == COMPILE_INLINE_DEPTH) return NULL;
+    if (e->cell[0]->type != LVAL_SYM) return NULL;
+    if (compile_param(this, e->cell[0]->sym) >= 0) return NULL;
+
+    fn = compile_lookup(this->env, e->cell[0]->sym);
+    if (fn->type != LVAL_LAMBDA || !fn->fun->code || fn->fun->env->count) {
+        lval_del(fn);
+        return NULL;
+    }
+    c = fn->fun->code;
+    if (
+        c->count > COMPILE_INLINE_OPS || c->nparams != e->count - 1 ||
+        fn->fun->args->expr->count != e->count - 1
+    ) {
+        lval_del(fn);
+        return NULL;
+    }
+    for (i = 0; i < this->ninline; ++i) {
+        if (this->inlining[i] == fn) {
+            lval_del(fn);
+            return NULL;
+        }
+    }
+    if (!compile_closed(this, fn, fn->fun->body->expr, 0)) {
+        lval_del(fn);
+        return NULL;
+    }
+
+    compile_closed(this, fn, fn->fun->body->expr, 1);
+    compile_assume(this, e->cell[0]->sym, lval_ref(fn));
+    return fn;
+}
+
+/* the arguments of e, then the body of fn reading them from the stack */
+static int compile_inline(compiler *this, lval *fn, expr *e, int tail) {
+    int i;
+    int ok;
+    int n = e->count - 1;
+    int slots[n];
+    int *outer = this->inline_slots;
+
+    for (i = 0; i < n; ++i) {
+        slots[i] = this->depth;
+        if (!compile_value(this, e->cell[i + 1], 0)) return 0;
+    }
+
+    this->inlining[this->ninline++] = fn;
+    this->inline_slots = slots;
+    ok = compile_form(this, fn->fun->body, tail);
+    this->inline_slots = outer;
+    this->ninline--;
+    if (!ok) return 0;
+
+    compile_emit(this, OP_SLIDE);
+    compile_emit(this, n);
+    this->depth -= n;
+    return 1;
+}
+
+static int compile_value(compiler *this, lval *v, int tail) {
+    int slot;
+
+    switch (v->type) {
+        case LVAL_ERR:
+            return 0;
+        case LVAL_SYM:
+            slot = compile_param(this, v->sym);
+            if (slot >= 0 && this->ninline) {
+                compile_emit(this, OP_STACK);
+                compile_emit(this, this->inline_slots[slot]);
+            }
+            else if (slot >= 0) {
+                compile_emit(this, OP_LOCAL);
+                compile_emit(this, slot);
+            }
+            else if (this->ninline) {
+                /* a symbol of its own, the callee's caches its scope */
+                v = lval_sym(v->sym);
+                compile_emit(this, OP_GLOBAL);
+                compile_emit(this, compile_const(this, v));
+                lval_del(v);
+            }
+            else {
+                compile_emit(this, OP_GLOBAL);
+                compile_emit(this, compile_const(this, v));
+            }
+            compile_push(this, 1);
+        break;
+        case LVAL_SEXPR:
+            return compile_form(this, v, tail);
+        default:
+            compile_emit(this, OP_CONST);
+            compile_emit(this, compile_const(this, v));
+            compile_push(this, 1);
+    }
+    return 1;
+}
+
+/* op guarding the code of form, with the inlined lambda form comes from
+ * if any; returns where the target of the guard goes */
+static int compile_guard(compiler *this, int op, lval *form) {
+    int guard;
+
+    compile_emit(this, op);
+    compile_emit(this, compile_const(this, form));
+    guard = this->code->count;
+    compile_emit(this, 0);
+    if (this->ninline) {
+        compile_emit(this, compile_const(
+            this, this->inlining[this->ninline - 1]
+        ));
+        compile_emit(this, this->inline_slots[0]);
+    }
+    else {
+        compile_emit(this, -1);
+        compile_emit(this, 0);
+    }
+    return guard;
+}
+
+/* (if cond {then} {else}) */
+static int compile_if(compiler *this, lval *form, int tail) {
+    int guard;
+    int jumpf;
+    int jump;
+    lval **cell = form->expr->cell;
+
+    guard = compile_guard(this, OP_IF, form);
+
+    if (!compile_value(this, cell[1], 0)) return 0;
+    compile_emit(this, OP_JUMPF);
+    jumpf = this->code->count;
+    compile_emit(this, 0);
+    this->depth--;
+
+    if (!compile_form(this, cell[2], tail)) return 0;
+    compile_emit(this, OP_JUMP);
+    jump = this->code->count;
+    compile_emit(this, 0);
+    this->depth--;
+
+    this->code->ops[jumpf] = this->code->count;
+    if (!compile_form(this, cell[3], tail)) return 0;
+
+    this->code->ops[jump] = this->code->count;
+    this->code->ops[guard] = this->code->count;
+    return 1;
+}
+
+/* the contents of form evaluated as an S-Expression, whatever its type */
+static int compile_form(compiler *this, lval *form, int tail) {
+    int i;
+    int guard;
+    lval *folded;
+    lval *callee;
+    expr *e = form->expr;
+
+    if (e->count == 0) {
+        compile_emit(this, OP_SEXPR);
+        compile_push(this, 1);
+        return 1;
+    }
+    if (e->count == 1) return compile_value(this, e->cell[0], tail);
+
+    if (
+        e->count == 4 &&
+        e->cell[0]->type == LVAL_SYM && e->cell[0]->sym == sym_if &&
+        e->cell[2]->type == LVAL_QEXPR && e->cell[3]->type == LVAL_QEXPR
+    ) {
+        return compile_if(this, form, tail);
+    }
+
+    folded = compile_fold(this, form);
+    if (folded) {
+        guard = compile_guard(this, OP_GUARD, form);
+        compile_emit(this, OP_CONST);
+        compile_emit(this, compile_const(this, folded));
+        compile_push(this, 1);
+        lval_del(folded);
+        this->code->ops[guard] = this->code->count;
+        return 1;
+    }
+
+    folded = compile_fusion(this, form);
+    if (folded) {
+        guard = compile_guard(this, OP_GUARD, form);
+        i = compile_fused(this, form, folded, tail);
+        lval_del(folded);
+        this->code->ops[guard] = this->code->count;
+        return i;
+    }
+
+    callee = compile_inlinable(this, form);
+    if (callee) {
+        guard = compile_guard(this, OP_GUARD, form);
+        i = compile_inline(this, callee, e, tail);
+        lval_del(callee);
+        this->code->ops[guard] = this->code->count;
+        return i;
+    }
+
+    for (i = 0; i < e->count; ++i) {
+        if (!compile_value(this, e->cell[i], 0)) return 0;
+    }
+    compile_emit(this, tail ? OP_TAILCALL : OP_CALL);
+    compile_emit(this, e->count);
+    this->depth -= e->count - 1;
+    return 1;
+}
+
+static code * compile_body(lambda *fun, lenv *env) {
+    int i;
+    int ok;
+    compiler cc;
+    code *c;
+
+    c = malloc(sizeof(code));
+    c->refs = 1;
+    c->count = 0;
+    c->cap = 0;
+    c->ops = NULL;
+    c->nconsts = 0;
+    c->consts = NULL;
+    c->nparams = 0;
+    c->params = malloc(sizeof(char*) * (fun->args->expr->count + 1));
+    c->depth = 0;
+    c->jit = NULL;
+    c->jit_tried = 0;
+    c->aot = NULL;
+    c->nassume = 0;
+    c->assume_syms = NULL;
+    c->assume_vals = NULL;
+    c->assume_epoch = lenv_epoch;
+    c->assume_dead = 0;
+    c->plain = NULL;
+    gc_track(&c->gc, GC_CODE);
+
+    cc.code = c;
+    cc.depth = 0;
+    cc.env = env;
+    cc.ninline = 0;
+    cc.inline_slots = NULL;
+
+    /* parameters are bound in order, skipping & */
+    for (i = 0; i < fun->args->expr->count; ++i) {
+        if (fun->args->expr->cell[i]->sym == sym_amp) continue;
+        if (compile_param(&cc, fun->args->expr->cell[i]->sym) >= 0) {
+            code_del(c);
+            return NULL;
+        }
+        c->params[c->nparams++] = fun->args->expr->cell[i]->sym;
+    }
+
+    ok = compile_form(&cc, fun->body, 1);
+
+    if (!ok) {
+        code_del(c);
+        return NULL;
+    }
+    compile_emit(&cc, OP_RETURN);
+    return c;
+}
+
+code * compile_lambda(lambda *fun) {
+    code *c;
+
+    if (!vm_enabled) return NULL;
+    if (!sym_if) sym_if = sym_intern("if");
+
+    c = compile_body(fun, fun->env);
+    if (c && c->nassume) c->plain = compile_body(fun, NULL);
+    return c;
+}
+
+/* whether the symbols this folded, fused or inlined still have in env the
+ * values it assumed; once one changed it never holds again */
+int code_valid(code *this, lenv *env) {
+    int i;
+    int ok = 1;
+    lval *v;
+
+    if (this->assume_dead) return 0;
+    if (this->assume_epoch == lenv_epoch) return 1;
+    this->assume_epoch = lenv_epoch;
+
+    for (i = 0; i < this->nassume; ++i) {
+        v = lenv_lookup(env, this->assume_syms[i]);
+        ok = v == this->assume_vals[i];
+        lval_del(v);
+        if (!ok) break;
+    }
+    if (!ok) this->assume_dead = 1;
+    return ok;
+}
+
+/* the code to run in env: this, unless a symbol it folded or inlined was
+ * rebound */
+code * code_current(code *this, lenv *env) {
+    if (!this->plain || code_valid(this, env)) return this;
+    return this->plain;
+}
+
+code * code_ref(code *this) {
+    this->refs++;
+    return this;
+}
+
+void code_del(code *this) {
+    int i;
+    if (--this->refs > 0) return;
+    for (i = 0; i < this->nconsts; ++i) lval_del(this->consts[i]);
+    free(this->consts);
+    free(this->ops);
+    free(this->params);
+    for (i = 0; i < this->nassume; ++i) {
+        lval_del(this->assume_syms[i]);
+        lval_del(this->assume_vals[i]);
+    }
+    free(this->assume_syms);
+    free(this->assume_vals);
+    if (this->plain) code_del(this->plain);
+    if (this->jit) jit_del(this->jit);
+    gc_untrack(&this->gc);
+    free(this);
+}
+
+void code_disassemble(code *this) {
+    int pc = 0;
+    int *ops = this->ops;
+
+    while (pc < this->count) {
+        printf("%4d  ", pc);
+        switch (ops[pc++]) {
+            case OP_CONST:
+                printf("CONST   ");
+                lval_print(this->consts[ops[pc++]]);
+            break;
+            case OP_LOCAL:
+                printf("LOCAL   %d (%s)", ops[pc], this->params[ops[pc]]);
+                pc++;
+            break;
+            case OP_GLOBAL:
+                printf("GLOBAL  %s", this->consts[ops[pc++]]->sym);
+            break;
+            case OP_SEXPR:
+                printf("SEXPR");
+            break;
+            case OP_CALL:
+                printf("CALL    %d", ops[pc++]);
+            break;
+            case OP_TAILCALL:
+                printf("TAILCALL %d", ops[pc++]);
+            break;
+            case OP_IF:
+            case OP_GUARD:
+                printf(ops[pc - 1] == OP_IF ? "IF      " : "GUARD   ");
+                printf("-> %d", ops[pc + 1]);
+                if (ops[pc + 2] >= 0) printf(" (inlined, %d)", ops[pc + 3]);
+                pc += 4;
+            break;
+            case OP_JUMPF:
+                printf("JUMPF   -> %d", ops[pc++]);
+            break;
+            case OP_JUMP:
+                printf("JUMP    -> %d", ops[pc++]);
+            break;
+            case OP_STACK:
+                printf("STACK   %d", ops[pc++]);
+            break;
+            case OP_SLIDE:
+                printf("SLIDE   %d", ops[pc++]);
+            break;
+            case OP_RETURN:
+                printf("RETURN");
+            break;
+            default:
+                assert(0);
+        }
+        putchar('\n');
+    }
+
+    if (this->nassume) {
+        printf("assumes");
+        for (pc = 0; pc < this->nassume; ++pc) {
+            printf(" %s", this->assume_syms[pc]->sym);
+        }
+        printf(this->assume_dead ? ", stale\n" : "\n");
+    }
+}
@@ -1,40 +1,201 @@
 #include "ownlisp.h"
 
+/* The cells of an expr live in base, inline in small for up to EXPR_SMALL
+ * of them, and cell points at the first one: popping the front only moves
+ * cell, and storage grows by doubling and never shrinks.
+ *
+ * Copies and slices of more than EXPR_SMALL cells do not copy anything:
+ * the cells move to a chunk shared by every expr viewing a range of them,
+ * which makes copying, tail and init O(1). A chunk never moves its cells
+ * and only hands out the free slots next to its first and last used ones,
+ * to the view that starts or ends there, so consing onto or appending to
+ * the latest view is O(1) too. Any other change gives the view its own
+ * cells first. */
+
+static chunk * chunk_new(lval **cell, int cap, int front, int back) {
+    chunk *r = pool_alloc(&chunk_pool);
+    r->refs = 1;
+    r->cell = cell;
+    r->cap = cap;
+    r->front = front;
+    r->back = back;
+    gc_track(&r->gc, GC_CHUNK);
+    return r;
+}
+
+chunk * chunk_ref(chunk *this) {
+    this->refs++;
+    return this;
+}
+
+void chunk_del(chunk *this) {
+    int i;
+    if (--this->refs > 0) return;
+    for (i = this->front; i < this->back; ++i) lval_del(this->cell[i]);
+    cells_free(this->cell, this->cap);
+    gc_untrack(&this->gc);
+    pool_free(&chunk_pool, this);
+}
+
+/* gives this fresh storage for at least n cells */
+static void expr_storage(expr *this, int n) {
+    int cap = EXPR_SMALL;
+
+    while (cap < n) cap <<= 1;
+    this->base = cap == EXPR_SMALL ? this->small : cells_alloc(cap);
+    this->cap = cap;
+}
+
+/* moves the cells to front cells into storage for at least n, growing it
+ * when needed */
+static void expr_place(expr *this, int front, int n) {
+    lval **base = this->base;
+    int cap = this->cap;
+
+    if (n > cap) {
+        while (cap < n) cap <<= 1;
+        base = cells_alloc(cap);
+    }
+    memmove(base + front, this->cell, sizeof(lval*) * this->count);
+    if (base != this->base) {
+        if (this->base != this->small) cells_free(this->base, this->cap);
+        this->base = base;
+        this->cap = cap;
+    }
+    this->cell = base + front;
+}
+
+/* gives a view its own storage for n cells, the first front of them free */
+static void expr_own(expr *this, int front, int n) {
+    int i;
+    chunk *c = this->shared;
+    lval **cell = this->cell;
+
+    expr_storage(this, n);
+    this->cell = this->base + front;
+    for (i = 0; i < this->count; ++i) this->cell[i] = lval_ref(cell[i]);
+    this->shared = NULL;
+    chunk_del(c);
+}
+
+/* moves the cells of this to a chunk, leaving this a view of it */
+static chunk * expr_share(expr *this) {
+    int front;
+
+    if (this->shared) return this->shared;
+    if (this->base == this->small) expr_place(this, 0, EXPR_SMALL + 1);
+    front = this->cell - this->base;
+    this->shared = chunk_new(
+        this->base, this->cap, front, front + this->count
+    );
+    this->base = NULL;
+    this->cap = 0;
+    return this->shared;
+}
+
+/* an expr of count cells for the caller to fill */
+expr * expr_new(int count) {
+    expr *r = pool_alloc(&expr_pool);
+    expr_storage(r, count);
+    r->cell = r->base;
+    r->count = count;
+    r->shared = NULL;
+    return r;
+}
+
 void expr_del(expr *this) {
     int i;
-    for (i = 0; i < this->count; ++i) {
-        lval_del(this->cell[i]);
+    if (this->shared) chunk_del(this->shared);
+    else {
+        for (i = 0; i < this->count; ++i) {
+            if (this->cell[i]) lval_del(this->cell[i]);
+        }
+        if (this->base != this->small) cells_free(this->base, this->cap);
     }
-    if (this->cell) free(this->cell);
-    free(this);
+    pool_free(&expr_pool, this);
 }
 
 expr * expr_copy(expr *this) {
+    return expr_sub(this, 0, this->count);
+}
+
+/* a new expr with the cells of this from from to to - 1 */
+expr * expr_sub(expr *this, int from, int to) {
     int i;
-    expr *r = malloc(sizeof(expr));
-    r->count = this->count;
-    r->cell = malloc(sizeof(lval*) * r->count);
+    expr *r;
+
+    if (to - from > EXPR_SMALL) {
+        r = pool_alloc(&expr_pool);
+        r->shared = chunk_ref(expr_share(this));
+        r->cell = this->cell + from;
+        r->count = to - from;
+        r->base = NULL;
+        r->cap = 0;
+        return r;
+    }
+
+    r = expr_new(to - from);
     for(i = 0; i < r->count; ++i) {
-        r->cell[i]  = lval_copy(this->cell[i]);
+        r->cell[i] = lval_ref(this->cell[from + i]);
     }
     return r;
 }
 
+/* makes room for n cells from the first one */
+void expr_reserve(expr *this, int n) {
+    chunk *c = this->shared;
+
+    if (c) {
+        if (
+            this->cell + this->count != c->cell + c->back ||
+            this->cell - c->cell + n > c->cap
+        ) {
+            expr_own(this, 0, n);
+        }
+        return;
+    }
+    if (this->cell - this->base + n > this->cap) expr_place(this, 0, n);
+}
+
 expr * expr_append(expr *this, lval *x) {
-    this->count++;
-    this->cell = realloc(this->cell, sizeof(lval*) * this->count);
-    this->cell[this->count - 1] = x;
+    expr_reserve(this, this->count + 1);
+    if (this->shared) this->shared->back++;
+    this->cell[this->count++] = x;
     return this;
 }
 
-expr * expr_prepend(expr *this, lval *x) {
+/* appends references to every cell of x */
+expr * expr_concat(expr *this, expr *x) {
     int i;
-    this->count++;
-    this->cell = realloc(this->cell, sizeof(lval*) * this->count);
-    for(i = this->count - 1; i > 0; --i) {
-        this->cell[i] = this->cell[i-1];
+    expr_reserve(this, this->count + x->count);
+    if (this->shared) this->shared->back += x->count;
+    for(i = 0; i < x->count; ++i) {
+        this->cell[this->count++] = lval_ref(x->cell[i]);
+    }
+    return this;
+}
+
+expr * expr_prepend(expr *this, lval *x) {
+    chunk *c = this->shared;
+
+    if (c && this->cell == c->cell + c->front && c->front > 0) c->front--;
+    else if (c || this->cell == this->base) {
+        /* leave as much room in front as there are cells */
+        if (c) expr_own(this, this->count + 1, 2 * this->count + 1);
+        else expr_place(this, this->count + 1, 2 * this->count + 1);
     }
+    this->cell--;
     this->cell[0] = x;
+    this->count++;
+    return this;
+}
+
+/* prepends references to every cell of x */
+expr * expr_unshift(expr *this, expr *x) {
+    int i;
+    for(i = x->count - 1; i >= 0; --i) {
+        expr_prepend(this, lval_ref(x->cell[i]));
+    }
     return this;
 }
 
@@ -54,14 +215,24 @@ lval * expr_pop(expr *this, int i) {
     if (i >= this->count) {
         return LERR_OVERFLOW;
     }
+    if (this->shared) {
+        if (i != 0 && i != this->count - 1) expr_own(this, 0, this->count);
+        else {
+            this->count--;
+            return lval_ref(i == 0 ? *this->cell++ : this->cell[i]);
+        }
+    }
     lval *r = this->cell[i];
     assert(r);
     this->count--;
-    memmove(
-        this->cell + i, this->cell + i + 1,
-        sizeof(lval*) * (this->count - i)
-    );
-    this->cell = realloc(this->cell, sizeof(lval*) * this->count);
+    if (i == 0) this->cell++;
+    else {
+        memmove(
+            this->cell + i, this->cell + i + 1,
+            sizeof(lval*) * (this->count - i)
+        );
+    }
+    if (this->count == 0) this->cell = this->base;
     return r;
 }
 
@@ -75,21 +246,68 @@ lval * expr_pop_typed(expr *this, int type) {
     return r;
 }
 
-lval * expr_eval(expr *this, lenv *env) {
+lval * args_take(lval **args, int i) {
+    lval *r = args[i];
+    args[i] = NULL;
+    return r;
+}
+
+/* NULL if args[from] to args[to - 1] all have type, otherwise the first
+ * error among them or a type error */
+lval * args_check(lval **args, int from, int to, int type) {
     int i;
-    lval *head;
+    for (i = from; i < to; ++i) {
+        if (args[i]->type == LVAL_ERR) return lval_ref(args[i]);
+        if (args[i]->type != type) return LERR_BAD_TYPE;
+    }
+    return NULL;
+}
 
-    for(i = 0; i < this->count; ++i) {
-        this->cell[i] = lval_eval(this->cell[i], env);
-        if (this->cell[i]->type == LVAL_ERR) return expr_pop(this, i);
+void args_release(lval **args, int count) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (args[i]) lval_del(args[i]);
     }
+}
 
+/* Evaluates this as a form, leaving it untouched: the arguments are
+ * evaluated into a fresh expr that the callee is free to consume. */
+lval * expr_eval(expr *this, lenv *env) {
+    int i;
+    int n = this->count - 1;
+    lval *head;
+    lval *r;
+    expr *args;
+
+    if (vm_stack_check()) return LERR_DEPTH;
     if (this->count == 0) return lval_sexpr();
-    if (this->count == 1) return expr_pop(this, 0);
 
-    head = expr_pop(this, 0);
+    head = lval_eval(lval_ref(this->cell[0]), env);
+    if (n == 0 || head->type == LVAL_ERR) return head;
 
-    return lval_call(head, this, env);
+    if (head->type == LVAL_BUILTIN && n <= 3) {
+        r = fuse_eval(this, head, env);
+        if (r) {
+            lval_del(head);
+            return r;
+        }
+    }
+
+    args = expr_new(n);
+    for(i = 0; i < n; ++i) {
+        r = lval_eval(lval_ref(this->cell[i + 1]), env);
+        if (r->type == LVAL_ERR) {
+            args->count = i;
+            expr_del(args);
+            lval_del(head);
+            return r;
+        }
+        args->cell[i] = r;
+    }
+
+    r = lval_call(head, args, env);
+    expr_del(args);
+    return r;
 }
 
 int expr_eq(expr *x, expr *y) {
@@ -0,0 +1,309 @@
+#include "ownlisp.h"
+
+/* Loop fusion for list pipelines.
+ *
+ * (foldl f z (filter p (map g l))) builds two lists only to walk each of
+ * them once. When a call to map, filter, foldl or len gets its list from
+ * a call to map or filter, the whole chain runs as one loop instead: each
+ * element of the innermost list goes through every stage before the next
+ * one is read, and only the outermost stage builds anything. The tree
+ * walker fuses the calls it evaluates, the compiler the calls in a lambda
+ * body, recording the builtins it relied on like it does for folding.
+ *
+ * Arguments are still evaluated in the order they are written, and each
+ * stage evaluates the elements it gets like the unfused builtin would;
+ * only the calls of the stages' functions interleave. A chain therefore
+ * runs fused only when those functions are pure (see compile_pure_call)
+ * and no element calls anything when evaluated. Otherwise, and as soon as
+ * a stage fails, the builtins run one after the other from the start:
+ * nothing done fused before can be told apart, and the side effects and
+ * the error are those of the unfused calls. A chain whose innermost list
+ * is not a Q-Expression runs them one after the other too.
+ *
+ * A plan is a Q-Expression naming the stages from the outermost. fuse_run
+ * gets the plan, then the arguments of every stage but its list, from the
+ * outermost, and last the innermost list. OWNLISP_FUSE=0 turns it off. */
+
+#define FUSE_STAGES 8
+
+enum { FUSE_MAP, FUSE_FILTER, FUSE_FOLDL, FUSE_LEN };
+
+int fuse_enabled = 1;
+
+static char *fuse_names[4];
+static int fuse_arity[] = { 2, 2, 3, 1 };
+static lprim fuse_prims[] = {
+    builtin_map, builtin_filter, builtin_foldl, builtin_len
+};
+
+void fuse_init(void) {
+    char *s = getenv("OWNLISP_FUSE");
+    if (s) fuse_enabled = strtol(s, NULL, 10) != 0;
+}
+
+static int fuse_kind(lval *f) {
+    int i;
+    if (f->type != LVAL_BUILTIN) return -1;
+    for (i = 0; i < 4; ++i) {
+        if (f->builtin == fuse_prims[i]) return i;
+    }
+    return -1;
+}
+
+/* the stage sym of a plan names */
+static int fuse_kind_of(char *sym) {
+    int i;
+    for (i = 0; i < 4; ++i) {
+        if (fuse_names[i] == sym) return i;
+    }
+    return -1;
+}
+
+/* looks sym up with a fresh symbol, leaving the caches of form alone */
+static int fuse_lookup(lenv *env, char *sym) {
+    int r;
+    lval *s = lval_sym(sym);
+    lval *v = lenv_lookup(env, s);
+    r = fuse_kind(v);
+    lval_del(s);
+    lval_del(v);
+    return r;
+}
+
+/* The plan of form, a call to head, or NULL if there is nothing to fuse.
+ * The heads of the inner calls are looked up in env. */
+lval * fuse_plan(expr *form, lval *head, lenv *env) {
+    int i;
+    int n = 1;
+    int kind[FUSE_STAGES];
+    lval *x;
+    lval *r;
+
+    if (!fuse_enabled) return NULL;
+    kind[0] = fuse_kind(head);
+    if (kind[0] < 0 || form->count != fuse_arity[kind[0]] + 1) return NULL;
+
+    while (n < FUSE_STAGES) {
+        x = form->cell[form->count - 1];
+        if (x->type != LVAL_SEXPR || x->expr->count != 3) break;
+        if (x->expr->cell[0]->type != LVAL_SYM) break;
+        kind[n] = fuse_lookup(env, x->expr->cell[0]->sym);
+        if (kind[n] != FUSE_MAP && kind[n] != FUSE_FILTER) break;
+        form = x->expr;
+        n++;
+    }
+    if (n < 2) return NULL;
+
+    if (!fuse_names[0]) {
+        fuse_names[FUSE_MAP] = sym_intern("map");
+        fuse_names[FUSE_FILTER] = sym_intern("filter");
+        fuse_names[FUSE_FOLDL] = sym_intern("foldl");
+        fuse_names[FUSE_LEN] = sym_intern("len");
+    }
+    r = lval_qexpr();
+    for (i = 0; i < n; ++i) lval_append(r, lval_sym(fuse_names[kind[i]]));
+    return r;
+}
+
+/* The value of form run fused, or NULL if it does not fuse. head is the
+ * value of its first cell. */
+lval * fuse_eval(expr *form, lval *head, lenv *env) {
+    int i;
+    int j;
+    lval *x;
+    lval *r;
+    lval *plan = fuse_plan(form, head, env);
+    expr *args;
+
+    if (!plan) return NULL;
+
+    args = expr_append(expr_new(0), plan);
+    for (i = 0; i < plan->expr->count; ++i) {
+        if (i) form = form->cell[form->count - 1]->expr;
+        for (j = 1; j < form->count - 1; ++j) {
+            x = lval_eval(lval_ref(form->cell[j]), env);
+            if (x->type == LVAL_ERR) {
+                expr_del(args);
+                return x;
+            }
+            args = expr_append(args, x);
+        }
+    }
+    x = lval_eval(lval_ref(form->cell[form->count - 1]), env);
+    if (x->type == LVAL_ERR) {
+        expr_del(args);
+        return x;
+    }
+    args = expr_append(args, x);
+
+    r = fuse_run(args->cell, args->count, env);
+    expr_del(args);
+    return r;
+}
+
+/* calls f with the n values in argv, consumed */
+static lval * fuse_call(lval *f, lval **argv, int n, lenv *env) {
+    int i;
+    lval *r;
+    expr *e = expr_new(n);
+
+    for (i = 0; i < n; ++i) e->cell[i] = argv[i];
+    r = lval_call(lval_ref(f), e, env);
+    expr_del(e);
+    return r;
+}
+
+/* whether the functions of the n stages in args are pure */
+static int fuse_pure(lval **args, int n, int *kind, int *first) {
+    int s;
+    for (s = 0; s < n; ++s) {
+        if (kind[s] != FUSE_LEN && !compile_pure_call(args[first[s]])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* the stages one after the other, from the innermost */
+static lval * fuse_unfused(
+    lval **args, int count, int n, int *kind, int *first, lenv *env
+) {
+    int i;
+    int j;
+    int m;
+    lval *argv[3];
+    lval *r = args_take(args, count - 1);
+
+    for (i = n - 1; i >= 0; --i) {
+        m = fuse_arity[kind[i]];
+        for (j = 0; j < m - 1; ++j) argv[j] = lval_ref(args[first[i] + j]);
+        argv[m - 1] = r;
+        r = fuse_prims[kind[i]](argv, m, env);
+        args_release(argv, m);
+    }
+    return r;
+}
+
+lval * fuse_run(lval **args, int count, lenv *env) {
+    int i;
+    int s;
+    int n;
+    int keep;
+    int kind[FUSE_STAGES];
+    int first[FUSE_STAGES];
+    long len = 0;
+    lval *f;
+    lval *x;
+    lval *y;
+    lval *raw;
+    lval *r = NULL;
+    lval *argv[2];
+    expr *l;
+    expr *e = NULL;
+
+    n = args[0]->expr->count;
+    for (s = 0, i = 1; s < n; ++s) {
+        kind[s] = fuse_kind_of(args[0]->expr->cell[s]->sym);
+        first[s] = i;
+        i += fuse_arity[kind[s]] - 1;
+    }
+    if (i != count - 1) return LERR_BAD_ARITY;
+
+    for (i = 1; i < count; ++i) {
+        if (args[i]->type == LVAL_ERR) return lval_ref(args[i]);
+    }
+    if (
+        args[count - 1]->type != LVAL_QEXPR ||
+        !fuse_pure(args, n, kind, first)
+    ) {
+        return fuse_unfused(args, count, n, kind, first, env);
+    }
+
+    l = args[count - 1]->expr;
+    if (kind[0] == FUSE_FOLDL) r = lval_ref(args[first[0] + 1]);
+    if (kind[0] == FUSE_MAP || kind[0] == FUSE_FILTER) {
+        e = expr_new(l->count);
+        e->count = 0;
+    }
+
+    for (i = 0; i < l->count; ++i) {
+        /* the element as the stage would find it in its list, each stage
+         * evaluates it again */
+        raw = lval_ref(l->cell[i]);
+        for (s = n - 1; s >= 0 && raw; --s) {
+            if (kind[s] == FUSE_LEN) {
+                lval_del(raw);
+                raw = NULL;
+                len++;
+                break;
+            }
+            if (raw->type == LVAL_SEXPR) {
+                y = NULL;
+                goto fail;
+            }
+
+            x = lval_eval(lval_ref(raw), env);
+            if (x->type == LVAL_ERR) {
+                y = x;
+                goto fail;
+            }
+            f = args[first[s]];
+
+            switch (kind[s]) {
+                case FUSE_MAP:
+                    y = fuse_call(f, &x, 1, env);
+                    if (y->type == LVAL_ERR) goto fail;
+                    lval_del(raw);
+                    raw = y;
+                break;
+                case FUSE_FILTER:
+                    y = fuse_call(f, &x, 1, env);
+                    if (y->type != LVAL_BOOLEAN) {
+                        if (y->type != LVAL_ERR) {
+                            lval_del(y);
+                            y = LERR_BAD_TYPE;
+                        }
+                        goto fail;
+                    }
+                    keep = y->boolean;
+                    lval_del(y);
+                    if (!keep) {
+                        lval_del(raw);
+                        raw = NULL;
+                    }
+                break;
+                case FUSE_FOLDL:
+                    argv[0] = r;
+                    argv[1] = x;
+                    r = fuse_call(f, argv, 2, env);
+                    lval_del(raw);
+                    raw = NULL;
+                    if (r->type == LVAL_ERR) {
+                        y = r;
+                        r = NULL;
+                        goto fail;
+                    }
+                break;
+            }
+        }
+        if (raw) e->cell[e->count++] = raw;
+    }
+
+    if (kind[0] == FUSE_FOLDL) return r;
+    if (kind[0] == FUSE_LEN) return lval_num(len);
+    if (!e->count) {
+        expr_del(e);
+        return lval_nil();
+    }
+    r = lval_qexpr();
+    expr_del(r->expr);
+    r->expr = e;
+    return r;
+
+fail:
+    if (raw) lval_del(raw);
+    if (r) lval_del(r);
+    if (e) expr_del(e);
+    if (y) lval_del(y);
+    return fuse_unfused(args, count, n, kind, first, env);
+}
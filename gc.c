@@ -0,0 +1,374 @@
+#include <limits.h>
+#include <stddef.h>
+
+#include "ownlisp.h"
+
+/* Cycle collector.
+ *
+ * Reference counting frees everything except cycles, so only the nodes
+ * that can be part of one are tracked: containers (S-Expressions,
+ * Q-Expressions, lambdas, vectors, maps, lazy sequences and delays),
+ * environments, which lambdas capture, compiled code, which holds the
+ * constants of a lambda body, the chunks of cells expressions share and
+ * the nodes of vectors and maps. A collection subtracts the references
+ * tracked nodes hold on each other: whatever keeps a positive count is
+ * referenced from outside the heap (the global lenv held by main or the C
+ * evaluation stack) and is a root. Everything reachable from the roots is
+ * marked, the rest is garbage.
+ *
+ * Each thread tracks the nodes it allocates on its own list and collects
+ * only those; nodes on other lists are treated as roots. A thread handing
+ * its values over to another moves its list there with gc_adopt. */
+
+/* counts can go negative while the evaluator holds stale cell pointers */
+#define GC_REACHABLE INT_MIN
+
+#define GC_LVAL_OF(h) ((lval *)((char *)(h) - offsetof(lval, gc)))
+#define GC_LENV_OF(h) ((lenv *)((char *)(h) - offsetof(lenv, gc)))
+#define GC_CODE_OF(h) ((code *)((char *)(h) - offsetof(code, gc)))
+#define GC_CHUNK_OF(h) ((chunk *)((char *)(h) - offsetof(chunk, gc)))
+#define GC_VNODE_OF(h) ((vnode *)((char *)(h) - offsetof(vnode, gc)))
+#define GC_MNODE_OF(h) ((mnode *)((char *)(h) - offsetof(mnode, gc)))
+
+long gc_threshold = GC_DEFAULT_THRESHOLD;
+
+/* empty until the thread tracks its first node */
+static __thread gchead gc_list;
+static __thread long gc_allocs = 0;
+static __thread int gc_running = 0;
+
+static __thread gchead **gc_stack = NULL;
+static __thread int gc_sp = 0;
+static __thread int gc_cap = 0;
+
+static gchead * gc_heap_init(void) {
+    if (!gc_list.next) gc_list.next = gc_list.prev = &gc_list;
+    return &gc_list;
+}
+
+static void gc_push(gchead *h) {
+    if (gc_sp == gc_cap) {
+        gc_cap = gc_cap ? gc_cap * 2 : 256;
+        gc_stack = realloc(gc_stack, sizeof(gchead*) * gc_cap);
+    }
+    gc_stack[gc_sp++] = h;
+}
+
+static void gc_visit_expr(expr *this, void (*fn)(gchead *child)) {
+    int i;
+    if (!this) return;
+    if (this->shared) {
+        fn(&this->shared->gc);
+        return;
+    }
+    /* cells taken by a running builtin are NULL */
+    for (i = 0; i < this->count; ++i) {
+        if (this->cell[i]) fn(&this->cell[i]->gc);
+    }
+}
+
+static void gc_visit(gchead *h, void (*fn)(gchead *child)) {
+    int i;
+    lval *v;
+    lenv *e;
+    code *c;
+    chunk *k;
+    vnode *n;
+    mnode *m;
+
+    if (h->kind == GC_CHUNK) {
+        k = GC_CHUNK_OF(h);
+        for (i = k->front; i < k->back; ++i) fn(&k->cell[i]->gc);
+        return;
+    }
+    if (h->kind == GC_MNODE) {
+        m = GC_MNODE_OF(h);
+        for (i = 0; i < m->n; ++i) {
+            if (m->slot[i].key) {
+                fn(&m->slot[i].key->gc);
+                fn(&m->slot[i].val->gc);
+            }
+            else {
+                fn(&m->slot[i].node->gc);
+            }
+        }
+        return;
+    }
+    if (h->kind == GC_VNODE) {
+        n = GC_VNODE_OF(h);
+        if (n->height) {
+            if (n->left) fn(&n->left->gc);
+            if (n->right) fn(&n->right->gc);
+        }
+        else {
+            for (i = 0; i < n->count; ++i) fn(&n->cell[i]->gc);
+        }
+        return;
+    }
+    if (h->kind == GC_LENV) {
+        e = GC_LENV_OF(h);
+        for (i = 0; i < e->count; ++i) fn(&e->vals[i]->gc);
+        if (e->parent) fn(&e->parent->gc);
+        return;
+    }
+    if (h->kind == GC_CODE) {
+        c = GC_CODE_OF(h);
+        for (i = 0; i < c->nconsts; ++i) fn(&c->consts[i]->gc);
+        for (i = 0; i < c->nassume; ++i) fn(&c->assume_vals[i]->gc);
+        if (c->plain) fn(&c->plain->gc);
+        if (c->jit) jit_visit(c->jit, fn);
+        return;
+    }
+
+    v = GC_LVAL_OF(h);
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            gc_visit_expr(v->expr, fn);
+        break;
+        case LVAL_VECTOR:
+            if (v->vec) fn(&v->vec->gc);
+        break;
+        case LVAL_MAP:
+            if (v->map) fn(&v->map->gc);
+        break;
+        case LVAL_SEQ:
+            if (!v->seq) break;
+            if (v->seq->fn) fn(&v->seq->fn->gc);
+            if (v->seq->env) fn(&v->seq->env->gc);
+            if (v->seq->src) fn(&v->seq->src->gc);
+        break;
+        case LVAL_DELAY:
+            if (v->delay_body) fn(&v->delay_body->gc);
+            if (v->delay_env) fn(&v->delay_env->gc);
+            if (v->delay_value) fn(&v->delay_value->gc);
+        break;
+        case LVAL_LAMBDA:
+            if (!v->fun) break;
+            if (v->fun->env) fn(&v->fun->env->gc);
+            if (v->fun->code) fn(&v->fun->code->gc);
+            if (v->fun->args) fn(&v->fun->args->gc);
+            if (v->fun->body) fn(&v->fun->body->gc);
+        break;
+    }
+}
+
+static void gc_subtract(gchead *child) {
+    if (child->next) child->refs--;
+}
+
+static void gc_mark(gchead *child) {
+    if (child->next && child->refs != GC_REACHABLE) {
+        child->refs = GC_REACHABLE;
+        gc_push(child);
+    }
+}
+
+static int gc_refs(gchead *h) {
+    if (h->kind == GC_LENV) return GC_LENV_OF(h)->refs;
+    if (h->kind == GC_CODE) return GC_CODE_OF(h)->refs;
+    if (h->kind == GC_CHUNK) return GC_CHUNK_OF(h)->refs;
+    if (h->kind == GC_VNODE) return GC_VNODE_OF(h)->refs;
+    if (h->kind == GC_MNODE) return GC_MNODE_OF(h)->refs;
+    return GC_LVAL_OF(h)->refs;
+}
+
+static void gc_hold(gchead *h) {
+    if (h->kind == GC_LENV) lenv_ref(GC_LENV_OF(h));
+    else if (h->kind == GC_CODE) code_ref(GC_CODE_OF(h));
+    else if (h->kind == GC_CHUNK) chunk_ref(GC_CHUNK_OF(h));
+    else if (h->kind == GC_VNODE) vnode_ref(GC_VNODE_OF(h));
+    else if (h->kind == GC_MNODE) mnode_ref(GC_MNODE_OF(h));
+    else lval_ref(GC_LVAL_OF(h));
+}
+
+/* drop everything a garbage node points to, leaving an empty shell */
+static void gc_clear(gchead *h) {
+    int i;
+    lval *v;
+    lenv *e;
+    code *c;
+    chunk *k;
+    vnode *n;
+    mnode *m;
+
+    if (h->kind == GC_CHUNK) {
+        k = GC_CHUNK_OF(h);
+        for (i = k->front; i < k->back; ++i) lval_del(k->cell[i]);
+        k->front = k->back = 0;
+        return;
+    }
+    if (h->kind == GC_MNODE) {
+        m = GC_MNODE_OF(h);
+        for (i = 0; i < m->n; ++i) {
+            if (m->slot[i].key) {
+                lval_del(m->slot[i].key);
+                lval_del(m->slot[i].val);
+            }
+            else {
+                mnode_del(m->slot[i].node);
+            }
+        }
+        m->n = 0;
+        return;
+    }
+    if (h->kind == GC_VNODE) {
+        n = GC_VNODE_OF(h);
+        if (n->height) {
+            vnode_del(n->left);
+            vnode_del(n->right);
+            n->left = n->right = NULL;
+        }
+        else {
+            for (i = 0; i < n->count; ++i) lval_del(n->cell[i]);
+            n->count = 0;
+        }
+        return;
+    }
+    if (h->kind == GC_LENV) {
+        e = GC_LENV_OF(h);
+        for (i = 0; i < e->count; ++i) lval_del(e->vals[i]);
+        e->count = 0;
+        if (e->parent) lenv_del(e->parent);
+        e->parent = NULL;
+        return;
+    }
+    if (h->kind == GC_CODE) {
+        c = GC_CODE_OF(h);
+        for (i = 0; i < c->nconsts; ++i) lval_del(c->consts[i]);
+        c->nconsts = 0;
+        for (i = 0; i < c->nassume; ++i) {
+            lval_del(c->assume_syms[i]);
+            lval_del(c->assume_vals[i]);
+        }
+        c->nassume = 0;
+        if (c->plain) code_del(c->plain);
+        c->plain = NULL;
+        if (c->jit) jit_del(c->jit);
+        c->jit = NULL;
+        return;
+    }
+
+    v = GC_LVAL_OF(h);
+    if (v->type == LVAL_LAMBDA) {
+        if (v->fun) lambda_del(v->fun);
+        v->fun = NULL;
+    }
+    else if (v->type == LVAL_VECTOR) {
+        vnode_del(v->vec);
+        v->vec = NULL;
+    }
+    else if (v->type == LVAL_MAP) {
+        mnode_del(v->map);
+        v->map = NULL;
+    }
+    else if (v->type == LVAL_SEQ) {
+        if (v->seq) seq_del(v->seq);
+        v->seq = NULL;
+    }
+    else if (v->type == LVAL_DELAY) {
+        if (v->delay_body) lval_del(v->delay_body);
+        if (v->delay_env) lenv_del(v->delay_env);
+        if (v->delay_value) lval_del(v->delay_value);
+        v->delay_body = v->delay_value = NULL;
+        v->delay_env = NULL;
+    }
+    else {
+        if (v->expr) expr_del(v->expr);
+        v->expr = NULL;
+    }
+}
+
+static void gc_release(gchead *h) {
+    if (h->kind == GC_LENV) lenv_del(GC_LENV_OF(h));
+    else if (h->kind == GC_CODE) code_del(GC_CODE_OF(h));
+    else if (h->kind == GC_CHUNK) chunk_del(GC_CHUNK_OF(h));
+    else if (h->kind == GC_VNODE) vnode_del(GC_VNODE_OF(h));
+    else if (h->kind == GC_MNODE) mnode_del(GC_MNODE_OF(h));
+    else lval_del(GC_LVAL_OF(h));
+}
+
+void gc_init(void) {
+    char *s = getenv("OWNLISP_GC_THRESHOLD");
+    if (s) gc_threshold = strtol(s, NULL, 10);
+}
+
+void gc_track(gchead *this, int kind) {
+    gc_heap_init();
+    this->kind = kind;
+    this->next = gc_list.next;
+    this->prev = &gc_list;
+    gc_list.next->prev = this;
+    gc_list.next = this;
+    gc_allocs++;
+}
+
+void gc_untrack(gchead *this) {
+    this->prev->next = this->next;
+    this->next->prev = this->prev;
+    this->next = this->prev = NULL;
+}
+
+void gc_poll(void) {
+    if (gc_threshold > 0 && gc_allocs >= gc_threshold) gc_collect();
+}
+
+int gc_collect(void) {
+    gchead *h;
+    int i;
+    int n;
+
+    if (gc_running) return 0;
+    gc_heap_init();
+    gc_running = 1;
+    gc_allocs = 0;
+
+    for (h = gc_list.next; h != &gc_list; h = h->next) {
+        h->refs = gc_refs(h);
+    }
+    for (h = gc_list.next; h != &gc_list; h = h->next) {
+        gc_visit(h, gc_subtract);
+    }
+
+    /* mark from roots */
+    for (h = gc_list.next; h != &gc_list; h = h->next) {
+        if (h->refs > 0) {
+            h->refs = GC_REACHABLE;
+            gc_push(h);
+        }
+    }
+    while (gc_sp) gc_visit(gc_stack[--gc_sp], gc_mark);
+
+    /* sweep: hold every garbage node, break its links, then release it */
+    for (h = gc_list.next; h != &gc_list; h = h->next) {
+        if (h->refs != GC_REACHABLE) {
+            gc_hold(h);
+            gc_push(h);
+        }
+    }
+    n = gc_sp;
+    for (i = 0; i < n; ++i) gc_clear(gc_stack[i]);
+    for (i = 0; i < n; ++i) gc_release(gc_stack[i]);
+    gc_sp = 0;
+
+    gc_running = 0;
+    return n;
+}
+
+/* the list of nodes the calling thread tracks */
+gchead * gc_heap(void) {
+    return gc_heap_init();
+}
+
+/* Moves the nodes on heap, the list of a thread not running meanwhile, to
+ * the calling thread's list. */
+void gc_adopt(gchead *heap) {
+    gc_heap_init();
+    if (!heap->next || heap->next == heap) return;
+
+    heap->next->prev = &gc_list;
+    heap->prev->next = gc_list.next;
+    gc_list.next->prev = heap->prev;
+    gc_list.next = heap->next;
+    heap->next = heap->prev = heap;
+}
@@ -0,0 +1,576 @@
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+
+#include "ownlisp.h"
+
+/* Template JIT for numeric lambdas.
+ *
+ * A lambda whose body only uses numbers, its parameters, + - * / % and
+ * two argument comparisons, if with literal branches, and calls to itself
+ * or to other jitted lambdas is translated to x86-64, one fixed template
+ * per form. Numbers are raw 64 bit integers held in rax, temporaries go
+ * on the machine stack.
+ *
+ * Such bodies have no side effects, so whenever the native code meets
+ * something it does not handle (a division by zero or of the smallest
+ * number by -1, running low on C stack, nesting calls deeper than the VM
+ * would let its frames go) it bails out and the whole call is run again
+ * by the VM, which then produces the proper result or error. Calls nested in that run stay
+ * in the VM too, or a deep recursion would bail out again at every level.
+ * Calls with non number arguments never enter native code.
+ *
+ * The native code assumes the global symbols it uses keep the values they
+ * had when it was compiled. def and = bump lenv_epoch; the first call in
+ * a new epoch looks the symbols up again and drops the native code for
+ * good if any of them changed. */
+
+enum { JIT_NUM = 1, JIT_BOOL };
+
+struct jit {
+    unsigned char *mem;
+    size_t size;
+    int (*fn)(long *args, long *out);
+    int type;
+    /* symbols the code depends on, and the values they had */
+    int nassume;
+    lval **syms;
+    lval **vals;
+    unsigned long epoch;
+    int dead;
+    /* the stack limit the code checks, the compiling thread's */
+    char **floor;
+};
+
+int jit_enabled = 0;
+
+/* VM depth of the last bail out, no native code runs deeper than it */
+static __thread int jit_suspended = -1;
+/* native calls that can still nest before reaching vm_max_depth */
+static __thread long jit_room;
+
+#if defined(__x86_64__)
+
+typedef struct {
+    jit *jit;
+    lval *self;
+    code *code;
+    lenv *env;
+    unsigned char *buf;
+    int count;
+    int cap;
+    /* rel32 slots that jump to the bail out path */
+    int *bails;
+    int nbails;
+    /* where the body starts, for self tail calls */
+    int start;
+} jitter;
+
+static void jit_byte(jitter *this, int b) {
+    if (this->count == this->cap) {
+        this->cap = this->cap ? this->cap * 2 : 256;
+        this->buf = realloc(this->buf, this->cap);
+    }
+    this->buf[this->count++] = b;
+}
+
+static void jit_bytes(jitter *this, const char *s, int n) {
+    while (n--) jit_byte(this, (unsigned char)*s++);
+}
+
+static void jit_int32(jitter *this, int x) {
+    int i;
+    for (i = 0; i < 4; ++i) jit_byte(this, (x >> (8 * i)) & 0xff);
+}
+
+static void jit_int64(jitter *this, long x) {
+    int i;
+    for (i = 0; i < 8; ++i) jit_byte(this, (x >> (8 * i)) & 0xff);
+}
+
+#define JIT_EMIT(this, s) jit_bytes((this), (s), sizeof(s) - 1)
+
+/* emits a rel32 placeholder and returns its offset */
+static int jit_hole(jitter *this) {
+    int r = this->count;
+    jit_int32(this, 0);
+    return r;
+}
+
+static void jit_patch(jitter *this, int hole, int to) {
+    int rel = to - (hole + 4);
+    memcpy(this->buf + hole, &rel, 4);
+}
+
+static void jit_bail_hole(jitter *this) {
+    this->bails = realloc(this->bails, sizeof(int) * (this->nbails + 1));
+    this->bails[this->nbails++] = jit_hole(this);
+}
+
+/* mov rax, imm64 */
+static void jit_mov_rax(jitter *this, long x) {
+    JIT_EMIT(this, "\x48\xb8");
+    jit_int64(this, x);
+}
+
+/* the value symbol sym has for the lambda, recorded as an assumption */
+static lval * jit_resolve(jitter *this, lval *sym) {
+    jit *j = this->jit;
+    lval *v = lenv_lookup(this->env, sym);
+
+    if (v->type == LVAL_ERR) {
+        lval_del(v);
+        return NULL;
+    }
+    j->syms = realloc(j->syms, sizeof(lval*) * (j->nassume + 1));
+    j->vals = realloc(j->vals, sizeof(lval*) * (j->nassume + 1));
+    j->syms[j->nassume] = lval_ref(sym);
+    j->vals[j->nassume] = v;
+    j->nassume++;
+    return v;
+}
+
+static int jit_param(jitter *this, char *sym) {
+    int i;
+    for (i = 0; i < this->code->nparams; ++i) {
+        if (this->code->params[i] == sym) return i;
+    }
+    return -1;
+}
+
+static int jit_form(jitter *this, lval *form, int tail);
+
+/* a value into rax, returns its type or 0 */
+static int jit_value(jitter *this, lval *v, int tail) {
+    int i;
+
+    switch (v->type) {
+        case LVAL_NUM:
+            jit_mov_rax(this, v->num);
+            return JIT_NUM;
+        case LVAL_BOOLEAN:
+            jit_mov_rax(this, v->boolean);
+            return JIT_BOOL;
+        case LVAL_SYM:
+            i = jit_param(this, v->sym);
+            if (i >= 0) { /* mov rax, [rbx + 8i] */
+                JIT_EMIT(this, "\x48\x8b\x83");
+                jit_int32(this, 8 * i);
+                return JIT_NUM;
+            }
+            v = jit_resolve(this, v);
+            if (!v) return 0;
+            if (v->type == LVAL_NUM) return jit_value(this, v, tail);
+            if (v->type == LVAL_BOOLEAN) return jit_value(this, v, tail);
+            return 0;
+        case LVAL_SEXPR:
+            return jit_form(this, v, tail);
+        default:
+            return 0;
+    }
+}
+
+/* rax = first operand, rcx = second */
+static int jit_operands(jitter *this, lval *x, lval *y) {
+    if (jit_value(this, x, 0) != JIT_NUM) return 0;
+    JIT_EMIT(this, "\x50");                         /* push rax */
+    if (jit_value(this, y, 0) != JIT_NUM) return 0;
+    JIT_EMIT(this, "\x48\x89\xc1");                 /* mov rcx, rax */
+    JIT_EMIT(this, "\x58");                         /* pop rax */
+    return 1;
+}
+
+static int jit_fold(jitter *this, expr *e, lprim op) {
+    int i;
+
+    if (jit_value(this, e->cell[1], 0) != JIT_NUM) return 0;
+    if (e->count == 2 && op == builtin_minus) {
+        JIT_EMIT(this, "\x48\xf7\xd8");             /* neg rax */
+        return JIT_NUM;
+    }
+    for (i = 2; i < e->count; ++i) {
+        JIT_EMIT(this, "\x50");
+        if (jit_value(this, e->cell[i], 0) != JIT_NUM) return 0;
+        JIT_EMIT(this, "\x48\x89\xc1");
+        JIT_EMIT(this, "\x58");
+        if (op == builtin_plus) {
+            JIT_EMIT(this, "\x48\x01\xc8");         /* add rax, rcx */
+        }
+        else if (op == builtin_minus) {
+            JIT_EMIT(this, "\x48\x29\xc8");         /* sub rax, rcx */
+        }
+        else {
+            JIT_EMIT(this, "\x48\x0f\xaf\xc1");     /* imul rax, rcx */
+        }
+    }
+    return JIT_NUM;
+}
+
+static int jit_div(jitter *this, expr *e, lprim op) {
+    int ok;
+
+    if (e->count != 3) return 0;
+    if (!jit_operands(this, e->cell[1], e->cell[2])) return 0;
+    JIT_EMIT(this, "\x48\x85\xc9");                 /* test rcx, rcx */
+    JIT_EMIT(this, "\x0f\x84");                     /* jz bail */
+    jit_bail_hole(this);
+    JIT_EMIT(this, "\x48\x83\xf9\xff");             /* cmp rcx, -1 */
+    JIT_EMIT(this, "\x0f\x85");                     /* jne ok */
+    ok = jit_hole(this);
+    JIT_EMIT(this, "\x48\x89\xc2");                 /* mov rdx, rax */
+    JIT_EMIT(this, "\x48\xf7\xda");                 /* neg rdx */
+    JIT_EMIT(this, "\x0f\x80");                     /* jo bail */
+    jit_bail_hole(this);
+    jit_patch(this, ok, this->count);
+    JIT_EMIT(this, "\x48\x99");                     /* cqo */
+    JIT_EMIT(this, "\x48\xf7\xf9");                 /* idiv rcx */
+    if (op == builtin_mod) {
+        JIT_EMIT(this, "\x48\x89\xd0");             /* mov rax, rdx */
+    }
+    return JIT_NUM;
+}
+
+static int jit_compare(jitter *this, expr *e, lprim op) {
+    int cc;
+
+    if (e->count != 3) return 0;
+    if (!jit_operands(this, e->cell[1], e->cell[2])) return 0;
+
+    if (op == builtin_lt) cc = 0x9c;
+    else if (op == builtin_gt) cc = 0x9f;
+    else if (op == builtin_le) cc = 0x9e;
+    else if (op == builtin_ge) cc = 0x9d;
+    else if (op == builtin_eq) cc = 0x94;
+    else cc = 0x95;
+
+    JIT_EMIT(this, "\x48\x39\xc8");                 /* cmp rax, rcx */
+    jit_byte(this, 0x0f);                           /* setcc al */
+    jit_byte(this, cc);
+    jit_byte(this, 0xc0);
+    JIT_EMIT(this, "\x0f\xb6\xc0");                 /* movzx eax, al */
+    return JIT_BOOL;
+}
+
+static int jit_if(jitter *this, expr *e, int tail) {
+    int t;
+    int f;
+    int jz;
+    int jmp;
+
+    if (e->count != 4) return 0;
+    if (e->cell[2]->type != LVAL_QEXPR) return 0;
+    if (e->cell[3]->type != LVAL_QEXPR) return 0;
+
+    if (jit_value(this, e->cell[1], 0) != JIT_BOOL) return 0;
+    JIT_EMIT(this, "\x48\x85\xc0");                 /* test rax, rax */
+    JIT_EMIT(this, "\x0f\x84");                     /* jz else */
+    jz = jit_hole(this);
+    t = jit_form(this, e->cell[2], tail);
+    if (!t) return 0;
+    jit_byte(this, 0xe9);                           /* jmp end */
+    jmp = jit_hole(this);
+    jit_patch(this, jz, this->count);
+    f = jit_form(this, e->cell[3], tail);
+    if (f != t) return 0;
+    jit_patch(this, jmp, this->count);
+    return t;
+}
+
+/* args are pushed last first, so args[i] is at rsp + 8i */
+static int jit_push_args(jitter *this, expr *e) {
+    int i;
+    for (i = e->count - 1; i > 0; --i) {
+        if (jit_value(this, e->cell[i], 0) != JIT_NUM) return 0;
+        JIT_EMIT(this, "\x50");
+    }
+    return 1;
+}
+
+static int jit_apply(jitter *this, expr *e, lval *fn, int tail) {
+    int i;
+    int n = e->count - 1;
+    jit *callee = NULL;
+
+    if (fn != this->self) {
+        callee = jit_compile(fn);
+        if (!callee || callee->dead) return 0;
+    }
+    if (fn->fun->env->count) return 0;
+    if (n != fn->fun->code->nparams || n != fn->fun->args->expr->count) return 0;
+
+    if (!callee && tail) { /* reuse the argument array and loop */
+        if (!jit_push_args(this, e)) return 0;
+        for (i = 0; i < n; ++i) {
+            JIT_EMIT(this, "\x58");                 /* pop rax */
+            JIT_EMIT(this, "\x48\x89\x83");         /* mov [rbx + 8i], rax */
+            jit_int32(this, 8 * i);
+        }
+        jit_byte(this, 0xe9);                       /* jmp start */
+        jit_patch(this, jit_hole(this), this->start);
+        return this->jit->type;
+    }
+
+    JIT_EMIT(this, "\x48\x83\xec\x08");             /* sub rsp, 8 */
+    if (!jit_push_args(this, e)) return 0;
+    JIT_EMIT(this, "\x48\x89\xe7");                 /* mov rdi, rsp */
+    JIT_EMIT(this, "\x48\x8d\xb4\x24");             /* lea rsi, [rsp + 8n] */
+    jit_int32(this, 8 * n);
+    if (callee) {
+        jit_mov_rax(this, (long)callee->fn);
+        JIT_EMIT(this, "\xff\xd0");                 /* call rax */
+    }
+    else {
+        jit_byte(this, 0xe8);                       /* call self */
+        jit_patch(this, jit_hole(this), 0);
+    }
+    JIT_EMIT(this, "\x85\xc0");                     /* test eax, eax */
+    JIT_EMIT(this, "\x0f\x85");                     /* jnz bail */
+    jit_bail_hole(this);
+    JIT_EMIT(this, "\x48\x81\xc4");                 /* add rsp, 8n */
+    jit_int32(this, 8 * n);
+    JIT_EMIT(this, "\x58");                         /* pop rax */
+    return callee ? callee->type : this->jit->type;
+}
+
+static int jit_form(jitter *this, lval *form, int tail) {
+    lval *head;
+    lprim op;
+    expr *e = form->expr;
+
+    if (e->count == 0) return 0;
+    if (e->count == 1) return jit_value(this, e->cell[0], tail);
+
+    if (e->cell[0]->type != LVAL_SYM) return 0;
+    if (jit_param(this, e->cell[0]->sym) >= 0) return 0;
+    head = jit_resolve(this, e->cell[0]);
+    if (!head) return 0;
+
+    if (head->type == LVAL_LAMBDA) return jit_apply(this, e, head, tail);
+    if (head->type != LVAL_BUILTIN) return 0;
+
+    op = head->builtin;
+    if (op == builtin_if) return jit_if(this, e, tail);
+    if (op == builtin_plus || op == builtin_minus || op == builtin_mul) {
+        return jit_fold(this, e, op);
+    }
+    if (op == builtin_div || op == builtin_mod) return jit_div(this, e, op);
+    if (
+        op == builtin_lt || op == builtin_gt ||
+        op == builtin_le || op == builtin_ge ||
+        op == builtin_eq || op == builtin_ne
+    ) {
+        return jit_compare(this, e, op);
+    }
+    return 0;
+}
+
+static int jit_body(jitter *this) {
+    int i;
+    int type;
+
+    JIT_EMIT(this, "\x55");                         /* push rbp */
+    JIT_EMIT(this, "\x48\x89\xe5");                 /* mov rbp, rsp */
+    JIT_EMIT(this, "\x53");                         /* push rbx */
+    JIT_EMIT(this, "\x41\x54");                     /* push r12 */
+    JIT_EMIT(this, "\x48\x89\xfb");                 /* mov rbx, rdi */
+    JIT_EMIT(this, "\x49\x89\xf4");                 /* mov r12, rsi */
+    jit_mov_rax(this, (long)&vm_cstack_floor);
+    JIT_EMIT(this, "\x48\x3b\x20");                 /* cmp rsp, [rax] */
+    JIT_EMIT(this, "\x0f\x82");                     /* jb bail */
+    jit_bail_hole(this);
+    jit_mov_rax(this, (long)&jit_room);
+    JIT_EMIT(this, "\x48\x83\x28\x01");             /* sub qword [rax], 1 */
+    JIT_EMIT(this, "\x0f\x82");                     /* jb bail */
+    jit_bail_hole(this);
+    this->start = this->count;
+
+    type = jit_form(this, this->self->fun->body, 1);
+    if (type != this->jit->type) return 0;
+
+    JIT_EMIT(this, "\x49\x89\x04\x24");             /* mov [r12], rax */
+    jit_mov_rax(this, (long)&jit_room);
+    JIT_EMIT(this, "\x48\x83\x00\x01");             /* add qword [rax], 1 */
+    JIT_EMIT(this, "\x31\xc0");                     /* xor eax, eax */
+    JIT_EMIT(this, "\x41\x5c");                     /* pop r12 */
+    JIT_EMIT(this, "\x5b");                         /* pop rbx */
+    JIT_EMIT(this, "\x5d");                         /* pop rbp */
+    JIT_EMIT(this, "\xc3");                         /* ret */
+
+    for (i = 0; i < this->nbails; ++i) jit_patch(this, this->bails[i], this->count);
+    JIT_EMIT(this, "\xb8\x01\x00\x00\x00");         /* mov eax, 1 */
+    JIT_EMIT(this, "\x48\x8d\x65\xf0");             /* lea rsp, [rbp - 16] */
+    JIT_EMIT(this, "\x41\x5c");
+    JIT_EMIT(this, "\x5b");
+    JIT_EMIT(this, "\x5d");
+    JIT_EMIT(this, "\xc3");
+    return 1;
+}
+
+static jit * jit_try(lval *fn, int type) {
+    jitter jj;
+    jit *j = malloc(sizeof(jit));
+    int ok;
+
+    j->mem = NULL;
+    j->size = 0;
+    j->fn = NULL;
+    j->type = type;
+    j->nassume = 0;
+    j->syms = NULL;
+    j->vals = NULL;
+    j->epoch = lenv_epoch;
+    j->dead = 0;
+    j->floor = &vm_cstack_floor;
+
+    jj.jit = j;
+    jj.self = fn;
+    jj.code = fn->fun->code;
+    jj.env = fn->fun->env;
+    jj.buf = NULL;
+    jj.count = 0;
+    jj.cap = 0;
+    jj.bails = NULL;
+    jj.nbails = 0;
+
+    ok = jit_body(&jj);
+    if (ok) {
+        j->size = jj.count;
+        j->mem = mmap(
+            NULL, j->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+        );
+        ok = j->mem != MAP_FAILED;
+    }
+    if (ok) {
+        memcpy(j->mem, jj.buf, j->size);
+        ok = !mprotect(j->mem, j->size, PROT_READ | PROT_EXEC);
+        j->fn = (int (*)(long *, long *))j->mem;
+    }
+    else {
+        j->mem = NULL;
+    }
+    free(jj.buf);
+    free(jj.bails);
+
+    if (!ok) {
+        jit_del(j);
+        return NULL;
+    }
+    return j;
+}
+
+jit * jit_compile(lval *fn) {
+    jit *r;
+    code *c = fn->fun->code;
+
+    if (!c || c->jit || c->jit_tried) return c ? c->jit : NULL;
+    c->jit_tried = 1;
+    if (fn->fun->env->count) return NULL;
+    if (c->nparams != fn->fun->args->expr->count) return NULL; /* variadic */
+
+    r = jit_try(fn, JIT_NUM);
+    if (!r) r = jit_try(fn, JIT_BOOL);
+    c->jit = r;
+    return r;
+}
+
+#else /* no native backend */
+
+jit * jit_compile(lval *fn) {
+    return NULL;
+}
+
+#endif
+
+void jit_init(void) {
+    char *s = getenv("OWNLISP_JIT");
+    if (s) jit_enabled = strtol(s, NULL, 10) != 0;
+}
+
+void jit_del(jit *this) {
+    int i;
+    for (i = 0; i < this->nassume; ++i) {
+        lval_del(this->syms[i]);
+        lval_del(this->vals[i]);
+    }
+    free(this->syms);
+    free(this->vals);
+    if (this->mem) munmap(this->mem, this->size);
+    free(this);
+}
+
+void jit_visit(jit *this, void (*fn)(gchead *child)) {
+    int i;
+    for (i = 0; i < this->nassume; ++i) fn(&this->vals[i]->gc);
+}
+
+/* checks the assumptions of this and of the jitted lambdas it calls, and
+ * that they were compiled by the calling thread */
+static int jit_valid(jit *this, lenv *env) {
+    int i;
+    int ok = 1;
+    lval *v;
+    lval *callee;
+
+    if (this->dead || this->floor != &vm_cstack_floor) return 0;
+    if (this->epoch == lenv_epoch) return 1;
+    this->epoch = lenv_epoch;
+
+    for (i = 0; i < this->nassume; ++i) {
+        v = lenv_lookup(env, this->syms[i]);
+        ok = v == this->vals[i];
+        lval_del(v);
+        if (!ok) break;
+        callee = this->vals[i];
+        if (
+            callee->type == LVAL_LAMBDA && callee->fun->code->jit &&
+            !jit_valid(callee->fun->code->jit, callee->fun->env)
+        ) {
+            ok = 0;
+            break;
+        }
+    }
+    if (!ok) this->dead = 1;
+    return ok;
+}
+
+/* Runs fn natively if it is (or, with OWNLISP_JIT=1, can be) jitted and
+ * args are numbers. Returns NULL when the call has to be interpreted. */
+lval * jit_invoke(lval *fn, expr *args) {
+    int i;
+    long out;
+    long a[args->count + 1];
+    code *c = fn->fun->code;
+    int depth = vm_depth();
+    jit *j;
+
+    if (!c) return NULL;
+    if (jit_suspended >= 0) {
+        if (depth > jit_suspended) return NULL;
+        jit_suspended = -1;
+    }
+    if (!c->jit && (!jit_enabled || !jit_compile(fn))) return NULL;
+    j = c->jit;
+
+    if (fn->fun->env->count || args->count != c->nparams) return NULL;
+    for (i = 0; i < args->count; ++i) {
+        if (args->cell[i]->type != LVAL_NUM) return NULL;
+        a[i] = args->cell[i]->num;
+    }
+    if (!jit_valid(j, fn->fun->env)) return NULL;
+    jit_room = vm_max_depth - depth;
+    if (jit_room < 0) jit_room = 0;
+    if (j->fn(a, &out)) {
+        jit_suspended = depth;
+        return NULL;
+    }
+
+    if (j->type == JIT_BOOL) return lval_boolean(out);
+    return lval_num(out);
+}
+
+void jit_print(jit *this) {
+    printf(
+        "native %lu bytes, %d assumptions%s\n",
+        (unsigned long)this->size, this->nassume, this->dead ? ", dead" : ""
+    );
+}
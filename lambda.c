@@ -1,95 +1,183 @@
 #include "ownlisp.h"
 
 lambda * lambda_new(void) {
-    lambda *this = malloc(sizeof(lambda));
+    lambda *this = pool_alloc(&lambda_pool);
     this->env = NULL;
     this->args = NULL;
     this->body = NULL;
+    this->code = NULL;
     return this;
 }
 
 void lambda_del(lambda *this) {
     if (this->env) lenv_del(this->env);
-    if (this->args) expr_del(this->args);
-    if (this->body) expr_del(this->body);
-    free(this);
+    if (this->args) lval_del(this->args);
+    if (this->body) lval_del(this->body);
+    if (this->code) code_del(this->code);
+    pool_free(&lambda_pool, this);
 }
 
+/* lambdas are never modified, copies share everything */
 lambda * lambda_copy(lambda *this) {
-    lambda *r = malloc(sizeof(lambda));
+    lambda *r = pool_alloc(&lambda_pool);
 
-    r->env = lenv_copy(this->env);
-    r->args = expr_copy(this->args);
-    r->body = expr_copy(this->body);
+    r->env = lenv_ref(this->env);
+    r->args = lval_ref(this->args);
+    r->body = lval_ref(this->body);
+    r->code = this->code ? code_ref(this->code) : NULL;
 
     return r;
 }
 
-lval * lambda_call(lambda *this, expr *args, lenv *env) {
-    while (args->count) { /* bind arguments */
-        if (this->args->count == 0) {
+/* this with the parameters from i on left to bind, env holding the rest */
+static lambda * lambda_partial(lambda *this, lenv *env, int i) {
+    lambda *r = pool_alloc(&lambda_pool);
+    expr *params = this->args->expr;
+
+    r->env = env;
+    r->args = lval_qexpr();
+    for (; i < params->count; ++i) {
+        lval_append(r->args, lval_ref(params->cell[i]));
+    }
+    r->body = lval_ref(this->body);
+    r->code = this->code ? code_ref(this->code) : NULL;
+
+    return r;
+}
+
+/* Binds args to the parameters in a fresh copy of this->env, leaving this
+ * and args as they are. Returns NULL when every parameter is bound, with
+ * the frame to run the body in stored in *frame, otherwise an error or the
+ * partially applied lambda. */
+lval * lambda_bind(lambda *this, expr *args, lenv **frame) {
+    int i = 0;
+    int j;
+    lval *v;
+    expr *params = this->args->expr;
+    lenv *e = lenv_copy(this->env);
+
+    for (j = 0; j < args->count; ++i, ++j) { /* bind arguments */
+        if (i == params->count) {
+            lenv_del(e);
             return LERR_BAD_ARITY;
         }
-        lval *v;
-        lval *sym = expr_pop_sym(this->args);
-        assert(sym->type == LVAL_SYM); /* checked earlier */
-        if (!strcmp(sym->sym, "&")) { /* variadic */
-            lval_del(sym);
-            sym = expr_pop_sym(this->args);
-            if (sym->type == LVAL_ERR) {
-                lval_del(sym);
+        if (params->cell[i]->sym == sym_amp) { /* variadic */
+            if (i + 1 == params->count) {
+                lenv_del(e);
                 return LERR_BAD_FUN;
             }
             v = lval_qexpr();
-            free(v->expr);
-            v->expr = expr_copy(args);
-            lenv_set(this->env, sym->sym, v);
-            lval_del(sym);
+            for (; j < args->count; ++j) {
+                lval_append(v, lval_ref(args->cell[j]));
+            }
+            lenv_set(e, params->cell[i + 1]->sym, v);
+            i += 2;
             break;
         }
-        v = expr_pop(args, 0);
-        lenv_set(this->env, sym->sym, v);
-        lval_del(sym);
+        lenv_set(e, params->cell[i]->sym, lval_ref(args->cell[j]));
     }
-    if (
-        (this->args->count > 0) &&
-        (!strcmp(this->args->cell[0]->sym, "&"))
-    ) { /* variadic part empty */
-        lval *sym = expr_pop_sym(this->args);
-        if (sym->type == LVAL_ERR) {
-            lval_del(sym);
+    if (i < params->count && params->cell[i]->sym == sym_amp) {
+        /* variadic part empty */
+        if (i + 1 == params->count) {
+            lenv_del(e);
             return LERR_BAD_FUN;
         }
-        lval_del(sym);
-        sym = expr_pop_sym(this->args);
-        if (sym->type == LVAL_ERR) {
-            lval_del(sym);
-            return LERR_BAD_FUN;
+        lenv_set(e, params->cell[i + 1]->sym, lval_nil());
+        i += 2;
+    }
+    if (i < params->count) { /* return partial */
+        return lval_lambda(lambda_partial(this, e, i));
+    }
+    e->fixed = e->count;
+    *frame = e;
+    return NULL;
+}
+
+lval * lambda_call(lambda *this, expr *args, lenv *env) {
+    lenv *frame;
+    lval *r = lambda_bind(this, args, &frame);
+    if (r) return r;
+
+    if (this->code && this->code->aot) r = this->code->aot(frame);
+    else if (this->code) r = vm_exec(this->code, frame);
+    else r = expr_eval(this->body->expr, frame);
+    lenv_del(frame);
+    return r;
+}
+
+/* Lexical addressing: the lambda gets a scope id shared by all its call
+ * frames, and every symbol in its body is resolved against the parameters
+ * and the captured parent environments, recording (scope, depth, slot) in
+ * the symbol so lenv_lookup can index straight into the right frame.
+ * Symbols that cannot be resolved yet are cached on first lookup. */
+
+static unsigned long lambda_scopes = 0;
+
+static void lambda_resolve_sym(lambda *this, lval *sym) {
+    int i;
+    int d;
+    int slot = 0;
+    lenv *e;
+
+    for(i = 0; i < this->args->expr->count; ++i) {
+        if (this->args->expr->cell[i]->sym == sym_amp) continue;
+        if (this->args->expr->cell[i]->sym == sym->sym) {
+            sym->sym_scope = this->env->scope;
+            sym->sym_depth = 0;
+            sym->sym_slot = slot;
+            return;
         }
-        lenv_set(this->env, sym->sym, lval_qexpr());
-        lval_del(sym);
+        slot++;
     }
-    if (this->args->count == 0) { /* evaluate */
-        this->env->parent = env;
-        lval *f = lval_sexpr();
-        free(f->expr);
-        f->expr = expr_copy(this->body);
-        return lval_eval(f, this->env);
+
+    for(d = 1, e = this->env->parent; e; e = e->parent, ++d) {
+        /* bindings of a copy still missing could shadow the rest */
+        if (e->origin) return;
+        i = lenv_find(e, sym->sym);
+        if (i >= 0) {
+            sym->sym_scope = this->env->scope;
+            sym->sym_depth = d;
+            sym->sym_slot = i;
+            return;
+        }
     }
-    else { /* return partial */
-        return lval_lambda(lambda_copy(this));
+}
+
+static void lambda_resolve_expr(lambda *this, expr *body) {
+    int i;
+    lval *c;
+
+    for(i = 0; i < body->count; ++i) {
+        c = body->cell[i];
+        switch (c->type) {
+            case LVAL_SYM:
+                lambda_resolve_sym(this, c);
+            break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                lambda_resolve_expr(this, c->expr);
+            break;
+        }
     }
 }
 
+void lambda_resolve(lambda *this) {
+    this->env->scope = __atomic_add_fetch(&lambda_scopes, 1, __ATOMIC_RELAXED);
+    lambda_resolve_expr(this, this->body->expr);
+}
+
 void lambda_print(lambda *this) {
     /* TODO print value of bound symbols */
     printf("(\\ ");
-    expr_print(this->args, '{', '}');
+    expr_print(this->args->expr, '{', '}');
     putchar(' ');
-    expr_print(this->body, '{', '}');
+    expr_print(this->body->expr, '{', '}');
     putchar(')');
 }
 
 int lambda_eq(lambda *x, lambda *y) {
-    return (expr_eq(x->args, y->args) && expr_eq(x->body, y->body));
+    return (
+        expr_eq(x->args->expr, y->args->expr) &&
+        expr_eq(x->body->expr, y->body->expr)
+    );
 }
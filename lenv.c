@@ -1,79 +1,227 @@
+#include <stdint.h>
+
 #include "ownlisp.h"
 
+/* Bindings are kept in insertion order in syms/vals. Frames with more than
+ * LENV_SMALL bindings also get an open-addressing index of slot + 1 (0 is
+ * empty) keyed by the interned symbol pointer; smaller frames, which is
+ * what lambda calls create, are scanned linearly. */
+
+#define LENV_SMALL 8
+#define LENV_HASH(sym) ((((uintptr_t)(sym)) >> 3) * 2654435761U)
+
+__thread unsigned long lenv_epoch = 1;
+static unsigned long lenv_epochs = 1;
+
 lenv * lenv_new(void) {
-    lenv *this = malloc(sizeof(lenv));
+    lenv *this = pool_alloc(&lenv_pool);
+    this->refs = 1;
+    this->scope = 0;
+    this->fixed = 0;
     this->parent = NULL;
     this->count = 0;
+    this->cap = 0;
     this->syms = NULL;
     this->vals = NULL;
+    this->index = NULL;
+    this->index_cap = 0;
+    this->origin = NULL;
+    gc_track(&this->gc, GC_LENV);
+    return this;
+}
+
+/* Gives the calling thread a new epoch. Epochs come from one counter, so
+ * code compiled by a thread never matches another thread's epoch. */
+void lenv_bump(void) {
+    lenv_epoch = __atomic_add_fetch(&lenv_epochs, 1, __ATOMIC_RELAXED);
+}
+
+lenv * lenv_ref(lenv *this) {
+    this->refs++;
     return this;
 }
 
 void lenv_del(lenv *this) {
     int i;
+    if (--this->refs > 0) return;
     for(i = 0; i < this->count; ++i) {
-        free(this->syms[i]);
         lval_del(this->vals[i]);
     }
+    if (this->parent) lenv_del(this->parent);
     free(this->syms);
     free(this->vals);
-    free(this);
+    free(this->index);
+    gc_untrack(&this->gc);
+    pool_free(&lenv_pool, this);
+}
+
+static void lenv_index_insert(lenv *this, int slot) {
+    int mask = this->index_cap - 1;
+    int h = LENV_HASH(this->syms[slot]) & mask;
+    while (this->index[h]) h = (h + 1) & mask;
+    this->index[h] = slot + 1;
+}
+
+static void lenv_reindex(lenv *this) {
+    int i;
+    free(this->index);
+    this->index_cap = 16;
+    while (this->index_cap < 2 * this->cap) this->index_cap *= 2;
+    this->index = calloc(this->index_cap, sizeof(int));
+    for(i = 0; i < this->count; ++i) lenv_index_insert(this, i);
+}
+
+int lenv_find(lenv *this, char *sym) {
+    int i;
+    int h;
+    int mask;
+
+    if (!this->index) {
+        for(i = 0; i < this->count; ++i) {
+            if(this->syms[i] == sym) return i;
+        }
+        return -1;
+    }
+
+    mask = this->index_cap - 1;
+    h = LENV_HASH(sym) & mask;
+    while ((i = this->index[h])) {
+        if (this->syms[i - 1] == sym) return i - 1;
+        h = (h + 1) & mask;
+    }
+    return -1;
 }
 
 lenv * lenv_copy(lenv *this) {
     int i;
-    int sz;
 
-    lenv *r = malloc(sizeof(lenv));
+    lenv *r = pool_alloc(&lenv_pool);
 
+    r->refs = 1;
+    r->scope = this->scope;
+    r->fixed = this->fixed;
     r->count = this->count;
-    r->parent = this->parent;
-    r->syms = malloc(sizeof(char*) * r->count);
-    r->vals = malloc(sizeof(lval*) * r->count);
+    r->cap = this->count;
+    r->parent = this->parent ? lenv_ref(this->parent) : NULL;
+    r->syms = malloc(sizeof(char*) * r->cap);
+    r->vals = malloc(sizeof(lval*) * r->cap);
+    r->index = NULL;
+    r->index_cap = 0;
+    r->origin = NULL;
 
+    if (r->count) memcpy(r->syms, this->syms, sizeof(char*) * r->count);
     for(i = 0; i < r->count; ++i) {
-        sz = strlen(this->syms[i]) + 1;
-        r->syms[i] = malloc(sz);
-        memcpy(r->syms[i], this->syms[i], sz);
-        r->vals[i] = lval_copy(this->vals[i]);
+        r->vals[i] = lval_ref(this->vals[i]);
     }
+    if (r->count > LENV_SMALL) lenv_reindex(r);
+    gc_track(&r->gc, GC_LENV);
 
     return r;
 }
 
+/* The slot of sym in this or -1. A copy made by a worker thread that
+ * does not bind sym yet gets the binding of its origin copied in. */
+static int lenv_slot(lenv *this, char *sym) {
+    int i = lenv_find(this, sym);
+    int fixed;
+
+    if (i >= 0 || !this->origin) return i;
+    i = lenv_find(this->origin, sym);
+    if (i < 0) return -1;
+
+    /* the binding is not new to the frame, so it cannot shadow anything
+     * cached through it */
+    fixed = this->fixed == this->count;
+    lenv_set(this, sym, par_copy(this->origin->vals[i]));
+    if (fixed) this->fixed = this->count;
+    return lenv_find(this, sym);
+}
+
+/* Gives this the bindings of its origin it does not have yet, shared, and
+ * drops the origin: the thread that copied this has handed it over to the
+ * one owning the origin. */
+void lenv_detach(lenv *this) {
+    int i;
+    int fixed = this->fixed == this->count;
+    lenv *from = this->origin;
+
+    if (!from) return;
+    this->origin = NULL;
+    for (i = 0; i < from->count; ++i) {
+        if (lenv_find(this, from->syms[i]) < 0) {
+            lenv_set(this, from->syms[i], lval_ref(from->vals[i]));
+        }
+    }
+    if (fixed) this->fixed = this->count;
+}
+
+/* Looks up a symbol value, caching where it was found in the symbol as
+ * (scope, depth, slot). Frames of one scope come from the same lambda so
+ * they have the same parents and bind their parameters in the same slots;
+ * the cache stays valid unless a frame on the way was extended by = after
+ * it was entered, which could shadow the cached binding. */
+lval * lenv_lookup(lenv *this, lval *sym) {
+    int d;
+    int i;
+    lenv *e = this;
+
+    if (this->scope && sym->sym_scope == this->scope) {
+        for(d = sym->sym_depth; d > 0; --d) {
+            if (e->count != e->fixed) goto slow;
+            e = e->parent;
+        }
+        i = sym->sym_slot;
+        if (i < e->count && e->syms[i] == sym->sym) {
+            return lval_ref(e->vals[i]);
+        }
+    }
+
+slow:
+    for(d = 0, e = this; e; e = e->parent, ++d) {
+        i = lenv_slot(e, sym->sym);
+        if (i >= 0) {
+            if (this->scope) {
+                sym->sym_scope = this->scope;
+                sym->sym_depth = d;
+                sym->sym_slot = i;
+            }
+            return lval_ref(e->vals[i]);
+        }
+    }
+    return LERR_UNBOUND;
+}
+
 lval * lenv_get(lenv *this, char *sym) {
     int i;
-    for(i = 0; i < this->count; ++i) {
-        if(!strcmp(this->syms[i], sym)) return lval_copy(this->vals[i]);
+    for(; this; this = this->parent) {
+        i = lenv_slot(this, sym);
+        if (i >= 0) return lval_ref(this->vals[i]);
     }
-    if (this->parent) return lenv_get(this->parent, sym);
     return LERR_UNBOUND;
 }
 
 void lenv_set(lenv *this, char *sym, lval *v) {
-    int i;
-    int sz;
+    int i = lenv_find(this, sym);
 
-    for(i = 0; i < this->count; ++i) {
-        if(!strcmp(this->syms[i], sym)) {
-            /* already exists, replace */
-            lval_del(this->vals[i]);
-            this->vals[i] = v;
-            sz = strlen(sym) + 1;
-            this->syms[i] = realloc(this->syms[i], sz);
-            memcpy(this->syms[i], sym, sz);
-            return;
-        }
+    if (i >= 0) { /* already exists, replace */
+        lval_del(this->vals[i]);
+        this->vals[i] = v;
+        return;
     }
 
     /* not found, insert */
+    if (this->count == this->cap) {
+        this->cap = this->cap ? this->cap * 2 : 4;
+        this->vals = realloc(this->vals, sizeof(lval*) * this->cap);
+        this->syms = realloc(this->syms, sizeof(char*) * this->cap);
+        if (this->index) lenv_reindex(this);
+    }
+    this->vals[this->count] = v;
+    this->syms[this->count] = sym;
     this->count++;
-    this->vals = realloc(this->vals, sizeof(lval*) * this->count);
-    this->syms = realloc(this->syms, sizeof(char*) * this->count);
-    this->vals[this->count - 1] = v;
-    sz = strlen(sym) + 1;
-    this->syms[this->count - 1] = malloc(sz);
-    memcpy(this->syms[this->count - 1], sym, sz);
+
+    if (this->index) lenv_index_insert(this, this->count - 1);
+    else if (this->count > LENV_SMALL) lenv_reindex(this);
 }
 
 void lenv_set_global(lenv *this, char *sym, lval *v) {
@@ -81,7 +229,10 @@ void lenv_set_global(lenv *this, char *sym, lval *v) {
     lenv_set(this, sym, v);
 }
 
+void lenv_add_prim(lenv *this, char *name, lprim builtin) {
+    lenv_set(this, sym_intern(name), lval_builtin(builtin));
+}
+
 void lenv_add_builtin(lenv *this, char *name, lbuiltin builtin) {
-    lval *v = lval_builtin(builtin);
-    lenv_set(this, name, v);
+    lenv_set(this, sym_intern(name), lval_builtin_legacy(builtin));
 }
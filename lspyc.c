@@ -0,0 +1,620 @@
+#include <limits.h>
+#include <stdarg.h>
+
+#include "ownlisp.h"
+
+/* lspyc: ahead-of-time compiler from .lspy files to C.
+ *
+ *     lspyc -o modules.c std.lspy ...
+ *
+ * Every file becomes a loader that rebuilds its forms without parsing and
+ * evaluates them in order. Lambdas the file defines with fun or def are
+ * compiled to bytecode as the VM would, and each op is translated to C
+ * with the stack depth resolved statically: values live in a local array,
+ * jumps become gotos and errors unwind through a chain of labels that
+ * drops the live slots. Calls to a lambda of the same file are made
+ * directly, guarded by identity of the bound value, and self tail calls
+ * rebind a fresh frame and jump back to the start. The output defines
+ * aot_modules, which registers the loaders with the runtime (aot.c). */
+
+typedef struct {
+    char *s;
+    int len;
+    int cap;
+} lspyc_buf;
+
+typedef struct {
+    char *name;
+    lval *args;
+    lval *body;
+    code *code;
+    /* first constant of code in the module table */
+    int kbase;
+    int kargs;
+    int kbody;
+} lspyc_def;
+
+typedef struct {
+    int id;
+    char *file;
+    lval *forms;
+    /* constants built once when the module loads */
+    int nconsts;
+    lval **consts;
+    int ndefs;
+    lspyc_def *defs;
+    /* definition that follows each form, -1 if none */
+    int *form_def;
+} lspyc_module;
+
+/* one lambda body being translated */
+typedef struct {
+    lspyc_module *module;
+    int self;
+    code *code;
+    lspyc_buf body;
+    /* stack depth at each jump target, -1 elsewhere */
+    int *target;
+    /* definition each stack slot was loaded from, -1 if none */
+    int *known;
+    /* depths errors unwind from */
+    char *unwind;
+    int direct;
+    /* self tail calls: the frame may be ours to drop */
+    int loop;
+} lspyc_fn;
+
+static void lspyc_printf(lspyc_buf *this, char *fmt, ...) {
+    int n;
+    va_list ap;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if (this->len + n + 1 > this->cap) {
+        while (this->len + n + 1 > this->cap) {
+            this->cap = this->cap ? this->cap * 2 : 256;
+        }
+        this->s = realloc(this->s, this->cap);
+    }
+    va_start(ap, fmt);
+    vsnprintf(this->s + this->len, n + 1, fmt, ap);
+    va_end(ap);
+    this->len += n;
+}
+
+static void lspyc_string(lspyc_buf *this, char *s) {
+    lspyc_printf(this, "\"");
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\' || *s == '?') {
+            lspyc_printf(this, "\\%c", *s);
+        }
+        else if (*s < ' ' || *s > '~') {
+            lspyc_printf(this, "\\%03o", (unsigned char)*s);
+        }
+        else {
+            lspyc_printf(this, "%c", *s);
+        }
+    }
+    lspyc_printf(this, "\"");
+}
+
+/* an expression building a fresh copy of v */
+static void lspyc_value(lspyc_buf *this, lval *v, int indent) {
+    int i;
+
+    switch (v->type) {
+        case LVAL_NUM:
+            if (v->num == LONG_MIN) lspyc_printf(this, "lval_num(LONG_MIN)");
+            else lspyc_printf(this, "lval_num(%ldL)", v->num);
+        break;
+        case LVAL_BOOLEAN:
+            lspyc_printf(this, "lval_boolean(%d)", v->boolean);
+        break;
+        case LVAL_ERR:
+            lspyc_printf(this, "lval_err(");
+            lspyc_string(this, v->err);
+            lspyc_printf(this, ")");
+        break;
+        case LVAL_SYM:
+            lspyc_printf(this, "lval_sym(");
+            lspyc_string(this, v->sym);
+            lspyc_printf(this, ")");
+        break;
+        case LVAL_STR:
+            lspyc_printf(this, "lval_str(");
+            lspyc_string(this, v->str);
+            lspyc_printf(this, ")");
+        break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (v->expr->count == 0) {
+                lspyc_printf(
+                    this, v->type == LVAL_QEXPR ? "lval_nil()" : "lval_sexpr()"
+                );
+                break;
+            }
+            lspyc_printf(
+                this, "aot_list(%s, %d",
+                v->type == LVAL_QEXPR ? "LVAL_QEXPR" : "LVAL_SEXPR",
+                v->expr->count
+            );
+            for (i = 0; i < v->expr->count; ++i) {
+                lspyc_printf(this, ",\n%*s", indent + 4, "");
+                lspyc_value(this, v->expr->cell[i], indent + 4);
+            }
+            lspyc_printf(this, ")");
+        break;
+        default:
+            assert(0);
+    }
+}
+
+static int lspyc_const(lspyc_module *this, lval *v) {
+    this->consts = realloc(this->consts, sizeof(lval*) * (this->nconsts + 1));
+    this->consts[this->nconsts] = lval_ref(v);
+    return this->nconsts++;
+}
+
+static int lspyc_is_sym(lval *v, char *sym) {
+    return v->type == LVAL_SYM && !strcmp(v->sym, sym);
+}
+
+static int lspyc_params(lval *v) {
+    int i;
+    if (v->type != LVAL_QEXPR) return 0;
+    for (i = 0; i < v->expr->count; ++i) {
+        if (v->expr->cell[i]->type != LVAL_SYM) return 0;
+    }
+    return 1;
+}
+
+/* (fun {name params...} {body}) or (def {name} (\ {params...} {body})) */
+static int lspyc_match(lval *form, lspyc_def *def) {
+    int i;
+    lval **cell;
+
+    if (form->type != LVAL_SEXPR || form->expr->count != 3) return 0;
+    cell = form->expr->cell;
+
+    if (lspyc_is_sym(cell[0], "fun")) {
+        if (!lspyc_params(cell[1]) || cell[1]->expr->count < 1) return 0;
+        if (cell[2]->type != LVAL_QEXPR) return 0;
+        def->name = cell[1]->expr->cell[0]->sym;
+        def->args = cell[1]->expr->count == 1 ? lval_nil() : lval_qexpr();
+        for (i = 1; i < cell[1]->expr->count; ++i) {
+            lval_append(def->args, lval_ref(cell[1]->expr->cell[i]));
+        }
+        def->body = lval_ref(cell[2]);
+        return 1;
+    }
+
+    if (lspyc_is_sym(cell[0], "def")) {
+        if (!lspyc_params(cell[1]) || cell[1]->expr->count != 1) return 0;
+        if (cell[2]->type != LVAL_SEXPR || cell[2]->expr->count != 3) return 0;
+        cell = cell[2]->expr->cell;
+        if (!lspyc_is_sym(cell[0], "\\") || !lspyc_params(cell[1])) return 0;
+        if (cell[2]->type != LVAL_QEXPR) return 0;
+        def->name = form->expr->cell[1]->expr->cell[0]->sym;
+        def->args = lval_ref(cell[1]);
+        def->body = lval_ref(cell[2]);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* the last definition of sym in the module */
+static int lspyc_known(lspyc_module *this, char *sym) {
+    int i;
+    for (i = this->ndefs - 1; i >= 0; --i) {
+        if (this->defs[i].name == sym) return i;
+    }
+    return -1;
+}
+
+static void lspyc_call(lspyc_fn *this, int h, int n, int tail) {
+    int i;
+    int g = this->known[h];
+    int m = this->module->id;
+    lspyc_buf *out = &this->body;
+
+    if (g >= 0 && g == this->self && tail) {
+        this->loop = 1;
+        lspyc_printf(out,
+            "    if (s[%d] == m%d_v%d && (f = aot_frame(s + %d, %d))) {\n",
+            h, m, g, h, n
+        );
+        /* values inlined code left below the call */
+        for (i = 0; i < h; ++i) {
+            lspyc_printf(out, "        lval_del(s[%d]);\n", i);
+        }
+        lspyc_printf(out,
+            "        if (own) lenv_del(env);\n"
+            "        env = f;\n"
+            "        own = 1;\n"
+            "        goto start;\n"
+            "    }\n"
+            "    v = aot_call(s + %d, %d, env);\n",
+            h, n
+        );
+    }
+    else if (g >= 0) {
+        lspyc_printf(out,
+            "    if (s[%d] == m%d_v%d && (f = aot_frame(s + %d, %d))) {\n"
+            "        v = m%d_f%d(f);\n"
+            "        lenv_del(f);\n"
+            "    }\n"
+            "    else v = aot_call(s + %d, %d, env);\n",
+            h, m, g, h, n, m, g, h, n
+        );
+    }
+    else {
+        lspyc_printf(out, "    v = aot_call(s + %d, %d, env);\n", h, n);
+    }
+    if (g >= 0) this->direct = 1;
+    lspyc_printf(out,
+        "    if (v->type == LVAL_ERR) goto E%d;\n"
+        "    s[%d] = v;\n",
+        h, h
+    );
+    this->unwind[h] = 1;
+}
+
+/* translates every op into this->body */
+static void lspyc_ops(lspyc_fn *this, int loop) {
+    code *c = this->code;
+    int *ops = c->ops;
+    int m = this->module->id;
+    int kbase = this->module->defs[this->self].kbase;
+    lspyc_buf *out = &this->body;
+    int pc;
+    int op;
+    int k;
+    int n;
+    int d = 0;
+
+    out->len = 0;
+    for (pc = 0; pc <= c->count; ++pc) this->target[pc] = -1;
+
+    for (pc = 0; pc < c->count;) {
+        if (this->target[pc] >= 0) {
+            d = this->target[pc];
+            lspyc_printf(out, "L%d:\n", pc);
+        }
+        op = ops[pc++];
+        switch (op) {
+            case OP_CONST:
+                k = kbase + ops[pc++];
+                lspyc_printf(out, "    s[%d] = lval_ref(m%d_K[%d]);\n", d, m, k);
+                this->known[d++] = -1;
+            break;
+            case OP_LOCAL:
+                lspyc_printf(out,
+                    "    s[%d] = lval_ref(env->vals[%d]);\n", d, ops[pc++]
+                );
+                this->known[d++] = -1;
+            break;
+            case OP_GLOBAL:
+                k = ops[pc++];
+                lspyc_printf(out,
+                    "    v = lenv_lookup(env, m%d_K[%d]);\n"
+                    "    if (v->type == LVAL_ERR) goto E%d;\n"
+                    "    s[%d] = v;\n",
+                    m, kbase + k, d, d
+                );
+                this->unwind[d] = 1;
+                this->known[d++] = lspyc_known(this->module, c->consts[k]->sym);
+            break;
+            case OP_SEXPR:
+                lspyc_printf(out, "    s[%d] = lval_sexpr();\n", d);
+                this->known[d++] = -1;
+            break;
+            case OP_CALL:
+            case OP_TAILCALL:
+                n = ops[pc++];
+                d -= n;
+                lspyc_call(this, d, n, op == OP_TAILCALL);
+                this->known[d++] = -1;
+            break;
+            case OP_IF:
+                k = kbase + ops[pc++];
+                lspyc_printf(out,
+                    "    v = lenv_lookup(env, m%d_K[%d]->expr->cell[0]);\n"
+                    "    if (v->type != LVAL_BUILTIN || v->builtin != builtin_if) {\n"
+                    "        lval_del(v);\n"
+                    "        v = vm_deopt(m%d_K[%d], env);\n"
+                    "        if (v->type == LVAL_ERR) goto E%d;\n"
+                    "        s[%d] = v;\n"
+                    "        goto L%d;\n"
+                    "    }\n"
+                    "    lval_del(v);\n",
+                    m, k, m, k, d, d, ops[pc]
+                );
+                this->unwind[d] = 1;
+                this->target[ops[pc++]] = d + 1;
+                /* nothing is inlined without an environment */
+                pc += 2;
+            break;
+            case OP_GUARD:
+                /* nor anything else that would need a guard */
+                assert(0);
+            break;
+            case OP_JUMPF:
+                d--;
+                lspyc_printf(out,
+                    "    v = s[%d];\n"
+                    "    if (v->type != LVAL_BOOLEAN) {\n"
+                    "        lval_del(v);\n"
+                    "        v = LERR_BAD_TYPE;\n"
+                    "        goto E%d;\n"
+                    "    }\n"
+                    "    if (!v->boolean) {\n"
+                    "        lval_del(v);\n"
+                    "        goto L%d;\n"
+                    "    }\n"
+                    "    lval_del(v);\n",
+                    d, d, ops[pc]
+                );
+                this->unwind[d] = 1;
+                this->target[ops[pc++]] = d;
+            break;
+            case OP_JUMP:
+                lspyc_printf(out, "    goto L%d;\n", ops[pc]);
+                this->target[ops[pc++]] = d;
+            break;
+            case OP_STACK:
+                lspyc_printf(out,
+                    "    s[%d] = lval_ref(s[%d]);\n", d, ops[pc++]
+                );
+                this->known[d++] = -1;
+            break;
+            case OP_SLIDE:
+                n = ops[pc++];
+                d -= n + 1;
+                for (k = 0; k < n; ++k) {
+                    lspyc_printf(out, "    lval_del(s[%d]);\n", d + k);
+                }
+                lspyc_printf(out, "    s[%d] = s[%d];\n", d, d + n);
+                this->known[d++] = -1;
+            break;
+            case OP_RETURN:
+                d--;
+                lspyc_printf(out, "    v = s[%d];\n", d);
+                if (loop) lspyc_printf(out, "    if (own) lenv_del(env);\n");
+                lspyc_printf(out, "    return v;\n");
+            break;
+            default:
+                assert(0);
+        }
+    }
+
+    /* an error at depth d drops the d values below it */
+    for (d = c->depth; d > 0 && !this->unwind[d]; --d);
+    if (d == 0 && !this->unwind[0]) return;
+    for (; d > 0; --d) {
+        if (this->unwind[d]) lspyc_printf(out, "E%d:\n", d);
+        lspyc_printf(out, "    lval_del(s[%d]);\n", d - 1);
+    }
+    if (this->unwind[0]) lspyc_printf(out, "E0:\n");
+    if (loop) lspyc_printf(out, "    if (own) lenv_del(env);\n");
+    lspyc_printf(out, "    return v;\n");
+}
+
+static void lspyc_function(FILE *out, lspyc_module *module, int self) {
+    lspyc_fn fn;
+    code *c = module->defs[self].code;
+
+    fn.module = module;
+    fn.self = self;
+    fn.code = c;
+    fn.body.s = NULL;
+    fn.body.len = fn.body.cap = 0;
+    fn.target = malloc(sizeof(int) * (c->count + 1));
+    fn.known = malloc(sizeof(int) * (c->depth + 1));
+    fn.unwind = calloc(c->depth + 1, 1);
+    fn.direct = 0;
+    fn.loop = 0;
+
+    /* returns only drop the frame if a self tail call made it */
+    lspyc_ops(&fn, 0);
+    if (fn.loop) lspyc_ops(&fn, 1);
+
+    fprintf(out, "/* %s */\n", module->defs[self].name);
+    fprintf(out, "static lval * m%d_f%d(lenv *env) {\n", module->id, self);
+    fprintf(out, "    lval *s[%d];\n", c->depth ? c->depth : 1);
+    fprintf(out, "    lval *v;\n");
+    if (fn.direct) fprintf(out, "    lenv *f;\n");
+    if (fn.loop) fprintf(out, "    int own = 0;\n");
+    fprintf(out, "\n    if (vm_stack_check()) return LERR_DEPTH;\n");
+    if (fn.loop) fprintf(out, "start:\n");
+    fwrite(fn.body.s, 1, fn.body.len, out);
+    fprintf(out, "}\n\n");
+
+    free(fn.body.s);
+    free(fn.unwind);
+    free(fn.known);
+    free(fn.target);
+}
+
+static lspyc_module * lspyc_read(char *file, int id) {
+    int i;
+    int k;
+    lval *forms;
+    lambda *fun;
+    lspyc_def def;
+    lspyc_module *this;
+    mpc_result_t parsed;
+
+    if (!mpc_parse_contents(file, Lispy, &parsed)) {
+        mpc_err_print(parsed.error);
+        mpc_err_delete(parsed.error);
+        return NULL;
+    }
+    forms = ast_read(parsed.output);
+    mpc_ast_delete(parsed.output);
+
+    this = malloc(sizeof(lspyc_module));
+    this->id = id;
+    this->file = file;
+    this->forms = forms;
+    this->nconsts = 0;
+    this->consts = NULL;
+    this->ndefs = 0;
+    this->defs = NULL;
+    this->form_def = malloc(sizeof(int) * (forms->expr->count + 1));
+
+    for (i = 0; i < forms->expr->count; ++i) {
+        this->form_def[i] = -1;
+        if (!lspyc_match(forms->expr->cell[i], &def)) continue;
+
+        fun = lambda_new();
+        fun->args = lval_ref(def.args);
+        fun->body = lval_ref(def.body);
+        def.code = compile_lambda(fun);
+        lambda_del(fun);
+        if (!def.code) {
+            lval_del(def.args);
+            lval_del(def.body);
+            continue;
+        }
+
+        def.kargs = lspyc_const(this, def.args);
+        def.kbody = lspyc_const(this, def.body);
+        this->defs = realloc(this->defs, sizeof(lspyc_def) * (this->ndefs + 1));
+        this->defs[this->ndefs] = def;
+        this->form_def[i] = this->ndefs++;
+        lval_del(def.args);
+        lval_del(def.body);
+    }
+
+    /* code constants follow the definitions they belong to */
+    for (i = 0; i < this->ndefs; ++i) {
+        this->defs[i].kbase = this->nconsts;
+        for (k = 0; k < this->defs[i].code->nconsts; ++k) {
+            lspyc_const(this, this->defs[i].code->consts[k]);
+        }
+    }
+    return this;
+}
+
+static void lspyc_module_del(lspyc_module *this) {
+    int i;
+    for (i = 0; i < this->ndefs; ++i) code_del(this->defs[i].code);
+    for (i = 0; i < this->nconsts; ++i) lval_del(this->consts[i]);
+    free(this->defs);
+    free(this->consts);
+    free(this->form_def);
+    lval_del(this->forms);
+    free(this);
+}
+
+static void lspyc_module_write(FILE *out, lspyc_module *this) {
+    int i;
+    lval **forms = this->forms->expr->cell;
+    lspyc_buf b = { NULL, 0, 0 };
+    lspyc_def *def;
+
+    fprintf(out, "/* %s */\n\n", this->file);
+    if (this->nconsts) {
+        fprintf(out, "static lval *m%d_K[%d];\n", this->id, this->nconsts);
+    }
+    for (i = 0; i < this->ndefs; ++i) {
+        fprintf(out, "static lval *m%d_v%d;\n", this->id, i);
+    }
+    for (i = 0; i < this->ndefs; ++i) {
+        fprintf(out, "static lval * m%d_f%d(lenv *env);\n", this->id, i);
+    }
+    fprintf(out, "\n");
+
+    for (i = 0; i < this->ndefs; ++i) lspyc_function(out, this, i);
+
+    fprintf(out, "static lval * m%d_load(lenv *env) {\n", this->id);
+    fprintf(out, "    lval *r;\n\n");
+    if (this->nconsts) {
+        fprintf(out, "    if (!m%d_K[0]) {\n", this->id);
+        for (i = 0; i < this->nconsts; ++i) {
+            b.len = 0;
+            lspyc_value(&b, this->consts[i], 8);
+            fprintf(out, "        m%d_K[%d] = %.*s;\n", this->id, i, b.len, b.s);
+        }
+        fprintf(out, "    }\n\n");
+    }
+
+    for (i = 0; i < this->forms->expr->count; ++i) {
+        b.len = 0;
+        lspyc_value(&b, forms[i], 4);
+        fprintf(out, "    r = lval_eval(%.*s, env);\n", b.len, b.s);
+        fprintf(out, "    if (r->type == LVAL_ERR) lval_println(r);\n");
+        fprintf(out, "    lval_del(r);\n");
+        if (this->form_def[i] < 0) continue;
+
+        def = &this->defs[this->form_def[i]];
+        b.len = 0;
+        lspyc_string(&b, def->name);
+        fprintf(out,
+            "    aot_attach(\n"
+            "        env, %.*s, m%d_K[%d], m%d_K[%d],\n"
+            "        m%d_f%d, &m%d_v%d\n"
+            "    );\n",
+            b.len, b.s, this->id, def->kargs, this->id, def->kbody,
+            this->id, this->form_def[i], this->id, this->form_def[i]
+        );
+    }
+    fprintf(out, "\n    return lval_sexpr();\n}\n\n");
+    free(b.s);
+}
+
+int main(int argc, char **argv) {
+    int i;
+    int n = 0;
+    char *path = NULL;
+    FILE *out;
+    lspyc_buf b = { NULL, 0, 0 };
+    lspyc_module **modules;
+
+    if (argc > 2 && !strcmp(argv[1], "-o")) {
+        path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+    if (!path || argc < 2) {
+        fprintf(stderr, "usage: lspyc -o out.c file.lspy...\n");
+        return 1;
+    }
+
+    ast_init();
+    lval_init();
+
+    modules = malloc(sizeof(lspyc_module*) * argc);
+    for (i = 1; i < argc; ++i) {
+        modules[n] = lspyc_read(argv[i], n);
+        if (!modules[n]) return 1;
+        n++;
+    }
+
+    out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return 1;
+    }
+    fprintf(out, "/* generated by lspyc, do not edit */\n\n");
+    fprintf(out, "#include <limits.h>\n\n#include \"ownlisp.h\"\n\n");
+    for (i = 0; i < n; ++i) lspyc_module_write(out, modules[i]);
+
+    fprintf(out, "void aot_modules(void) {\n");
+    for (i = 0; i < n; ++i) {
+        b.len = 0;
+        lspyc_string(&b, argv[i + 1]);
+        fprintf(out, "    aot_register(%.*s, m%d_load);\n", b.len, b.s, i);
+    }
+    fprintf(out, "}\n");
+    fclose(out);
+    free(b.s);
+
+    for (i = 0; i < n; ++i) lspyc_module_del(modules[i]);
+    free(modules);
+    ast_cleanup();
+    return 0;
+}
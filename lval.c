@@ -2,67 +2,114 @@
 
 /* constructors */
 
+static lval * lval_new(int type) {
+    lval *v;
+    gc_poll();
+    v = pool_alloc(&lval_pool);
+    v->type = type;
+    v->refs = 1;
+    if (GC_CONTAINER(type)) gc_track(&v->gc, GC_LVAL);
+    else v->gc.next = NULL;
+    return v;
+}
+
+/* Small numbers, booleans and nil are preallocated and never freed. Like
+ * any shared value they are immutable: writers go through lval_unshare.
+ * Their count is never touched either, so threads share them freely. */
+
+#define LVAL_IMMORTAL (1 << 30)
+#define LVAL_SMALL_MIN -256
+#define LVAL_SMALL_MAX 1023
+
+static lval lval_small[LVAL_SMALL_MAX - LVAL_SMALL_MIN + 1];
+static lval lval_true;
+static lval lval_false;
+static lval lval_nil_v;
+static expr lval_nil_expr;
+
+static void lval_init_immortal(lval *v, int type) {
+    v->type = type;
+    v->refs = LVAL_IMMORTAL;
+    v->gc.next = NULL;
+}
+
+void lval_init(void) {
+    long i;
+    sym_init();
+    for (i = LVAL_SMALL_MIN; i <= LVAL_SMALL_MAX; ++i) {
+        lval_init_immortal(&lval_small[i - LVAL_SMALL_MIN], LVAL_NUM);
+        lval_small[i - LVAL_SMALL_MIN].num = i;
+    }
+    lval_init_immortal(&lval_true, LVAL_BOOLEAN);
+    lval_true.boolean = 1;
+    lval_init_immortal(&lval_false, LVAL_BOOLEAN);
+    lval_false.boolean = 0;
+    lval_init_immortal(&lval_nil_v, LVAL_QEXPR);
+    lval_nil_expr.cell = lval_nil_expr.base = lval_nil_expr.small;
+    lval_nil_expr.cap = EXPR_SMALL;
+    lval_nil_v.expr = &lval_nil_expr;
+}
+
 lval * lval_num(long x) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
+    lval *v;
+    if (x >= LVAL_SMALL_MIN && x <= LVAL_SMALL_MAX) {
+        return lval_ref(&lval_small[x - LVAL_SMALL_MIN]);
+    }
+    v = lval_new(LVAL_NUM);
     v->num = x;
     return v;
 }
 
 lval * lval_boolean(int x) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_BOOLEAN;
-    v->boolean = x ? 1 : 0;
-    return v;
+    return lval_ref(x ? &lval_true : &lval_false);
 }
 
 lval * lval_err(char *x) {
     ssize_t sz = strlen(x) + 1;
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+    lval *v = lval_new(LVAL_ERR);
     v->err = malloc(sz);
     memcpy(v->err, x, sz);
     return v;
 }
 
 lval * lval_sym(char *x) {
-    ssize_t sz = strlen(x) + 1;
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(sz);
-    memcpy(v->sym, x, sz);
+    lval *v = lval_new(LVAL_SYM);
+    v->sym = sym_intern(x);
+    v->sym_scope = 0;
     return v;
 }
 
 lval * lval_str(char *x) {
     ssize_t sz = strlen(x) + 1;
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
+    lval *v = lval_new(LVAL_STR);
     v->str = malloc(sz);
     memcpy(v->sym, x, sz);
     return v;
 }
 
-lval * lval_builtin(lbuiltin builtin) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_BUILTIN;
+lval * lval_builtin(lprim builtin) {
+    lval *v = lval_new(LVAL_BUILTIN);
     v->builtin = builtin;
+    v->legacy = NULL;
+    return v;
+}
+
+lval * lval_builtin_legacy(lbuiltin builtin) {
+    lval *v = lval_new(LVAL_BUILTIN);
+    v->builtin = NULL;
+    v->legacy = builtin;
     return v;
 }
 
 lval * lval_lambda(lambda *fun) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_LAMBDA;
+    lval *v = lval_new(LVAL_LAMBDA);
     v->fun = fun;
     return v;
 }
 
 lval * lval_sexpr(void) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
-    v->expr = malloc(sizeof(expr));
-    v->expr->count = 0;
-    v->expr->cell = NULL;
+    lval *v = lval_new(LVAL_SEXPR);
+    v->expr = expr_new(0);
     return v;
 }
 
@@ -72,18 +119,63 @@ lval * lval_qexpr(void) {
     return v;
 }
 
-/* destructor, copy */
+lval * lval_vector(vnode *vec) {
+    lval *v = lval_new(LVAL_VECTOR);
+    v->vec = vec;
+    return v;
+}
+
+lval * lval_map(mnode *map) {
+    lval *v = lval_new(LVAL_MAP);
+    v->map = map;
+    return v;
+}
+
+/* takes arr, malloc'd */
+lval * lval_i64array(long *arr, int count) {
+    lval *v = lval_new(LVAL_I64ARRAY);
+    v->arr = arr;
+    v->arr_count = count;
+    return v;
+}
+
+lval * lval_seq(seq *seq) {
+    lval *v = lval_new(LVAL_SEQ);
+    v->seq = seq;
+    return v;
+}
+
+/* a delay of the Q-Expression body in env, both consumed */
+lval * lval_delay(lval *body, lenv *env) {
+    lval *v = lval_new(LVAL_DELAY);
+    v->delay_body = body;
+    v->delay_env = env;
+    v->delay_value = NULL;
+    return v;
+}
+
+/* shared empty Q-Expression, use lval_qexpr to build a list */
+lval * lval_nil(void) {
+    return lval_ref(&lval_nil_v);
+}
+
+/* reference counting, destructor, copy */
+
+lval * lval_ref(lval *this) {
+    if (this->refs != LVAL_IMMORTAL) this->refs++;
+    return this;
+}
 
 void lval_del(lval *this) {
+    if (this->refs == LVAL_IMMORTAL || --this->refs > 0) return;
+
     switch (this->type) {
         case LVAL_ERR:
             if(this->err) free(this->err);
         break;
         case LVAL_NUM:
         case LVAL_BOOLEAN:
-        break;
         case LVAL_SYM:
-            if(this->sym) free(this->sym);
         break;
         case LVAL_STR:
             if(this->str) free(this->str);
@@ -97,17 +189,36 @@ void lval_del(lval *this) {
         case LVAL_QEXPR:
             if(this->expr) expr_del(this->expr);
         break;
+        case LVAL_VECTOR:
+            vnode_del(this->vec);
+        break;
+        case LVAL_MAP:
+            mnode_del(this->map);
+        break;
+        case LVAL_I64ARRAY:
+            free(this->arr);
+        break;
+        case LVAL_SEQ:
+            if (this->seq) seq_del(this->seq);
+        break;
+        case LVAL_DELAY:
+            if (this->delay_body) lval_del(this->delay_body);
+            if (this->delay_env) lenv_del(this->delay_env);
+            if (this->delay_value) lval_del(this->delay_value);
+        break;
         default:
             assert(0);
     }
-    free(this);
+    if (this->gc.next) gc_untrack(&this->gc);
+    pool_free(&lval_pool, this);
 }
 
+/* Values are immutable once shared: this only copies the top level,
+ * children are shared by reference. */
 lval * lval_copy(lval *this) {
     ssize_t sz;
 
-    lval *r = malloc(sizeof(lval));
-    r->type = this->type;
+    lval *r = lval_new(this->type);
 
     switch(this->type) {
         case LVAL_ERR:
@@ -122,9 +233,10 @@ lval * lval_copy(lval *this) {
             r->boolean = this->boolean;
         break;
         case LVAL_SYM:
-            sz = strlen(this->sym) + 1;
-            r->sym = malloc(sz);
-            memcpy(r->sym, this->sym, sz);
+            r->sym = this->sym;
+            r->sym_scope = this->sym_scope;
+            r->sym_depth = this->sym_depth;
+            r->sym_slot = this->sym_slot;
         break;
         case LVAL_STR:
             sz = strlen(this->str) + 1;
@@ -133,6 +245,7 @@ lval * lval_copy(lval *this) {
         break;
         case LVAL_BUILTIN:
             r->builtin = this->builtin;
+            r->legacy = this->legacy;
         break;
         case LVAL_LAMBDA:
             r->fun = lambda_copy(this->fun);
@@ -141,6 +254,27 @@ lval * lval_copy(lval *this) {
         case LVAL_QEXPR:
             r->expr = expr_copy(this->expr);
         break;
+        case LVAL_VECTOR:
+            r->vec = vnode_ref(this->vec);
+        break;
+        case LVAL_MAP:
+            r->map = mnode_ref(this->map);
+        break;
+        case LVAL_I64ARRAY:
+            sz = sizeof(long) * this->arr_count;
+            r->arr = malloc(sz);
+            if (sz) memcpy(r->arr, this->arr, sz);
+            r->arr_count = this->arr_count;
+        break;
+        case LVAL_SEQ:
+            r->seq = seq_copy(this->seq);
+        break;
+        case LVAL_DELAY:
+            r->delay_body = this->delay_body ? lval_ref(this->delay_body) : NULL;
+            r->delay_env = this->delay_env ? lenv_ref(this->delay_env) : NULL;
+            r->delay_value =
+                this->delay_value ? lval_ref(this->delay_value) : NULL;
+        break;
         default:
             assert(0);
     }
@@ -148,6 +282,15 @@ lval * lval_copy(lval *this) {
     return r;
 }
 
+/* returns a value safe to mutate in place, consuming this */
+lval * lval_unshare(lval *this) {
+    lval *r;
+    if (this->refs == 1) return this;
+    r = lval_copy(this);
+    lval_del(this);
+    return r;
+}
+
 /* print, eq */
 
 void lval_print(lval *this) {
@@ -187,6 +330,30 @@ void lval_print(lval *this) {
         case LVAL_QEXPR:
             expr_print(this->expr, '{', '}');
         break;
+        case LVAL_VECTOR:
+            vector_print(this->vec);
+        break;
+        case LVAL_MAP:
+            map_print(this->map);
+        break;
+        case LVAL_I64ARRAY:
+            printf("#[");
+            for (sz = 0; sz < this->arr_count; ++sz) {
+                printf(sz ? " %ld" : "%ld", this->arr[sz]);
+            }
+            putchar(']');
+        break;
+        case LVAL_SEQ:
+            seq_print(this);
+        break;
+        case LVAL_DELAY:
+            printf("<delay");
+            if (this->delay_value) {
+                putchar(' ');
+                lval_print(this->delay_value);
+            }
+            putchar('>');
+        break;
         default:
             assert(0);
     }
@@ -198,6 +365,7 @@ void lval_println(lval *this) {
 }
 
 int lval_eq(lval *x, lval* y) {
+    if(x == y) return 1;
     if(x->type != y->type) return 0;
 
     switch (x->type) {
@@ -208,17 +376,30 @@ int lval_eq(lval *x, lval* y) {
         case LVAL_BOOLEAN:
             return (x->boolean == y->boolean);
         case LVAL_SYM:
-            return (!strcmp(x->sym, y->sym));
+            return (x->sym == y->sym);
         case LVAL_STR:
             return (!strcmp(x->str, y->str));
         case LVAL_BUILTIN:
-            return (x->builtin == y->builtin);
+            return (x->builtin == y->builtin && x->legacy == y->legacy);
         case LVAL_LAMBDA:
             return lambda_eq(x->fun, y->fun);
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             return expr_eq(x->expr, y->expr);
         break;
+        case LVAL_VECTOR:
+            return vector_eq(x->vec, y->vec);
+        case LVAL_MAP:
+            return map_eq(x->map, y->map);
+        case LVAL_I64ARRAY:
+            return x->arr_count == y->arr_count && (
+                !x->arr_count ||
+                !memcmp(x->arr, y->arr, sizeof(long) * x->arr_count)
+            );
+        case LVAL_SEQ:
+        case LVAL_DELAY:
+            /* only the same one, comparing would run them */
+            return 0;
         default:
             assert(0);
     }
@@ -244,6 +425,16 @@ char * lval_type(lval *this) {
             return "sexpr";
         case LVAL_QEXPR:
             return "qexpr";
+        case LVAL_VECTOR:
+            return "vector";
+        case LVAL_MAP:
+            return "map";
+        case LVAL_I64ARRAY:
+            return "i64array";
+        case LVAL_SEQ:
+            return "seq";
+        case LVAL_DELAY:
+            return "delay";
         default:
             assert(0);
     }
@@ -256,9 +447,14 @@ lval * lval_call(lval *this, expr *args, lenv *env) {
 
     switch (this->type) {
         case LVAL_BUILTIN:
-            r = this->builtin(args, env);
+            if (this->builtin) {
+                r = this->builtin(args->cell, args->count, env);
+            }
+            else r = this->legacy(args, env);
         break;
         case LVAL_LAMBDA:
+            r = jit_invoke(this, args);
+            if (r) break;
             r = lambda_call(this->fun, args, env);
         break;
         case LVAL_SYM:
@@ -279,7 +475,7 @@ lval * lval_eval(lval *this, lenv *env) {
         lval_del(this);
     }
     else if (this->type == LVAL_SYM) {
-        r = lenv_get(env, this->sym);
+        r = lenv_lookup(env, this);
         lval_del(this);
     }
     return r;
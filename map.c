@@ -0,0 +1,372 @@
+#include "ownlisp.h"
+
+/* Persistent hash maps.
+ *
+ * A map is a hash array mapped trie: each node uses the next MAP_BITS bits
+ * of a key's hash to pick one of 32 slots, and a bitmap tells which slots
+ * are present so only those are stored. A slot holds either a key with its
+ * value or the node for the keys sharing those bits. Keys with the same
+ * hash end up in a node past the last bits, searched linearly. Like vector
+ * nodes, map nodes are never modified once built: put and del copy the
+ * path to the key and share everything else. The empty map is NULL.
+ *
+ * The functions borrow the nodes they are given and return a new
+ * reference; slots passed in are consumed. */
+
+#define MAP_BITS 5
+#define MAP_MASK ((1UL << MAP_BITS) - 1)
+#define MAP_HASH_BITS ((int)sizeof(unsigned long) * 8)
+
+#define MAP_BIT(hash, shift) (1U << (((hash) >> (shift)) & MAP_MASK))
+#define MAP_INDEX(this, bit) __builtin_popcount((this)->bitmap & ((bit) - 1))
+
+static mnode * mnode_new(int n) {
+    mnode *r = malloc(sizeof(mnode) + sizeof(mslot) * n);
+    r->refs = 1;
+    r->bitmap = 0;
+    r->count = 0;
+    r->n = n;
+    gc_track(&r->gc, GC_MNODE);
+    return r;
+}
+
+mnode * mnode_ref(mnode *this) {
+    if (this) this->refs++;
+    return this;
+}
+
+static void mslot_ref(mslot *this) {
+    if (this->key) {
+        lval_ref(this->key);
+        lval_ref(this->val);
+    }
+    else {
+        mnode_ref(this->node);
+    }
+}
+
+static void mslot_del(mslot *this) {
+    if (this->key) {
+        lval_del(this->key);
+        lval_del(this->val);
+    }
+    else {
+        mnode_del(this->node);
+    }
+}
+
+void mnode_del(mnode *this) {
+    int i;
+
+    if (!this || --this->refs > 0) return;
+    for (i = 0; i < this->n; ++i) mslot_del(&this->slot[i]);
+    gc_untrack(&this->gc);
+    free(this);
+}
+
+/* fills in the count of r from its slots */
+static mnode * mnode_done(mnode *r) {
+    int i;
+
+    r->count = 0;
+    for (i = 0; i < r->n; ++i) {
+        r->count += r->slot[i].key ? 1 : r->slot[i].node->count;
+    }
+    return r;
+}
+
+/* this with slot i replaced by x */
+static mnode * mnode_set(mnode *this, int i, mslot *x) {
+    int j;
+    mnode *r = mnode_new(this->n);
+
+    r->bitmap = this->bitmap;
+    for (j = 0; j < this->n; ++j) {
+        if (j == i) continue;
+        r->slot[j] = this->slot[j];
+        mslot_ref(&r->slot[j]);
+    }
+    r->slot[i] = *x;
+    return mnode_done(r);
+}
+
+/* this with x inserted at slot i */
+static mnode * mnode_insert(mnode *this, int i, unsigned bit, mslot *x) {
+    int j;
+    mnode *r = mnode_new(this->n + 1);
+
+    r->bitmap = this->bitmap | bit;
+    for (j = 0; j < this->n; ++j) {
+        r->slot[j < i ? j : j + 1] = this->slot[j];
+        mslot_ref(&this->slot[j]);
+    }
+    r->slot[i] = *x;
+    return mnode_done(r);
+}
+
+/* this without slot i, NULL once empty */
+static mnode * mnode_remove(mnode *this, int i, unsigned bit) {
+    int j;
+    mnode *r;
+
+    if (this->n == 1) return NULL;
+    r = mnode_new(this->n - 1);
+    r->bitmap = this->bitmap & ~bit;
+    for (j = 0; j < this->n; ++j) {
+        if (j == i) continue;
+        r->slot[j < i ? j : j - 1] = this->slot[j];
+        mslot_ref(&this->slot[j]);
+    }
+    return mnode_done(r);
+}
+
+/* index of key in a node past the last bits of the hash, or -1 */
+static int mnode_find(mnode *this, lval *key) {
+    int i;
+    for (i = 0; i < this->n; ++i) {
+        if (lval_eq(this->slot[i].key, key)) return i;
+    }
+    return -1;
+}
+
+static mnode * mnode_put(mnode *this, int shift, mslot *x) {
+    int i;
+    unsigned bit;
+    mslot *s;
+    mslot y;
+    mnode *a;
+
+    if (!this) {
+        this = mnode_new(1);
+        if (shift < MAP_HASH_BITS) this->bitmap = MAP_BIT(x->hash, shift);
+        this->slot[0] = *x;
+        return mnode_done(this);
+    }
+
+    if (shift >= MAP_HASH_BITS) {
+        i = mnode_find(this, x->key);
+        if (i < 0) return mnode_insert(this, this->n, 0, x);
+        return mnode_set(this, i, x);
+    }
+
+    bit = MAP_BIT(x->hash, shift);
+    i = MAP_INDEX(this, bit);
+    if (!(this->bitmap & bit)) return mnode_insert(this, i, bit, x);
+
+    s = &this->slot[i];
+    if (!s->key) {
+        y.key = NULL;
+        y.node = mnode_put(s->node, shift + MAP_BITS, x);
+        return mnode_set(this, i, &y);
+    }
+    if (s->hash == x->hash && lval_eq(s->key, x->key)) {
+        return mnode_set(this, i, x);
+    }
+
+    /* two keys share these bits, move both one level down */
+    y = *s;
+    mslot_ref(&y);
+    a = mnode_put(NULL, shift + MAP_BITS, &y);
+    y.key = NULL;
+    y.node = mnode_put(a, shift + MAP_BITS, x);
+    mnode_del(a);
+    return mnode_set(this, i, &y);
+}
+
+/* returns this itself, with a new reference, when key is not there */
+static mnode * mnode_remove_key(
+    mnode *this, int shift, lval *key, unsigned long hash
+) {
+    int i;
+    unsigned bit;
+    mslot *s;
+    mslot y;
+    mnode *a;
+
+    if (shift >= MAP_HASH_BITS) {
+        i = mnode_find(this, key);
+        if (i < 0) return mnode_ref(this);
+        return mnode_remove(this, i, 0);
+    }
+
+    bit = MAP_BIT(hash, shift);
+    if (!(this->bitmap & bit)) return mnode_ref(this);
+    i = MAP_INDEX(this, bit);
+    s = &this->slot[i];
+
+    if (s->key) {
+        if (s->hash != hash || !lval_eq(s->key, key)) return mnode_ref(this);
+        return mnode_remove(this, i, bit);
+    }
+
+    a = mnode_remove_key(s->node, shift + MAP_BITS, key, hash);
+    if (a == s->node) {
+        mnode_del(a);
+        return mnode_ref(this);
+    }
+    if (!a) return mnode_remove(this, i, bit);
+    if (a->n == 1 && a->slot[0].key) {
+        /* a single key left below, keep it here */
+        y = a->slot[0];
+        mslot_ref(&y);
+        mnode_del(a);
+        return mnode_set(this, i, &y);
+    }
+    y.key = NULL;
+    y.node = a;
+    return mnode_set(this, i, &y);
+}
+
+static unsigned long map_mix(unsigned long x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdUL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53UL;
+    x ^= x >> 33;
+    return x;
+}
+
+static unsigned long map_hash_str(char *s) {
+    unsigned long r = 14695981039346656037UL;
+    for (; *s; ++s) r = (r ^ (unsigned char)*s) * 1099511628211UL;
+    return r;
+}
+
+/* Stores the hash of x in *hash. Returns 0 when x cannot be a key: only
+ * numbers, booleans, symbols, strings and Q-Expressions of those can. */
+int map_hash(lval *x, unsigned long *hash) {
+    int i;
+    unsigned long h;
+    unsigned long r;
+
+    switch (x->type) {
+        case LVAL_NUM:
+            r = (unsigned long)x->num;
+        break;
+        case LVAL_BOOLEAN:
+            r = x->boolean;
+        break;
+        case LVAL_SYM:
+            r = map_hash_str(x->sym);
+        break;
+        case LVAL_STR:
+            r = map_hash_str(x->str);
+        break;
+        case LVAL_QEXPR:
+            r = x->expr->count;
+            for (i = 0; i < x->expr->count; ++i) {
+                if (!map_hash(x->expr->cell[i], &h)) return 0;
+                r = r * 31 + h;
+            }
+        break;
+        default:
+            return 0;
+    }
+    *hash = map_mix(r + x->type);
+    return 1;
+}
+
+/* the value of key, borrowed from this, or NULL */
+lval * map_get(mnode *this, lval *key, unsigned long hash) {
+    int i;
+    int shift = 0;
+    unsigned bit;
+    mslot *s;
+
+    while (this) {
+        if (shift >= MAP_HASH_BITS) {
+            i = mnode_find(this, key);
+            return i < 0 ? NULL : this->slot[i].val;
+        }
+        bit = MAP_BIT(hash, shift);
+        if (!(this->bitmap & bit)) return NULL;
+        s = &this->slot[MAP_INDEX(this, bit)];
+        if (s->key) {
+            if (s->hash != hash || !lval_eq(s->key, key)) return NULL;
+            return s->val;
+        }
+        this = s->node;
+        shift += MAP_BITS;
+    }
+    return NULL;
+}
+
+/* this with key bound to val, key and val consumed */
+mnode * map_put(mnode *this, lval *key, lval *val, unsigned long hash) {
+    mslot x;
+
+    x.hash = hash;
+    x.key = key;
+    x.val = val;
+    x.node = NULL;
+    return mnode_put(this, 0, &x);
+}
+
+/* this without key */
+mnode * map_remove(mnode *this, lval *key, unsigned long hash) {
+    if (!this) return NULL;
+    return mnode_remove_key(this, 0, key, hash);
+}
+
+/* stores borrowed references to the keys and values of this, in hash
+ * order, and returns how many were stored */
+int map_entries(mnode *this, lval **keys, lval **vals) {
+    int i;
+    int n = 0;
+
+    if (!this) return 0;
+    for (i = 0; i < this->n; ++i) {
+        if (this->slot[i].key) {
+            if (keys) keys[n] = this->slot[i].key;
+            if (vals) vals[n] = this->slot[i].val;
+            n++;
+        }
+        else {
+            n += map_entries(
+                this->slot[i].node, keys ? keys + n : NULL, vals ? vals + n : NULL
+            );
+        }
+    }
+    return n;
+}
+
+void map_print(mnode *this) {
+    int i;
+    int n = MAP_COUNT(this);
+    lval **keys = malloc(sizeof(lval*) * (n + 1));
+    lval **vals = malloc(sizeof(lval*) * (n + 1));
+
+    map_entries(this, keys, vals);
+    printf("#{");
+    for (i = 0; i < n; ++i) {
+        lval_print(keys[i]);
+        putchar(' ');
+        lval_print(vals[i]);
+        if (i != n - 1) putchar(' ');
+    }
+    putchar('}');
+    free(keys);
+    free(vals);
+}
+
+/* every key of x is bound to the same value in y */
+static int map_sub(mnode *x, mnode *y) {
+    int i;
+    lval *v;
+
+    for (i = 0; i < x->n; ++i) {
+        if (!x->slot[i].key) {
+            if (!map_sub(x->slot[i].node, y)) return 0;
+            continue;
+        }
+        v = map_get(y, x->slot[i].key, x->slot[i].hash);
+        if (!v || !lval_eq(v, x->slot[i].val)) return 0;
+    }
+    return 1;
+}
+
+int map_eq(mnode *x, mnode *y) {
+    if (x == y) return 1;
+    if (MAP_COUNT(x) != MAP_COUNT(y)) return 0;
+    return map_sub(x, y);
+}
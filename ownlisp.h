@@ -14,41 +14,220 @@ extern mpc_parser_t *Lispy;
 typedef struct lval lval;
 typedef struct  lenv lenv;
 typedef struct expr expr;
+typedef struct chunk chunk;
+typedef struct vnode vnode;
+typedef struct mnode mnode;
+typedef struct seq seq;
+typedef struct seq_iter seq_iter;
 typedef struct lambda lambda;
+typedef struct code code;
+typedef struct jit jit;
+typedef struct pool pool;
+typedef struct gchead gchead;
 
+/* Builtins get their arguments as a span borrowed from the caller, which
+ * releases whatever is left in it afterwards: args_take moves a value out
+ * to return it or modify it in place. */
+typedef lval * (*lprim)(lval **args, int count, lenv *env);
+/* older builtins popping their arguments from an expr they own, still
+ * accepted by lenv_add_builtin */
 typedef lval * (*lbuiltin)(expr *this, lenv *env);
 
+/* cycle collector bookkeeping, see gc.c */
+struct gchead {
+    gchead *prev;
+    gchead *next;
+    int refs;
+    int kind;
+};
+
+#define EXPR_SMALL 4
+
 struct expr {
     int count;
+    /* the first cell, inside base */
     lval **cell;
+    lval **base;
+    int cap;
+    lval *small[EXPR_SMALL];
+    /* set when the cells belong to a chunk, base is then unused */
+    chunk *shared;
+};
+
+/* cells shared by several exprs, see expr.c */
+struct chunk {
+    int refs;
+    gchead gc;
+    /* cell[front] to cell[back - 1] are used and hold a reference */
+    int front;
+    int back;
+    int cap;
+    lval **cell;
+};
+
+/* a node of a persistent vector, see vector.c */
+struct vnode {
+    int refs;
+    gchead gc;
+    /* 0 for leaves, which hold count cells and no children */
+    int height;
+    int count;
+    vnode *left;
+    vnode *right;
+    lval *cell[];
 };
 
+/* a key with its value, or when key is NULL a node of keys below */
+typedef struct {
+    unsigned long hash;
+    lval *key;
+    lval *val;
+    mnode *node;
+} mslot;
+
+/* a node of a persistent hash map, see map.c */
+struct mnode {
+    int refs;
+    gchead gc;
+    /* the hash bits present at this level, one per slot */
+    unsigned bitmap;
+    /* keys below */
+    int count;
+    int n;
+    mslot slot[];
+};
+
+/* a lazy sequence, see seq.c */
+struct seq {
+    int kind;
+    /* ranges count values from from by step, takes count elements */
+    long from;
+    long step;
+    long count;
+    /* the function of a map or filter and where it was built */
+    lval *fn;
+    lenv *env;
+    /* what a map, filter or take reads, a sequence or a Q-Expression */
+    lval *src;
+};
+
+enum { SEQ_RANGE, SEQ_MAP, SEQ_FILTER, SEQ_TAKE };
+
 struct lambda {
+    /* the captured environment plus any partially applied arguments, it
+     * is copied into a fresh frame for each call */
     lenv *env;
-    expr *args;
-    expr *body;
+    /* Q-Expressions of the parameters left to bind and of the body, never
+     * modified and shared with partial applications */
+    lval *args;
+    lval *body;
+    /* compiled body, NULL when it runs in the tree walker */
+    code *code;
+};
+
+/* bytecode for a lambda body, shared by copies of the lambda */
+struct code {
+    int refs;
+    gchead gc;
+    int count;
+    int cap;
+    int *ops;
+    int nconsts;
+    lval **consts;
+    /* parameter names by slot, for disassembly */
+    int nparams;
+    char **params;
+    /* stack slots needed to run */
+    int depth;
+    /* native code, see jit.c */
+    jit *jit;
+    int jit_tried;
+    /* body translated to C by lspyc, see aot.c */
+    lval * (*aot)(lenv *env);
+    /* symbols folded or inlined and the values they had */
+    int nassume;
+    lval **assume_syms;
+    lval **assume_vals;
+    unsigned long assume_epoch;
+    int assume_dead;
+    /* the body compiled without either, run once an assumption fails */
+    code *plain;
 };
 
 struct lval {
     int type;
+    int refs;
+    gchead gc;
     union {
         long num;
         char boolean;
         char *err;
-        char *sym;
+        struct {
+            char *sym;
+            /* where sym was last found, see lenv_lookup */
+            unsigned long sym_scope;
+            int sym_depth;
+            int sym_slot;
+        };
         char *str;
         expr *expr;
-        lbuiltin builtin;
+        /* one of them is set */
+        struct {
+            lprim builtin;
+            lbuiltin legacy;
+        };
         lambda *fun;
+        /* NULL for the empty vector */
+        vnode *vec;
+        /* NULL for the empty map */
+        mnode *map;
+        /* packed 64 bit integers */
+        struct {
+            long *arr;
+            int arr_count;
+        };
+        seq *seq;
+        /* body and env until forced, value after */
+        struct {
+            lval *delay_body;
+            lenv *delay_env;
+            lval *delay_value;
+        };
     };
 };
 
 struct lenv
 {
+    int refs;
+    gchead gc;
+    /* frames of the same lambda share a scope id, 0 is none */
+    unsigned long scope;
+    /* bindings present when the frame was entered */
+    int fixed;
     lenv *parent;
     int count;
+    int cap;
     char **syms;
     lval **vals;
+    int *index;
+    int index_cap;
+    /* for the copies a worker thread makes, the environment bindings are
+     * still to be copied from, borrowed; see par.c */
+    lenv *origin;
+};
+
+struct pool {
+    char *name;
+    size_t size;
+    void *free;
+    char *page;
+    int left;
+    /* objects on the free list */
+    long nfree;
+    long hits;
+    long misses;
+    /* hits + misses when objects were last taken, see pool_take */
+    long taken;
 };
 
 /* value types */
@@ -61,14 +240,26 @@ enum {
     LVAL_BUILTIN,
     LVAL_LAMBDA,
     LVAL_SEXPR,
-    LVAL_QEXPR
+    LVAL_QEXPR,
+    LVAL_VECTOR,
+    LVAL_MAP,
+    LVAL_I64ARRAY,
+    LVAL_SEQ,
+    LVAL_DELAY
 };
 
 /* expr */
 
+chunk * chunk_ref(chunk *this);
+void chunk_del(chunk *this);
+expr * expr_new(int count);
 void expr_del(expr *this);
 expr * expr_copy(expr *this);
+expr * expr_sub(expr *this, int from, int to);
+void expr_reserve(expr *this, int n);
 expr * expr_append(expr *this, lval *x);
+expr * expr_concat(expr *this, expr *x);
+expr * expr_unshift(expr *this, expr *x);
 expr * expr_prepend(expr *this, lval *x);
 void expr_print(expr *this, char open, char close);
 lval * expr_pop(expr *this, int i);
@@ -82,6 +273,12 @@ int expr_eq(expr *x, expr *y);
 #define expr_pop_str(this) expr_pop_typed((this), LVAL_STR)
 #define expr_pop_qexpr(this) expr_pop_typed((this), LVAL_QEXPR)
 
+/* argument spans, see lprim */
+
+lval * args_take(lval **args, int i);
+lval * args_check(lval **args, int from, int to, int type);
+void args_release(lval **args, int count);
+
 /* lval */
 
 lval * lval_num(long x);
@@ -89,13 +286,23 @@ lval * lval_boolean(int x);
 lval * lval_err(char *x);
 lval * lval_sym(char *x);
 lval * lval_str(char *x);
-lval * lval_builtin(lbuiltin builtin);
+lval * lval_builtin(lprim builtin);
+lval * lval_builtin_legacy(lbuiltin builtin);
 lval * lval_lambda(lambda *fun);
 lval * lval_sexpr(void);
 lval * lval_qexpr(void);
+lval * lval_nil(void);
+lval * lval_vector(vnode *vec);
+lval * lval_map(mnode *map);
+lval * lval_i64array(long *arr, int count);
+lval * lval_seq(seq *seq);
+lval * lval_delay(lval *body, lenv *env);
+void lval_init(void);
 
+lval * lval_ref(lval *this);
 void lval_del(lval *this);
 lval * lval_copy(lval *this);
+lval * lval_unshare(lval *this);
 void lval_print(lval *this);
 void lval_println(lval *this);
 int lval_eq(lval *x, lval* y);
@@ -106,14 +313,101 @@ lval * lval_eval(lval *this, lenv *env);
 #define lval_append(this, x) (this)->expr = expr_append((this)->expr, (x))
 #define lval_prepend(this, x) (this)->expr = expr_prepend((this)->expr, (x))
 
+/* vector */
+
+#define VECTOR_COUNT(this) ((this) ? (this)->count : 0)
+
+vnode * vnode_ref(vnode *this);
+void vnode_del(vnode *this);
+vnode * vector_from(lval **cell, int n);
+lval * vector_get(vnode *this, int i);
+vnode * vector_assoc(vnode *this, int i, lval *x);
+vnode * vector_slice(vnode *this, int from, int to);
+vnode * vector_concat(vnode *x, vnode *y);
+void vector_cells(vnode *this, lval **out);
+void vector_print(vnode *this);
+int vector_eq(vnode *x, vnode *y);
+
+/* map */
+
+#define MAP_COUNT(this) ((this) ? (this)->count : 0)
+
+mnode * mnode_ref(mnode *this);
+void mnode_del(mnode *this);
+int map_hash(lval *x, unsigned long *hash);
+lval * map_get(mnode *this, lval *key, unsigned long hash);
+mnode * map_put(mnode *this, lval *key, lval *val, unsigned long hash);
+mnode * map_remove(mnode *this, lval *key, unsigned long hash);
+int map_entries(mnode *this, lval **keys, lval **vals);
+void map_print(mnode *this);
+int map_eq(mnode *x, mnode *y);
+
+/* array */
+
+void array_init(void);
+long array_sum(long *x, int n);
+long array_min(long *x, int n);
+long array_max(long *x, int n);
+void array_add(long *r, long *x, long y, int n);
+void array_add_array(long *r, long *x, long *y, int n);
+long array_dot(long *x, long *y, int n);
+int array_filter_lt(long *r, long *x, long y, int n);
+
+/* seq */
+
+seq * seq_new(int kind);
+void seq_del(seq *this);
+seq * seq_copy(seq *this);
+seq_iter * seq_iter_new(lval *src);
+void seq_iter_del(seq_iter *this);
+int seq_next(seq_iter *this, lval **out);
+void seq_print(lval *this);
+lval * delay_force(lval *this);
+
+/* fuse */
+
+extern int fuse_enabled;
+
+void fuse_init(void);
+lval * fuse_plan(expr *form, lval *head, lenv *env);
+lval * fuse_eval(expr *form, lval *head, lenv *env);
+lval * fuse_run(lval **args, int count, lenv *env);
+
+/* par */
+
+enum { PAR_MAP, PAR_FILTER, PAR_REDUCE };
+
+extern int par_threads;
+
+void par_init(void);
+lval * par_list(int kind, lval *fn, lval *z, expr *l, lenv *env);
+lval * par_copy(lval *v);
+
+/* sym */
+
+extern char *sym_amp;
+
+char * sym_intern(char *name);
+void sym_init(void);
+
 /* lenv */
 
+/* bumped whenever def or = changes a binding, per thread */
+extern __thread unsigned long lenv_epoch;
+
+void lenv_bump(void);
 lenv * lenv_new(void);
+lenv * lenv_ref(lenv *this);
 void lenv_del(lenv *this);
 lenv * lenv_copy(lenv *this);
+void lenv_detach(lenv *this);
+int lenv_find(lenv *this, char *sym);
+lval * lenv_lookup(lenv *this, lval *sym);
+/* symbols given to lenv must come from sym_intern */
 lval * lenv_get(lenv *this, char *sym);
 void lenv_set(lenv *this, char *sym, lval *v);
 void lenv_set_global(lenv *this, char *sym, lval *v);
+void lenv_add_prim(lenv *this, char *name, lprim builtin);
 void lenv_add_builtin(lenv *this, char *name, lbuiltin builtin);
 
 /* lambda */
@@ -121,19 +415,207 @@ void lenv_add_builtin(lenv *this, char *name, lbuiltin builtin);
 lambda * lambda_new(void);
 void lambda_del(lambda *this);
 lambda * lambda_copy(lambda *this);
+lval * lambda_bind(lambda *this, expr *args, lenv **frame);
 lval * lambda_call(lambda *this, expr *args, lenv *env);
+void lambda_resolve(lambda *this);
 void lambda_print(lambda *this);
 int lambda_eq(lambda *x, lambda *y);
 
+/* compile */
+
+/* opcodes, operands follow inline */
+enum {
+    OP_CONST,    /* k: push consts[k] */
+    OP_LOCAL,    /* slot: push a parameter of the current frame */
+    OP_GLOBAL,   /* k: push the value of symbol consts[k] */
+    OP_SEXPR,    /* push () */
+    OP_CALL,     /* n: call the value n below the top with the n - 1 above */
+    OP_TAILCALL, /* n: as OP_CALL, the result is returned */
+    OP_IF,       /* k to f slot: if if is not the builtin, eval consts[k]
+                    and jump; if f >= 0 the form comes from the lambda
+                    consts[f] inlined with its arguments from slot on */
+    OP_GUARD,    /* k to f slot: as OP_IF, once a symbol the code assumed
+                    the value of was rebound */
+    OP_JUMPF,    /* to: pop a boolean, jump if false */
+    OP_JUMP,     /* to */
+    OP_STACK,    /* slot: push the value in a stack slot of the frame */
+    OP_SLIDE,    /* n: drop the n values below the top */
+    OP_RETURN
+};
+
+code * compile_lambda(lambda *fun);
+int compile_pure_call(lval *fn);
+int code_valid(code *this, lenv *env);
+code * code_current(code *this, lenv *env);
+code * code_ref(code *this);
+void code_del(code *this);
+void code_disassemble(code *this);
+
+/* vm */
+
+#define VM_DEFAULT_MAX_DEPTH 1000000
+
+extern int vm_enabled;
+extern long vm_max_depth;
+extern __thread char *vm_cstack_floor;
+
+void vm_init(void);
+void vm_thread_init(char *base, long size);
+int vm_stack_check(void);
+int vm_depth(void);
+lval * vm_deopt(lval *form, lenv *env);
+lval * vm_exec(code *this, lenv *env);
+
+/* jit */
+
+extern int jit_enabled;
+
+void jit_init(void);
+jit * jit_compile(lval *fn);
+void jit_del(jit *this);
+void jit_visit(jit *this, void (*fn)(gchead *child));
+lval * jit_invoke(lval *fn, expr *args);
+void jit_print(jit *this);
+
+/* aot */
+
+typedef lval * (*aot_fn)(lenv *env);
+typedef lval * (*aot_loader)(lenv *env);
+
+extern int aot_enabled;
+
+void aot_init(void);
+void aot_modules(void);
+void aot_register(char *file, aot_loader load);
+aot_loader aot_find(char *file);
+lval * aot_list(int type, int n, ...);
+lval * aot_call(lval **s, int n, lenv *env);
+lenv * aot_frame(lval **s, int n);
+void aot_attach(
+    lenv *env, char *name, lval *args, lval *body,
+    aot_fn fn, lval **known
+);
+
 /* ast */
 
+void ast_init(void);
+void ast_cleanup(void);
 lval * ast_read_num(mpc_ast_t *t);
 lval * ast_read(mpc_ast_t *t);
 lval * ast_load_eval(char* fn, lenv *env);
 
+/* pool */
+
+#define CELLS_CLASSES 7
+#define POOL_COUNT (5 + CELLS_CLASSES)
+
+extern __thread pool lval_pool;
+extern __thread pool expr_pool;
+extern __thread pool lambda_pool;
+extern __thread pool lenv_pool;
+extern __thread pool chunk_pool;
+extern __thread pool cells_pools[CELLS_CLASSES];
+
+void * pool_alloc(pool *this);
+void pool_free(pool *this, void *p);
+lval ** cells_alloc(int n);
+void cells_free(lval **cell, int n);
+lval ** cells_resize(lval **cell, int from, int to);
+void pool_all(pool **out);
+void pool_take(pool **from, int n);
+void pool_print_stats(void);
+
+/* gc */
+
+#define GC_DEFAULT_THRESHOLD 100000
+#define GC_CONTAINER(type) \
+    ((type) == LVAL_SEXPR || (type) == LVAL_QEXPR || (type) == LVAL_LAMBDA || \
+     (type) == LVAL_VECTOR || (type) == LVAL_MAP || (type) == LVAL_SEQ || \
+     (type) == LVAL_DELAY)
+
+extern long gc_threshold;
+
+enum { GC_LVAL, GC_LENV, GC_CODE, GC_CHUNK, GC_VNODE, GC_MNODE };
+
+void gc_init(void);
+void gc_track(gchead *this, int kind);
+void gc_untrack(gchead *this);
+void gc_poll(void);
+int gc_collect(void);
+gchead * gc_heap(void);
+void gc_adopt(gchead *heap);
+
 /* builtin */
 
 void register_builtins(lenv *env);
+lval * builtin_eq(lval **args, int count, lenv *env);
+lval * builtin_ne(lval **args, int count, lenv *env);
+lval * builtin_plus(lval **args, int count, lenv *env);
+lval * builtin_minus(lval **args, int count, lenv *env);
+lval * builtin_mul(lval **args, int count, lenv *env);
+lval * builtin_div(lval **args, int count, lenv *env);
+lval * builtin_mod(lval **args, int count, lenv *env);
+lval * builtin_lt(lval **args, int count, lenv *env);
+lval * builtin_le(lval **args, int count, lenv *env);
+lval * builtin_gt(lval **args, int count, lenv *env);
+lval * builtin_ge(lval **args, int count, lenv *env);
+lval * builtin_min(lval **args, int count, lenv *env);
+lval * builtin_max(lval **args, int count, lenv *env);
+lval * builtin_list(lval **args, int count, lenv *env);
+lval * builtin_head(lval **args, int count, lenv *env);
+lval * builtin_tail(lval **args, int count, lenv *env);
+lval * builtin_join(lval **args, int count, lenv *env);
+lval * builtin_cons(lval **args, int count, lenv *env);
+lval * builtin_len(lval **args, int count, lenv *env);
+lval * builtin_map(lval **args, int count, lenv *env);
+lval * builtin_filter(lval **args, int count, lenv *env);
+lval * builtin_foldl(lval **args, int count, lenv *env);
+lval * builtin_foldr(lval **args, int count, lenv *env);
+lval * builtin_last(lval **args, int count, lenv *env);
+lval * builtin_reverse(lval **args, int count, lenv *env);
+lval * builtin_take(lval **args, int count, lenv *env);
+lval * builtin_drop(lval **args, int count, lenv *env);
+lval * builtin_zip(lval **args, int count, lenv *env);
+lval * builtin_range(lval **args, int count, lenv *env);
+lval * builtin_lazy_range(lval **args, int count, lenv *env);
+lval * builtin_lazy_map(lval **args, int count, lenv *env);
+lval * builtin_lazy_filter(lval **args, int count, lenv *env);
+lval * builtin_realize(lval **args, int count, lenv *env);
+lval * builtin_delay(lval **args, int count, lenv *env);
+lval * builtin_force(lval **args, int count, lenv *env);
+lval * builtin_pmap(lval **args, int count, lenv *env);
+lval * builtin_pfilter(lval **args, int count, lenv *env);
+lval * builtin_preduce(lval **args, int count, lenv *env);
+lval * builtin_vec(lval **args, int count, lenv *env);
+lval * builtin_nth(lval **args, int count, lenv *env);
+lval * builtin_assoc(lval **args, int count, lenv *env);
+lval * builtin_slice(lval **args, int count, lenv *env);
+lval * builtin_concat(lval **args, int count, lenv *env);
+lval * builtin_hash_map(lval **args, int count, lenv *env);
+lval * builtin_get(lval **args, int count, lenv *env);
+lval * builtin_put(lval **args, int count, lenv *env);
+lval * builtin_del(lval **args, int count, lenv *env);
+lval * builtin_keys(lval **args, int count, lenv *env);
+lval * builtin_vals(lval **args, int count, lenv *env);
+lval * builtin_contains(lval **args, int count, lenv *env);
+lval * builtin_arr(lval **args, int count, lenv *env);
+lval * builtin_arr_list(lval **args, int count, lenv *env);
+lval * builtin_arr_sum(lval **args, int count, lenv *env);
+lval * builtin_arr_min(lval **args, int count, lenv *env);
+lval * builtin_arr_max(lval **args, int count, lenv *env);
+lval * builtin_arr_map_plus(lval **args, int count, lenv *env);
+lval * builtin_arr_dot(lval **args, int count, lenv *env);
+lval * builtin_arr_filter_lt(lval **args, int count, lenv *env);
+lval * builtin_init(lval **args, int count, lenv *env);
+lval * builtin_not(lval **args, int count, lenv *env);
+lval * builtin_and(lval **args, int count, lenv *env);
+lval * builtin_or(lval **args, int count, lenv *env);
+lval * builtin_lambda(lval **args, int count, lenv *env);
+lval * builtin_deflocal(lval **args, int count, lenv *env);
+lval * builtin_let(lval **args, int count, lenv *env);
+lval * builtin_eval(lval **args, int count, lenv *env);
+lval * builtin_load(lval **args, int count, lenv *env);
+lval * builtin_if(lval **args, int count, lenv *env);
 
 /* errors */
 
@@ -146,7 +628,14 @@ void register_builtins(lenv *env);
 #define LERR_BAD_SEXP lval_err("bad S-Expression")
 #define LERR_BAD_TYPE lval_err("bad type")
 #define LERR_EMPTY lval_err("empty")
+#define LERR_RANGE lval_err("index out of range")
+#define LERR_NO_KEY lval_err("key not found")
+#define LERR_BAD_KEY lval_err("bad key")
+#define LERR_LENGTH lval_err("length mismatch")
 #define LERR_UNBOUND lval_err("unbound symbol")
 #define LERR_OVERFLOW lval_err("overflow")
+#define LERR_NOT_COMPILED lval_err("not compiled")
+#define LERR_DEPTH lval_err("stack depth exceeded")
+#define LERR_NOT_JITTABLE lval_err("not jittable")
 
 #endif /* OWNLISP_H */
@@ -0,0 +1,539 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "ownlisp.h"
+
+/* Parallel list functions.
+ *
+ * pmap, pfilter and preduce cut their list into one chunk per worker of a
+ * fixed pool of threads, OWNLISP_THREADS of them (one per processor by
+ * default), and wait for every chunk before putting the results together
+ * in order. Values are not shared between threads: a worker runs its
+ * chunk on copies of the function and of the elements, in a copy of the
+ * environment of the call. Environments are copied lazily, a copy only
+ * gets a binding of the environment it comes from (its origin) when the
+ * worker first looks the symbol up, so big lists bound somewhere along
+ * the way are not copied for nothing. Lambdas are compiled again; partial
+ * applications run in the tree walker.
+ *
+ * What a worker defines stays in its copies, lambdas it builds keep the
+ * copies of the bindings they used, and the functions of different chunks
+ * run at the same time, so their side effects interleave. Results do not
+ * depend on the threads: the value of a chunk is what the sequential
+ * builtin gives for it, the first chunk in order that fails gives the
+ * error and preduce folds the values of the chunks from the left starting
+ * from its initial value, which is right as long as the function is
+ * associative.
+ *
+ * Once all chunks are done the caller adopts what the workers allocated
+ * (gc_adopt) and detaches the environment copies still in use from their
+ * origins; the workers take back the objects the caller freed for them
+ * (pool_take). Lists of fewer than PAR_MIN elements per thread, calls
+ * made from a worker and OWNLISP_THREADS=1 use the sequential builtins. */
+
+/* elements a task needs to make up for waking a worker and copying its
+ * share of the values when the function is cheap */
+#define PAR_MIN 1024
+#define PAR_MAX 64
+/* C stack of a worker */
+#define PAR_STACK (8L << 20)
+#define PAR_HASH(p) ((((uintptr_t)(p)) >> 4) * 2654435761U)
+
+typedef struct {
+    int kind;
+    lval *fn;
+    lenv *env;
+    lval **cell;
+    int count;
+    lval *result;
+    /* copies of environments still in use when the task ended, which the
+     * caller detaches from their origin */
+    lenv **envs;
+    int nenvs;
+} par_task;
+
+/* the copies of one task, by original */
+typedef struct {
+    void **from;
+    void **to;
+    char *is_env;
+    int count;
+    int cap;
+    /* lambdas copied but not compiled yet */
+    lambda **funs;
+    int nfuns;
+    int funs_cap;
+} par_memo;
+
+int par_threads = 1;
+
+static __thread int par_worker = 0;
+static __thread par_memo *par_current = NULL;
+
+static pthread_mutex_t par_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t par_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t par_done = PTHREAD_COND_INITIALIZER;
+static int par_started = 0;
+static par_task *par_tasks;
+static int par_ntasks = 0;
+static int par_next = 0;
+static int par_pending = 0;
+/* the node list of each worker and the pools of the caller */
+static gchead *par_heaps[PAR_MAX];
+static pool *par_home[POOL_COUNT];
+
+void par_init(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    char *s = getenv("OWNLISP_THREADS");
+    if (s) n = strtol(s, NULL, 10);
+    if (n < 1) n = 1;
+    if (n > PAR_MAX) n = PAR_MAX;
+    par_threads = n;
+}
+
+/* memo */
+
+static void * par_memo_get(par_memo *this, void *from) {
+    int i;
+    if (!this->cap) return NULL;
+    i = PAR_HASH(from) & (this->cap - 1);
+    while (this->from[i]) {
+        if (this->from[i] == from) return this->to[i];
+        i = (i + 1) & (this->cap - 1);
+    }
+    return NULL;
+}
+
+static void par_memo_insert(par_memo *this, void *from, void *to, int env) {
+    int i = PAR_HASH(from) & (this->cap - 1);
+    while (this->from[i]) i = (i + 1) & (this->cap - 1);
+    this->from[i] = from;
+    this->to[i] = to;
+    this->is_env[i] = env;
+    this->count++;
+}
+
+/* remembers to as the copy of from, holding a reference on it so it stays
+ * valid for the whole task */
+static void par_memo_put(par_memo *this, void *from, void *to, int env) {
+    int i;
+    int cap = this->cap;
+    void **f = this->from;
+    void **t = this->to;
+    char *e = this->is_env;
+
+    if (2 * (this->count + 1) > cap) {
+        this->cap = cap ? cap * 2 : 64;
+        this->from = calloc(this->cap, sizeof(void*));
+        this->to = malloc(sizeof(void*) * this->cap);
+        this->is_env = malloc(this->cap);
+        this->count = 0;
+        for (i = 0; i < cap; ++i) {
+            if (f[i]) par_memo_insert(this, f[i], t[i], e[i]);
+        }
+        free(f);
+        free(t);
+        free(e);
+    }
+    if (env) lenv_ref(to);
+    else lval_ref(to);
+    par_memo_insert(this, from, to, env);
+}
+
+/* drops the copies, handing those of environments still in use to t */
+static void par_memo_del(par_memo *this, par_task *t) {
+    int i;
+    lenv *e;
+
+    t->envs = malloc(sizeof(lenv*) * (this->count ? this->count : 1));
+    t->nenvs = 0;
+    for (i = 0; i < this->cap; ++i) {
+        if (!this->from[i]) continue;
+        e = this->to[i];
+        if (!this->is_env[i]) lval_del(this->to[i]);
+        else if (e->origin && e->refs > 1) t->envs[t->nenvs++] = e;
+        else lenv_del(e);
+    }
+    free(this->from);
+    free(this->to);
+    free(this->is_env);
+    free(this->funs);
+}
+
+/* copying */
+
+static lval * par_copy_val(par_memo *this, lval *v);
+
+/* a copy of e getting its bindings lazily */
+static lenv * par_copy_env(par_memo *this, lenv *e) {
+    lenv *r = par_memo_get(this, e);
+    if (r) return lenv_ref(r);
+
+    r = lenv_new();
+    r->scope = e->scope;
+    r->origin = e;
+    par_memo_put(this, e, r, 1);
+    if (e->parent) r->parent = par_copy_env(this, e->parent);
+    return r;
+}
+
+/* a copy of the environment of a lambda, with its bindings in the same
+ * slots */
+static lenv * par_copy_lambda_env(par_memo *this, lenv *e) {
+    int i;
+    lenv *r = par_memo_get(this, e);
+    if (r) return lenv_ref(r);
+
+    r = lenv_new();
+    r->scope = e->scope;
+    par_memo_put(this, e, r, 1);
+    if (e->parent) r->parent = par_copy_env(this, e->parent);
+    for (i = 0; i < e->count; ++i) {
+        lenv_set(r, e->syms[i], par_copy_val(this, e->vals[i]));
+    }
+    r->fixed = e->fixed;
+    return r;
+}
+
+static lval * par_copy_lambda(par_memo *this, lval *v) {
+    lambda *f = lambda_new();
+    lval *r = lval_lambda(f);
+
+    par_memo_put(this, v, r, 0);
+    f->env = par_copy_lambda_env(this, v->fun->env);
+    f->args = par_copy_val(this, v->fun->args);
+    f->body = par_copy_val(this, v->fun->body);
+
+    /* partial applications share the code of the full lambda */
+    if (v->fun->code && !v->fun->env->count) {
+        if (this->nfuns == this->funs_cap) {
+            this->funs_cap = this->funs_cap ? this->funs_cap * 2 : 16;
+            this->funs = realloc(this->funs, sizeof(lambda*) * this->funs_cap);
+        }
+        this->funs[this->nfuns++] = f;
+    }
+    return r;
+}
+
+static lval * par_copy_vector(par_memo *this, lval *v) {
+    int i;
+    int n = VECTOR_COUNT(v->vec);
+    lval **cells = malloc(sizeof(lval*) * (n ? n : 1));
+    lval *r;
+
+    vector_cells(v->vec, cells);
+    for (i = 0; i < n; ++i) cells[i] = par_copy_val(this, cells[i]);
+    r = lval_vector(vector_from(cells, n));
+    for (i = 0; i < n; ++i) lval_del(cells[i]);
+    free(cells);
+    return r;
+}
+
+static lval * par_copy_map(par_memo *this, lval *v) {
+    int i;
+    int n = MAP_COUNT(v->map);
+    unsigned long h;
+    lval *k;
+    lval **keys = malloc(sizeof(lval*) * (n ? n : 1));
+    lval **vals = malloc(sizeof(lval*) * (n ? n : 1));
+    mnode *m = NULL;
+
+    n = map_entries(v->map, keys, vals);
+    for (i = 0; i < n; ++i) {
+        k = par_copy_val(this, keys[i]);
+        map_hash(k, &h);
+        m = map_put(m, k, par_copy_val(this, vals[i]), h);
+    }
+    free(keys);
+    free(vals);
+    return lval_map(m);
+}
+
+static lval * par_copy_val(par_memo *this, lval *v) {
+    int i;
+    lval *x;
+    lval *r;
+    seq *s;
+    expr *e;
+
+    switch (v->type) {
+        case LVAL_NUM:
+            return lval_num(v->num);
+        case LVAL_BOOLEAN:
+            return lval_boolean(v->boolean);
+        case LVAL_SYM:
+            r = lval_copy(v);
+            r->sym_scope = 0;
+            return r;
+        case LVAL_ERR:
+        case LVAL_STR:
+        case LVAL_BUILTIN:
+        case LVAL_I64ARRAY:
+            return lval_copy(v);
+    }
+
+    r = par_memo_get(this, v);
+    if (r) return lval_ref(r);
+
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (!v->expr->count && v->type == LVAL_QEXPR) return lval_nil();
+            e = expr_new(v->expr->count);
+            e->count = 0;
+            r = lval_sexpr();
+            r->type = v->type;
+            expr_del(r->expr);
+            r->expr = e;
+            par_memo_put(this, v, r, 0);
+            for (i = 0; i < v->expr->count; ++i) {
+                x = par_copy_val(this, v->expr->cell[i]);
+                e->cell[e->count++] = x;
+            }
+            return r;
+        case LVAL_LAMBDA:
+            return par_copy_lambda(this, v);
+        case LVAL_VECTOR:
+            r = par_copy_vector(this, v);
+        break;
+        case LVAL_MAP:
+            r = par_copy_map(this, v);
+        break;
+        case LVAL_SEQ:
+            s = seq_new(v->seq->kind);
+            s->from = v->seq->from;
+            s->step = v->seq->step;
+            s->count = v->seq->count;
+            r = lval_seq(s);
+            par_memo_put(this, v, r, 0);
+            if (v->seq->fn) s->fn = par_copy_val(this, v->seq->fn);
+            if (v->seq->env) s->env = par_copy_env(this, v->seq->env);
+            if (v->seq->src) s->src = par_copy_val(this, v->seq->src);
+            return r;
+        case LVAL_DELAY:
+            r = lval_delay(NULL, NULL);
+            par_memo_put(this, v, r, 0);
+            if (v->delay_body) {
+                r->delay_body = par_copy_val(this, v->delay_body);
+            }
+            if (v->delay_env) {
+                r->delay_env = par_copy_env(this, v->delay_env);
+            }
+            if (v->delay_value) {
+                r->delay_value = par_copy_val(this, v->delay_value);
+            }
+            return r;
+        default:
+            assert(0);
+            return NULL;
+    }
+    par_memo_put(this, v, r, 0);
+    return r;
+}
+
+/* compiles the lambdas copied so far, which can copy more */
+static void par_compile(par_memo *this) {
+    lambda *f;
+    while (this->nfuns) {
+        f = this->funs[--this->nfuns];
+        lambda_resolve(f);
+        f->code = compile_lambda(f);
+    }
+}
+
+/* A copy of v, a value of the thread waiting for the calling worker, for
+ * the task the worker runs. */
+lval * par_copy(lval *v) {
+    lval *r = par_copy_val(par_current, v);
+    par_compile(par_current);
+    return r;
+}
+
+/* workers */
+
+static void par_run(par_task *t) {
+    int i;
+    int n = 2;
+    par_memo m;
+    lenv *env;
+    lval *l;
+    lval *argv[3];
+    expr *e;
+
+    memset(&m, 0, sizeof(par_memo));
+    par_current = &m;
+
+    env = par_copy_env(&m, t->env);
+    argv[0] = par_copy_val(&m, t->fn);
+    e = expr_new(t->count);
+    for (i = 0; i < t->count; ++i) e->cell[i] = par_copy_val(&m, t->cell[i]);
+    l = lval_qexpr();
+    expr_del(l->expr);
+    l->expr = e;
+    par_compile(&m);
+
+    if (t->kind == PAR_REDUCE) {
+        /* the first element starts the fold of the others */
+        argv[1] = lval_eval(lval_ref(e->cell[0]), env);
+        lval_del(expr_pop(e, 0));
+        argv[2] = l;
+        n = 3;
+    }
+    else argv[1] = l;
+
+    if (t->kind == PAR_MAP) t->result = builtin_map(argv, n, env);
+    else if (t->kind == PAR_FILTER) t->result = builtin_filter(argv, n, env);
+    else if (argv[1]->type == LVAL_ERR) t->result = lval_ref(argv[1]);
+    else t->result = builtin_foldl(argv, n, env);
+
+    args_release(argv, n);
+    lenv_del(env);
+    par_memo_del(&m, t);
+    par_current = NULL;
+}
+
+static void * par_main(void *arg) {
+    char base;
+    par_task *t;
+
+    vm_thread_init(&base, PAR_STACK);
+    lenv_bump();
+    par_worker = 1;
+
+    pthread_mutex_lock(&par_lock);
+    par_heaps[(intptr_t)arg] = gc_heap();
+    for (;;) {
+        while (par_next == par_ntasks) pthread_cond_wait(&par_work, &par_lock);
+        t = &par_tasks[par_next++];
+        pool_take(par_home, par_ntasks - par_next + 1);
+        pthread_mutex_unlock(&par_lock);
+
+        par_run(t);
+
+        pthread_mutex_lock(&par_lock);
+        if (--par_pending == 0) pthread_cond_signal(&par_done);
+    }
+    return NULL;
+}
+
+/* starts the workers, falling back to fewer if threads cannot be made */
+static void par_start(void) {
+    intptr_t i;
+    pthread_t t;
+    pthread_attr_t attr;
+
+    par_started = 1;
+    pool_all(par_home);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PAR_STACK);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < par_threads; ++i) {
+        if (pthread_create(&t, &attr, par_main, (void *)i)) break;
+    }
+    pthread_attr_destroy(&attr);
+    par_threads = i;
+}
+
+/* the values of the tasks put together in order, consumed */
+static lval * par_gather(
+    int kind, lval *fn, lval *z, par_task *tasks, int n, lenv *env
+) {
+    int i;
+    int j;
+    int total = 0;
+    lval *r = NULL;
+    expr *e;
+    expr *args;
+
+    for (i = 0; i < n && !r; ++i) {
+        if (tasks[i].result->type == LVAL_ERR) r = lval_ref(tasks[i].result);
+        else if (kind != PAR_REDUCE) total += tasks[i].result->expr->count;
+    }
+
+    if (!r && kind == PAR_REDUCE) {
+        r = lval_ref(z);
+        for (i = 0; i < n && r->type != LVAL_ERR; ++i) {
+            args = expr_new(2);
+            args->cell[0] = r;
+            args->cell[1] = lval_ref(tasks[i].result);
+            r = lval_call(lval_ref(fn), args, env);
+            expr_del(args);
+        }
+    }
+    else if (!r && !total) r = lval_nil();
+    else if (!r) {
+        e = expr_new(total);
+        e->count = 0;
+        for (i = 0; i < n; ++i) {
+            for (j = 0; j < tasks[i].result->expr->count; ++j) {
+                e->cell[e->count++] = lval_ref(tasks[i].result->expr->cell[j]);
+            }
+        }
+        r = lval_qexpr();
+        expr_del(r->expr);
+        r->expr = e;
+    }
+
+    for (i = 0; i < n; ++i) lval_del(tasks[i].result);
+    return r;
+}
+
+/* fn over the elements of l in parallel, like the sequential builtin of
+ * kind would, z being the initial value of preduce. NULL when l is better
+ * left to the sequential builtin. */
+lval * par_list(int kind, lval *fn, lval *z, expr *l, lenv *env) {
+    int i;
+    int j;
+    int n;
+    int from = 0;
+    lval *r;
+    par_task *tasks;
+
+    if (par_worker || par_threads < 2) return NULL;
+    n = l->count / PAR_MIN;
+    if (n > par_threads) n = par_threads;
+    if (n < 2) return NULL;
+
+    tasks = malloc(sizeof(par_task) * n);
+    for (i = 0; i < n; ++i) {
+        tasks[i].kind = kind;
+        tasks[i].fn = fn;
+        tasks[i].env = env;
+        tasks[i].cell = l->cell + from;
+        tasks[i].count = l->count / n + (i < l->count % n);
+        tasks[i].result = NULL;
+        from += tasks[i].count;
+    }
+
+    pthread_mutex_lock(&par_lock);
+    if (!par_started) par_start();
+    if (par_threads < 2) {
+        pthread_mutex_unlock(&par_lock);
+        free(tasks);
+        return NULL;
+    }
+    par_tasks = tasks;
+    par_ntasks = n;
+    par_next = 0;
+    par_pending = n;
+    pthread_cond_broadcast(&par_work);
+    while (par_pending) pthread_cond_wait(&par_done, &par_lock);
+    par_ntasks = par_next = 0;
+    for (i = 0; i < PAR_MAX; ++i) {
+        if (par_heaps[i]) gc_adopt(par_heaps[i]);
+    }
+    pthread_mutex_unlock(&par_lock);
+
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < tasks[i].nenvs; ++j) {
+            lenv_detach(tasks[i].envs[j]);
+            lenv_del(tasks[i].envs[j]);
+        }
+        free(tasks[i].envs);
+    }
+
+    r = par_gather(kind, fn, z, tasks, n, env);
+    free(tasks);
+    return r;
+}
@@ -0,0 +1,162 @@
+#include "ownlisp.h"
+
+/* Free-list allocator for the interpreter's small fixed-size nodes.
+ *
+ * Objects are carved out of pages of POOL_PAGE objects and recycled through
+ * a per-pool free list threaded through the objects themselves. Pages are
+ * never given back to the system. Each thread has its own pools; an object
+ * freed by another thread than the one that allocated it joins the free
+ * list of the thread freeing it, until pool_take hands it back. Building
+ * with -DPOOL_DISABLE forwards everything to malloc/free, which is useful
+ * under a memory checker. */
+
+#define POOL_PAGE 256
+#define POOL_INIT(name, sz) { (name), (sz), NULL, NULL, 0, 0, 0, 0, 0 }
+
+__thread pool lval_pool = POOL_INIT("lval", sizeof(lval));
+__thread pool expr_pool = POOL_INIT("expr", sizeof(expr));
+__thread pool lambda_pool = POOL_INIT("lambda", sizeof(lambda));
+__thread pool lenv_pool = POOL_INIT("lenv", sizeof(lenv));
+__thread pool chunk_pool = POOL_INIT("chunk", sizeof(chunk));
+
+/* cell arrays, by capacity: 1, 2, 4, ... CELLS_MAX cells */
+__thread pool cells_pools[CELLS_CLASSES] = {
+    POOL_INIT("cells1", sizeof(lval*) << 0),
+    POOL_INIT("cells2", sizeof(lval*) << 1),
+    POOL_INIT("cells4", sizeof(lval*) << 2),
+    POOL_INIT("cells8", sizeof(lval*) << 3),
+    POOL_INIT("cells16", sizeof(lval*) << 4),
+    POOL_INIT("cells32", sizeof(lval*) << 5),
+    POOL_INIT("cells64", sizeof(lval*) << 6)
+};
+
+void * pool_alloc(pool *this) {
+#ifdef POOL_DISABLE
+    this->misses++;
+    return malloc(this->size);
+#else
+    void *r;
+
+    if (this->free) {
+        r = this->free;
+        this->free = *(void **)r;
+        this->nfree--;
+        this->hits++;
+        return r;
+    }
+
+    this->misses++;
+    if (!this->left) {
+        this->page = malloc(this->size * POOL_PAGE);
+        this->left = POOL_PAGE;
+    }
+    r = this->page;
+    this->page += this->size;
+    this->left--;
+    return r;
+#endif
+}
+
+void pool_free(pool *this, void *p) {
+#ifdef POOL_DISABLE
+    free(p);
+#else
+    *(void **)p = this->free;
+    this->free = p;
+    this->nfree++;
+#endif
+}
+
+/* cell arrays hold count cells in the smallest class that fits, so they
+ * only move when the count crosses a power of two */
+
+static int cells_class(int n) {
+    int c = 0;
+    while ((1 << c) < n) c++;
+    return c;
+}
+
+lval ** cells_alloc(int n) {
+    int c;
+    if (n == 0) return NULL;
+    c = cells_class(n);
+    if (c >= CELLS_CLASSES) return malloc(sizeof(lval*) << c);
+    return pool_alloc(&cells_pools[c]);
+}
+
+void cells_free(lval **cell, int n) {
+    int c;
+    if (!cell) return;
+    c = cells_class(n);
+    if (c >= CELLS_CLASSES) free(cell);
+    else pool_free(&cells_pools[c], cell);
+}
+
+lval ** cells_resize(lval **cell, int from, int to) {
+    lval **r;
+    int c_from = cells_class(from);
+    int c_to = cells_class(to);
+
+    if (cell && to && c_from == c_to) return cell;
+    if (c_from >= CELLS_CLASSES && c_to >= CELLS_CLASSES) {
+        return realloc(cell, sizeof(lval*) << c_to);
+    }
+
+    r = cells_alloc(to);
+    if (cell && r) memcpy(r, cell, sizeof(lval*) * (from < to ? from : to));
+    cells_free(cell, from);
+    return r;
+}
+
+/* the POOL_COUNT pools of the calling thread */
+void pool_all(pool **out) {
+    int i;
+    out[0] = &lval_pool;
+    out[1] = &expr_pool;
+    out[2] = &lambda_pool;
+    out[3] = &lenv_pool;
+    out[4] = &chunk_pool;
+    for (i = 0; i < CELLS_CLASSES; ++i) out[5 + i] = &cells_pools[i];
+}
+
+/* Moves free objects of the pools from, another thread's pools as given
+ * by pool_all, to the calling thread's: an nth of them at most, and about
+ * as many as the calling thread allocated since it last took some. The
+ * other thread must not run meanwhile. Threads freeing what others
+ * allocate hand the objects back this way. */
+void pool_take(pool **from, int n) {
+    int i;
+    long j;
+    long k;
+    void *first;
+    void *last;
+    pool *to[POOL_COUNT];
+
+    pool_all(to);
+    for (i = 0; i < POOL_COUNT; ++i) {
+        k = to[i]->hits + to[i]->misses - to[i]->taken + POOL_PAGE;
+        to[i]->taken = to[i]->hits + to[i]->misses;
+        if (k > from[i]->nfree / n) k = from[i]->nfree / n;
+        if (!k || from[i] == to[i]) continue;
+
+        first = last = from[i]->free;
+        for (j = 1; j < k; ++j) last = *(void **)last;
+        from[i]->free = *(void **)last;
+        from[i]->nfree -= k;
+
+        *(void **)last = to[i]->free;
+        to[i]->free = first;
+        to[i]->nfree += k;
+    }
+}
+
+void pool_print_stats(void) {
+    int i;
+    pool *all[POOL_COUNT];
+
+    pool_all(all);
+    for (i = 0; i < POOL_COUNT; ++i) {
+        printf("%-8s hits %ld misses %ld\n",
+            all[i]->name, all[i]->hits, all[i]->misses);
+    }
+}
@@ -8,28 +8,16 @@ int main(int argc, char** argv) {
     mpc_result_t mpc_result;
     lval *result;
 
-    mpc_parser_t *Number = mpc_new("number");
-    mpc_parser_t *Symbol = mpc_new("symbol");
-    mpc_parser_t *String = mpc_new("string");
-    mpc_parser_t *Comment = mpc_new("comment");
-    mpc_parser_t *Sexpr = mpc_new("sexpr");
-    mpc_parser_t *Qexpr = mpc_new("qexpr");
-    mpc_parser_t *Expr = mpc_new("expr");
-    Lispy = mpc_new("lispy");
-
-    mpca_lang(
-        MPC_LANG_DEFAULT,
-        "number   :  /-?[0-9]+/ ;"
-        "symbol   :  /[a-zA-Z0-9_+\\-*\\/\%\\\\=<>!&|]+/ ;"
-        "string   :  /\"(\\\\.|[^\"])*\"/ ;"
-        "comment  :  /;[^\\r\\n]*/ ;"
-        "sexpr    :  '(' <expr>* ')' ;"
-        "qexpr    :  '{' <expr>* '}' ;"
-        "expr     :  <number> | <symbol> | <string>"
-        "         |  <comment> | <sexpr> | <qexpr> ;"
-        "lispy    :  /^/ <expr>* /$/ ;",
-        Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy
-    );
+    ast_init();
+    gc_init();
+    vm_init();
+    jit_init();
+    array_init();
+    fuse_init();
+    par_init();
+    aot_init();
+    lval_init();
+    aot_modules();
 
     lenv *env = lenv_new();
     register_builtins(env);
@@ -67,7 +55,8 @@ int main(int argc, char** argv) {
     }
 
     lenv_del(env);
-    mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    gc_collect();
+    ast_cleanup();
 
     return 0;
 }
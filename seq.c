@@ -0,0 +1,181 @@
+#include "ownlisp.h"
+
+/* Lazy sequences and delays.
+ *
+ * A sequence is a recipe rather than a list: a range of numbers, or a map,
+ * filter or take over another sequence or a Q-Expression. Consuming it
+ * (realize, len, foldl, printing) runs the recipe through a chain of
+ * iterators, one per stage, that pull one element at a time, so nothing
+ * but the element in flight is ever held. Nothing is cached either: a
+ * sequence consumed twice calls its functions twice. Map and filter keep
+ * the environment they were built in to call their function and, like
+ * fst, to evaluate the elements they get from a Q-Expression.
+ *
+ * A delay holds a Q-Expression and the environment it was written in;
+ * the first force evaluates it and keeps the result, letting go of the
+ * environment. */
+
+struct seq_iter {
+    /* the sequence or Q-Expression read, borrowed */
+    lval *src;
+    long i;
+    /* the iterator over src's own source */
+    seq_iter *inner;
+};
+
+seq * seq_new(int kind) {
+    seq *r = malloc(sizeof(seq));
+    r->kind = kind;
+    r->from = 0;
+    r->step = 1;
+    r->count = 0;
+    r->fn = NULL;
+    r->env = NULL;
+    r->src = NULL;
+    return r;
+}
+
+void seq_del(seq *this) {
+    if (this->fn) lval_del(this->fn);
+    if (this->env) lenv_del(this->env);
+    if (this->src) lval_del(this->src);
+    free(this);
+}
+
+seq * seq_copy(seq *this) {
+    seq *r = seq_new(this->kind);
+    r->from = this->from;
+    r->step = this->step;
+    r->count = this->count;
+    r->fn = this->fn ? lval_ref(this->fn) : NULL;
+    r->env = this->env ? lenv_ref(this->env) : NULL;
+    r->src = this->src ? lval_ref(this->src) : NULL;
+    return r;
+}
+
+seq_iter * seq_iter_new(lval *src) {
+    seq_iter *r = malloc(sizeof(seq_iter));
+    r->src = src;
+    r->i = 0;
+    r->inner = NULL;
+    if (src->type == LVAL_SEQ && src->seq->src) {
+        r->inner = seq_iter_new(src->seq->src);
+    }
+    return r;
+}
+
+void seq_iter_del(seq_iter *this) {
+    if (this->inner) seq_iter_del(this->inner);
+    free(this);
+}
+
+/* the function of this applied to x, consumed */
+static lval * seq_call(seq *this, lval *x) {
+    lval *r;
+    expr *args;
+
+    x = lval_eval(x, this->env);
+    if (x->type == LVAL_ERR) return x;
+
+    args = expr_new(1);
+    args->cell[0] = x;
+    r = lval_call(lval_ref(this->fn), args, this->env);
+    expr_del(args);
+    return r;
+}
+
+/* Returns 1 with the next element in *out, 0 at the end, or -1 with an
+ * error in *out. */
+int seq_next(seq_iter *this, lval **out) {
+    int n;
+    lval *r;
+    seq *s;
+
+    if (this->src->type == LVAL_QEXPR) {
+        if (this->i >= this->src->expr->count) return 0;
+        *out = lval_ref(this->src->expr->cell[this->i++]);
+        return 1;
+    }
+
+    s = this->src->seq;
+    switch (s->kind) {
+        case SEQ_RANGE:
+            if (this->i >= s->count) return 0;
+            *out = lval_num(s->from + (unsigned long)this->i++ * s->step);
+            return 1;
+        case SEQ_TAKE:
+            if (this->i >= s->count) return 0;
+            n = seq_next(this->inner, out);
+            if (n > 0) this->i++;
+            return n;
+        case SEQ_MAP:
+            n = seq_next(this->inner, out);
+            if (n <= 0) return n;
+            *out = seq_call(s, *out);
+            return (*out)->type == LVAL_ERR ? -1 : 1;
+        case SEQ_FILTER:
+            while ((n = seq_next(this->inner, out)) > 0) {
+                r = seq_call(s, lval_ref(*out));
+                if (r->type == LVAL_BOOLEAN && r->boolean) {
+                    lval_del(r);
+                    return 1;
+                }
+                lval_del(*out);
+                if (r->type == LVAL_BOOLEAN) {
+                    lval_del(r);
+                    continue;
+                }
+                if (r->type != LVAL_ERR) {
+                    lval_del(r);
+                    r = LERR_BAD_TYPE;
+                }
+                *out = r;
+                return -1;
+            }
+            return n;
+    }
+    return 0;
+}
+
+void seq_print(lval *this) {
+    int n;
+    int first = 1;
+    lval *x;
+    seq_iter *it = seq_iter_new(this);
+
+    printf("#lazy{");
+    while ((n = seq_next(it, &x)) != 0) {
+        if (!first) putchar(' ');
+        first = 0;
+        lval_print(x);
+        lval_del(x);
+        if (n < 0) break;
+    }
+    putchar('}');
+    seq_iter_del(it);
+}
+
+/* the value of the delay this, evaluated on the first call */
+lval * delay_force(lval *this) {
+    lval *r;
+    lval *body;
+    lenv *env;
+
+    if (this->delay_value) return lval_ref(this->delay_value);
+
+    body = lval_ref(this->delay_body);
+    env = lenv_ref(this->delay_env);
+    r = expr_eval(body->expr, env);
+
+    /* errors are not kept, forcing again tries again */
+    if (r->type != LVAL_ERR && !this->delay_value) {
+        this->delay_value = lval_ref(r);
+        lval_del(this->delay_body);
+        this->delay_body = NULL;
+        lenv_del(this->delay_env);
+        this->delay_env = NULL;
+    }
+    lval_del(body);
+    lenv_del(env);
+    return r;
+}
@@ -0,0 +1,69 @@
+#include <pthread.h>
+
+#include "ownlisp.h"
+
+/* Symbol intern table: every symbol name is stored once, so symbols (and
+ * lenv keys) compare by pointer. Interned names live until exit. The table
+ * is shared by all threads. */
+
+char *sym_amp;
+
+static char **sym_table = NULL;
+static int sym_cap = 0;
+static int sym_count = 0;
+static pthread_mutex_t sym_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long sym_hash(char *s) {
+    unsigned long h = 14695981039346656037UL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static void sym_grow(void) {
+    int i;
+    int j;
+    char **old = sym_table;
+    int old_cap = sym_cap;
+
+    sym_cap = sym_cap ? sym_cap * 2 : 256;
+    sym_table = calloc(sym_cap, sizeof(char*));
+    for (i = 0; i < old_cap; ++i) {
+        if (!old[i]) continue;
+        j = sym_hash(old[i]) & (sym_cap - 1);
+        while (sym_table[j]) j = (j + 1) & (sym_cap - 1);
+        sym_table[j] = old[i];
+    }
+    free(old);
+}
+
+char * sym_intern(char *name) {
+    int i;
+    ssize_t sz;
+    char *r;
+
+    pthread_mutex_lock(&sym_lock);
+    if (2 * (sym_count + 1) > sym_cap) sym_grow();
+
+    i = sym_hash(name) & (sym_cap - 1);
+    while (sym_table[i]) {
+        if (!strcmp(sym_table[i], name)) break;
+        i = (i + 1) & (sym_cap - 1);
+    }
+
+    if (!sym_table[i]) {
+        sz = strlen(name) + 1;
+        sym_table[i] = malloc(sz);
+        memcpy(sym_table[i], name, sz);
+        sym_count++;
+    }
+    r = sym_table[i];
+    pthread_mutex_unlock(&sym_lock);
+    return r;
+}
+
+void sym_init(void) {
+    sym_amp = sym_intern("&");
+}
@@ -0,0 +1,27 @@
+#!/usr/bin/env bash
+# runs each test in every mode and checks that all of them print what
+# tests/<name>.out holds: ./tests/run.sh [prompt binary]
+# a test starting with a "; modes: ..." line only runs in those
+
+PROMPT=${1:-./prompt}
+DIR=$(dirname "$0")
+MODES="OWNLISP_VM=0 OWNLISP_AOT=0 OWNLISP_VM=1 OWNLISP_JIT=1 OWNLISP_FUSE=0 OWNLISP_THREADS=1"
+# the parallel list functions run on threads even with one processor
+export OWNLISP_THREADS=${OWNLISP_THREADS:-4}
+failed=0
+
+for t in "$DIR"/*.lspy; do
+    modes=$(sed -n '1s/^; modes: //p' "$t")
+    for mode in ${modes:-$MODES}; do
+        if env $mode "$PROMPT" "$t" 2>&1 | diff -u "${t%.lspy}.out" - > /dev/null
+        then
+            printf '%-20s %-17s ok\n' "$(basename "$t")" "$mode"
+        else
+            printf '%-20s %-17s FAILED\n' "$(basename "$t")" "$mode"
+            env $mode "$PROMPT" "$t" 2>&1 | diff -u "${t%.lspy}.out" -
+            failed=1
+        fi
+    done
+done
+
+exit $failed
@@ -0,0 +1,266 @@
+#include "ownlisp.h"
+
+/* Persistent vectors.
+ *
+ * A vector is a height balanced binary tree whose leaves hold up to
+ * VECTOR_LEAF values in order, each node knowing how many values are below
+ * it. Nodes are never modified once built: indexing walks a single path,
+ * and assoc, slice and concat build O(log n) new nodes that share the rest
+ * of the tree with the vectors they came from. The empty vector is NULL.
+ *
+ * Every function consumes the nodes it is given unless it says it borrows
+ * them, and returns a new reference. */
+
+#define VECTOR_LEAF 32
+
+static vnode * vnode_new(int height, int count, int ncells) {
+    vnode *r = malloc(sizeof(vnode) + sizeof(lval*) * ncells);
+    r->refs = 1;
+    r->height = height;
+    r->count = count;
+    r->left = NULL;
+    r->right = NULL;
+    gc_track(&r->gc, GC_VNODE);
+    return r;
+}
+
+vnode * vnode_ref(vnode *this) {
+    if (this) this->refs++;
+    return this;
+}
+
+void vnode_del(vnode *this) {
+    int i;
+
+    if (!this || --this->refs > 0) return;
+    if (this->height) {
+        vnode_del(this->left);
+        vnode_del(this->right);
+    }
+    else {
+        for (i = 0; i < this->count; ++i) lval_del(this->cell[i]);
+    }
+    gc_untrack(&this->gc);
+    free(this);
+}
+
+/* a leaf with references to n cells, borrowed */
+static vnode * vnode_leaf(lval **cell, int n) {
+    int i;
+    vnode *r = vnode_new(0, n, n);
+    for (i = 0; i < n; ++i) r->cell[i] = lval_ref(cell[i]);
+    return r;
+}
+
+static vnode * vnode_node(vnode *l, vnode *r) {
+    int h = l->height > r->height ? l->height : r->height;
+    vnode *x = vnode_new(h + 1, l->count + r->count, 0);
+    x->left = l;
+    x->right = r;
+    return x;
+}
+
+/* the node over l and r, rotated when their heights differ by two */
+static vnode * vnode_balance(vnode *l, vnode *r) {
+    vnode *a;
+    vnode *b;
+    vnode *c;
+    vnode *d;
+
+    if (l->height > r->height + 1) {
+        a = vnode_ref(l->left);
+        b = vnode_ref(l->right);
+        vnode_del(l);
+        if (a->height >= b->height) return vnode_node(a, vnode_node(b, r));
+        c = vnode_ref(b->left);
+        d = vnode_ref(b->right);
+        vnode_del(b);
+        return vnode_node(vnode_node(a, c), vnode_node(d, r));
+    }
+    if (r->height > l->height + 1) {
+        a = vnode_ref(r->left);
+        b = vnode_ref(r->right);
+        vnode_del(r);
+        if (b->height >= a->height) return vnode_node(vnode_node(l, a), b);
+        c = vnode_ref(a->left);
+        d = vnode_ref(a->right);
+        vnode_del(a);
+        return vnode_node(vnode_node(l, c), vnode_node(d, b));
+    }
+    return vnode_node(l, r);
+}
+
+/* drops this once its cells have been copied elsewhere */
+static void vnode_release_cells(vnode *this) {
+    int i;
+
+    if (this->refs == 1) {
+        /* the copies take over the references */
+        this->count = 0;
+    }
+    else {
+        for (i = 0; i < this->count; ++i) lval_ref(this->cell[i]);
+    }
+    vnode_del(this);
+}
+
+/* l followed by r, in O(difference of their heights) */
+static vnode * vnode_join(vnode *l, vnode *r) {
+    vnode *a;
+    vnode *b;
+    vnode *x;
+
+    if (!l) return r;
+    if (!r) return l;
+
+    if (!l->height && !r->height && l->count + r->count <= VECTOR_LEAF) {
+        x = vnode_new(0, l->count + r->count, l->count + r->count);
+        memcpy(x->cell, l->cell, sizeof(lval*) * l->count);
+        memcpy(x->cell + l->count, r->cell, sizeof(lval*) * r->count);
+        vnode_release_cells(l);
+        vnode_release_cells(r);
+        return x;
+    }
+
+    if (l->height > r->height + 1) {
+        a = vnode_ref(l->left);
+        b = vnode_ref(l->right);
+        vnode_del(l);
+        return vnode_balance(a, vnode_join(b, r));
+    }
+    if (r->height > l->height + 1) {
+        a = vnode_ref(r->left);
+        b = vnode_ref(r->right);
+        vnode_del(r);
+        return vnode_balance(vnode_join(l, a), b);
+    }
+    return vnode_node(l, r);
+}
+
+/* the first n values of this, borrowed */
+static vnode * vnode_take(vnode *this, int n) {
+    if (n <= 0) return NULL;
+    if (n >= this->count) return vnode_ref(this);
+    if (!this->height) return vnode_leaf(this->cell, n);
+    if (n <= this->left->count) return vnode_take(this->left, n);
+    return vnode_join(
+        vnode_ref(this->left), vnode_take(this->right, n - this->left->count)
+    );
+}
+
+/* this without its first n values, borrowed */
+static vnode * vnode_drop(vnode *this, int n) {
+    if (n <= 0) return vnode_ref(this);
+    if (n >= this->count) return NULL;
+    if (!this->height) return vnode_leaf(this->cell + n, this->count - n);
+    if (n >= this->left->count) {
+        return vnode_drop(this->right, n - this->left->count);
+    }
+    return vnode_join(vnode_drop(this->left, n), vnode_ref(this->right));
+}
+
+/* a vector of references to n cells, borrowed */
+vnode * vector_from(lval **cell, int n) {
+    int m;
+
+    if (n == 0) return NULL;
+    if (n <= VECTOR_LEAF) return vnode_leaf(cell, n);
+
+    /* half of the leaves on each side */
+    m = (n + VECTOR_LEAF - 1) / VECTOR_LEAF / 2 * VECTOR_LEAF;
+    return vnode_node(vector_from(cell, m), vector_from(cell + m, n - m));
+}
+
+/* the value at i, borrowed from this */
+lval * vector_get(vnode *this, int i) {
+    while (this->height) {
+        if (i < this->left->count) this = this->left;
+        else {
+            i -= this->left->count;
+            this = this->right;
+        }
+    }
+    return this->cell[i];
+}
+
+/* this with x at i, this borrowed */
+vnode * vector_assoc(vnode *this, int i, lval *x) {
+    vnode *r;
+
+    if (!this->height) {
+        r = vnode_leaf(this->cell, this->count);
+        lval_del(r->cell[i]);
+        r->cell[i] = x;
+        return r;
+    }
+    if (i < this->left->count) {
+        return vnode_node(
+            vector_assoc(this->left, i, x), vnode_ref(this->right)
+        );
+    }
+    return vnode_node(
+        vnode_ref(this->left),
+        vector_assoc(this->right, i - this->left->count, x)
+    );
+}
+
+/* the values of this from from to to - 1, this borrowed */
+vnode * vector_slice(vnode *this, int from, int to) {
+    vnode *r;
+
+    if (!this || from >= to) return NULL;
+    r = vnode_take(this, to);
+    this = vnode_drop(r, from);
+    vnode_del(r);
+    return this;
+}
+
+vnode * vector_concat(vnode *x, vnode *y) {
+    return vnode_join(x, y);
+}
+
+/* stores borrowed references to every value of this in out */
+void vector_cells(vnode *this, lval **out) {
+    if (!this) return;
+    if (this->height) {
+        vector_cells(this->left, out);
+        vector_cells(this->right, out + this->left->count);
+        return;
+    }
+    memcpy(out, this->cell, sizeof(lval*) * this->count);
+}
+
+void vector_print(vnode *this) {
+    int i;
+    int n = VECTOR_COUNT(this);
+    lval **cell = malloc(sizeof(lval*) * (n + 1));
+
+    vector_cells(this, cell);
+    putchar('[');
+    for (i = 0; i < n; ++i) {
+        lval_print(cell[i]);
+        if (i != n - 1) putchar(' ');
+    }
+    putchar(']');
+    free(cell);
+}
+
+int vector_eq(vnode *x, vnode *y) {
+    int i;
+    int r = 1;
+    int n = VECTOR_COUNT(x);
+    lval **a;
+    lval **b;
+
+    if (x == y) return 1;
+    if (n != VECTOR_COUNT(y)) return 0;
+
+    a = malloc(sizeof(lval*) * n);
+    b = malloc(sizeof(lval*) * n);
+    vector_cells(x, a);
+    vector_cells(y, b);
+    for (i = 0; i < n && r; ++i) r = lval_eq(a[i], b[i]);
+    free(a);
+    free(b);
+    return r;
+}
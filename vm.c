@@ -0,0 +1,328 @@
+#include <sys/resource.h>
+
+#include "ownlisp.h"
+
+/* Stack machine for compiled lambda bodies, see compile.c.
+ *
+ * Values and call frames live on two heap stacks, so a call from one
+ * compiled lambda to another pushes a frame instead of recursing in C and
+ * evaluation depth is only bounded by vm_max_depth. Every value on the
+ * stack holds a reference. Errors stop execution the way they stop
+ * expr_eval: the frames are dropped and the error returned.
+ *
+ * A tail call replaces the caller's frame, so tail recursive loops run in
+ * constant space apart from their environment.
+ *
+ * Builtins that evaluate code (eval, if when it is not inlined, ...) and
+ * the tree walker still recurse in C; vm_stack_check turns running out of
+ * C stack there into an error. Both stacks and the C stack limits belong
+ * to the thread running. */
+
+typedef struct {
+    code *code;
+    int pc;
+    lenv *env;
+    /* the lambda running, NULL for the frame vm_exec was given; env is
+     * owned by the frame when it is set */
+    lval *self;
+    int base;
+} vm_frame;
+
+int vm_enabled = 1;
+long vm_max_depth = VM_DEFAULT_MAX_DEPTH;
+/* native code bails out below this, see jit.c */
+__thread char *vm_cstack_floor;
+
+static __thread vm_frame *vm_frames = NULL;
+static __thread int vm_fp = 0;
+static __thread int vm_fcap = 0;
+
+static __thread lval **vm_stack = NULL;
+static __thread int vm_sp = 0;
+static __thread int vm_scap = 0;
+
+static __thread char *vm_cstack_base;
+static __thread long vm_cstack_max;
+
+/* Sets the C stack of the calling thread: size bytes from base, the
+ * address of a local of its first function. An eighth is left for
+ * whatever runs between checks. */
+void vm_thread_init(char *base, long size) {
+    vm_cstack_base = base;
+    vm_cstack_max = size - size / 8;
+    vm_cstack_floor = vm_cstack_base - vm_cstack_max;
+}
+
+void vm_init(void) {
+    char base;
+    long size = 8L << 20;
+    struct rlimit rl;
+    char *s = getenv("OWNLISP_VM");
+    if (s) vm_enabled = strtol(s, NULL, 10) != 0;
+    s = getenv("OWNLISP_MAX_DEPTH");
+    if (s) vm_max_depth = strtol(s, NULL, 10);
+
+    if (!getrlimit(RLIMIT_STACK, &rl) && rl.rlim_cur != RLIM_INFINITY) {
+        size = rl.rlim_cur;
+    }
+    vm_thread_init(&base, size);
+}
+
+/* nonzero when native recursion is about to run out of C stack */
+int vm_stack_check(void) {
+    char here;
+    long used = vm_cstack_base - &here;
+    if (used < 0) used = -used;
+    return used > vm_cstack_max;
+}
+
+/* frames on the VM stack */
+int vm_depth(void) {
+    return vm_fp;
+}
+
+/* evaluate form as an S-Expression with the tree walker */
+lval * vm_deopt(lval *form, lenv *env) {
+    return expr_eval(form->expr, env);
+}
+
+/* vm_deopt for a form of the body of fn, inlined with its arguments in
+ * args: they are bound in a frame of fn first */
+static lval * vm_deopt_inline(lval *form, lval *fn, lval **args) {
+    int i;
+    lenv *frame;
+    lval *r;
+    expr *e = expr_new(fn->fun->code->nparams);
+
+    for (i = 0; i < e->count; ++i) e->cell[i] = lval_ref(args[i]);
+    r = lambda_bind(fn->fun, e, &frame);
+    expr_del(e);
+    if (r) return r;
+    r = vm_deopt(form, frame);
+    lenv_del(frame);
+    return r;
+}
+
+static expr * vm_args(lval **cell, int n) {
+    expr *r = expr_new(n);
+    if (n) memcpy(r->cell, cell, sizeof(lval*) * n);
+    return r;
+}
+
+static void vm_reserve(int n) {
+    if (vm_sp + n <= vm_scap) return;
+    while (vm_sp + n > vm_scap) vm_scap = vm_scap ? vm_scap * 2 : 256;
+    vm_stack = realloc(vm_stack, sizeof(lval*) * vm_scap);
+}
+
+/* pushes a frame running this in env, the frame of self if not NULL */
+static lval * vm_enter(code *this, lenv *env, lval *self) {
+    vm_frame *f;
+
+    if (vm_fp >= vm_max_depth) return LERR_DEPTH;
+    if (vm_fp == vm_fcap) {
+        vm_fcap = vm_fcap ? vm_fcap * 2 : 64;
+        vm_frames = realloc(vm_frames, sizeof(vm_frame) * vm_fcap);
+    }
+    vm_reserve(this->depth);
+
+    f = &vm_frames[vm_fp++];
+    f->code = this;
+    f->pc = 0;
+    f->env = env;
+    f->self = self;
+    f->base = vm_sp;
+    return NULL;
+}
+
+static void vm_leave(void) {
+    vm_frame *f = &vm_frames[--vm_fp];
+    while (vm_sp > f->base) lval_del(vm_stack[--vm_sp]);
+    if (f->self) {
+        lval_del(f->self);
+        lenv_del(f->env);
+    }
+}
+
+/* Calls the value n below the top of the stack with the n - 1 above it.
+ * Returns NULL when that is a compiled lambda and its frame was pushed
+ * (or, for a tail call, put in place of the current one), otherwise the
+ * result of the call. */
+static lval * vm_call(int n, int tail) {
+    lval *r;
+    code *c;
+    lenv *frame;
+    lval *fn = vm_stack[vm_sp - n];
+    expr *args;
+
+    if (fn->type == LVAL_BUILTIN && fn->builtin) {
+        /* the builtin may run code that grows vm_stack, so the arguments
+         * move to the C stack */
+        lval *argv[n];
+        memcpy(argv, vm_stack + vm_sp - n + 1, sizeof(lval*) * (n - 1));
+        vm_sp -= n;
+        r = fn->builtin(argv, n - 1, vm_frames[vm_fp - 1].env);
+        args_release(argv, n - 1);
+        lval_del(fn);
+        return r;
+    }
+
+    args = vm_args(vm_stack + vm_sp - n + 1, n - 1);
+    vm_sp -= n;
+
+    if (fn->type != LVAL_LAMBDA || !fn->fun->code) {
+        r = lval_call(fn, args, vm_frames[vm_fp - 1].env);
+        expr_del(args);
+        return r;
+    }
+
+    r = jit_invoke(fn, args);
+    if (r) {
+        lval_del(fn);
+        expr_del(args);
+        return r;
+    }
+
+    r = lambda_bind(fn->fun, args, &frame);
+    expr_del(args);
+    if (r) {
+        lval_del(fn);
+        return r;
+    }
+
+    c = fn->fun->code;
+    if (c->aot) {
+        r = c->aot(frame);
+        lenv_del(frame);
+        lval_del(fn);
+        return r;
+    }
+
+    if (tail) vm_leave();
+    r = vm_enter(code_current(c, frame), frame, fn);
+    if (r) {
+        lenv_del(frame);
+        lval_del(fn);
+    }
+    return r;
+}
+
+lval * vm_exec(code *this, lenv *env) {
+    int entry = vm_fp;
+    int pc;
+    int n;
+    int *ops;
+    lval *v;
+
+    if (vm_stack_check()) return LERR_DEPTH;
+    v = vm_enter(code_current(this, env), env, NULL);
+    if (v) return v;
+
+/* the current frame changes on calls and returns, it keeps pc meanwhile;
+ * calls can also move vm_frames, so frames are only reached through vm_fp */
+#define VM_LOAD()                                                              \
+    do {                                                                       \
+        vm_frame *f = &vm_frames[vm_fp - 1];                                   \
+        this = f->code;                                                        \
+        env = f->env;                                                          \
+        ops = this->ops;                                                       \
+        pc = f->pc;                                                            \
+    } while(0)
+
+#define VM_SAVE() (vm_frames[vm_fp - 1].pc = pc)
+
+    VM_LOAD();
+    for (;;) {
+        switch (ops[pc++]) {
+            case OP_CONST:
+                vm_stack[vm_sp++] = lval_ref(this->consts[ops[pc++]]);
+            break;
+            case OP_LOCAL:
+                vm_stack[vm_sp++] = lval_ref(env->vals[ops[pc++]]);
+            break;
+            case OP_GLOBAL:
+                v = lenv_lookup(env, this->consts[ops[pc++]]);
+                if (v->type == LVAL_ERR) goto error;
+                vm_stack[vm_sp++] = v;
+            break;
+            case OP_SEXPR:
+                vm_stack[vm_sp++] = lval_sexpr();
+            break;
+            case OP_CALL:
+            case OP_TAILCALL:
+                n = ops[pc++];
+                VM_SAVE();
+                v = vm_call(n, ops[pc - 2] == OP_TAILCALL);
+                if (!v) {
+                    VM_LOAD();
+                    break;
+                }
+                if (v->type == LVAL_ERR) goto error;
+                vm_stack[vm_sp++] = v;
+            break;
+            case OP_IF:
+            case OP_GUARD:
+                if (ops[pc - 1] == OP_IF) {
+                    v = lenv_lookup(env, this->consts[ops[pc]]->expr->cell[0]);
+                    n = v->type == LVAL_BUILTIN && v->builtin == builtin_if;
+                    lval_del(v);
+                }
+                else n = code_valid(this, env);
+                if (n) {
+                    pc += 4;
+                    break;
+                }
+                if (ops[pc + 2] >= 0) {
+                    n = vm_frames[vm_fp - 1].base + ops[pc + 3];
+                    v = vm_deopt_inline(
+                        this->consts[ops[pc]], this->consts[ops[pc + 2]],
+                        vm_stack + n
+                    );
+                }
+                else v = vm_deopt(this->consts[ops[pc]], env);
+                if (v->type == LVAL_ERR) goto error;
+                vm_stack[vm_sp++] = v;
+                pc = ops[pc + 1];
+            break;
+            case OP_JUMPF:
+                v = vm_stack[--vm_sp];
+                if (v->type != LVAL_BOOLEAN) {
+                    lval_del(v);
+                    v = LERR_BAD_TYPE;
+                    goto error;
+                }
+                pc = v->boolean ? pc + 1 : ops[pc];
+                lval_del(v);
+            break;
+            case OP_JUMP:
+                pc = ops[pc];
+            break;
+            case OP_STACK:
+                n = vm_frames[vm_fp - 1].base + ops[pc++];
+                vm_stack[vm_sp++] = lval_ref(vm_stack[n]);
+            break;
+            case OP_SLIDE:
+                n = ops[pc++];
+                v = vm_stack[--vm_sp];
+                while (n--) lval_del(vm_stack[--vm_sp]);
+                vm_stack[vm_sp++] = v;
+            break;
+            case OP_RETURN:
+                v = vm_stack[--vm_sp];
+                vm_leave();
+                if (vm_fp == entry) return v;
+                VM_LOAD();
+                vm_stack[vm_sp++] = v;
+            break;
+            default:
+                assert(0);
+        }
+    }
+
+#undef VM_LOAD
+#undef VM_SAVE
+
+error:
+    while (vm_fp > entry) vm_leave();
+    return v;
+}